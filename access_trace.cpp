@@ -0,0 +1,142 @@
+#include "access_trace.h"
+#include "fileop.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+uint32_t AccessTrace::RegisterFile(std::string_view name) {
+    std::lock_guard<std::mutex> guard(mutex);
+    std::string key(name);
+    auto it = name_ids.find(key);
+    if (it != name_ids.end()) return it->second;
+    uint32_t id = (uint32_t)names.size();
+    names.push_back(key);
+    name_ids.emplace(std::move(key), id);
+    return id;
+}
+
+void AccessTrace::Record(char type, uint32_t file, uint64_t offset, uint64_t size) {
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> guard(mutex);
+    events.push_back({ time, file, type, offset, size });
+}
+
+std::vector<AccessTrace::Event> AccessTrace::GetEvents() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return events;
+}
+
+std::vector<std::string> AccessTrace::GetFileNames() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return names;
+}
+
+bool AccessTrace::Save(const std::string& path) {
+    std::lock_guard<std::mutex> guard(mutex);
+    FILE* fp = fileop::fopen(path, "w");
+    if (!fp) {
+        printf("Failed to create %s\n", path.c_str());
+        return false;
+    }
+    fprintf(fp, "%s\n", ACCESS_TRACE_MAGIC);
+    for (size_t i = 0; i < names.size(); i++) {
+        fprintf(fp, "F %zu %s\n", i, names[i].c_str());
+    }
+    for (auto& event : events) {
+        fprintf(fp, "%c %" PRIu64 " %" PRIu32 " %" PRIu64 " %" PRIu64 "\n", event.type, event.time, event.file, event.offset, event.size);
+    }
+    return fclose(fp) == 0;
+}
+
+bool AccessTrace::Load(const std::string& path) {
+    FILE* fp = fileop::fopen(path, "r");
+    if (!fp) {
+        printf("Failed to open %s\n", path.c_str());
+        return false;
+    }
+    std::vector<Event> loaded_events;
+    std::vector<std::string> loaded_names;
+    std::string line;
+    bool ok = true;
+    bool first = true;
+    char buffer[4096];
+    while (ok && fgets(buffer, sizeof(buffer), fp)) {
+        line += buffer;
+        // Names may be longer than the buffer
+        if (line.back() != '\n' && !feof(fp)) continue;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+        if (first) {
+            ok = line == ACCESS_TRACE_MAGIC;
+            first = false;
+        } else if (line.size() > 2 && line[0] == 'F' && line[1] == ' ') {
+            size_t id = 0;
+            int consumed = 0;
+            ok = sscanf(line.c_str() + 2, "%zu %n", &id, &consumed) >= 1 && id == loaded_names.size();
+            if (ok) loaded_names.push_back(line.substr(2 + consumed));
+        } else if (!line.empty()) {
+            Event event;
+            ok = sscanf(line.c_str(), "%c %" SCNu64 " %" SCNu32 " %" SCNu64 " %" SCNu64, &event.type, &event.time, &event.file, &event.offset, &event.size) == 5;
+            ok = ok && event.file < loaded_names.size();
+            if (ok) loaded_events.push_back(event);
+        }
+        line.clear();
+    }
+    fclose(fp);
+    if (!ok || first) {
+        printf("Invalid access trace %s\n", path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(mutex);
+    events = std::move(loaded_events);
+    names = std::move(loaded_names);
+    name_ids.clear();
+    for (size_t i = 0; i < names.size(); i++) {
+        name_ids.emplace(names[i], (uint32_t)i);
+    }
+    return true;
+}
+
+std::vector<size_t> plan_layout(AccessTrace& trace, const std::vector<std::string>& names) {
+    auto events = trace.GetEvents();
+    auto trace_names = trace.GetFileNames();
+    std::stable_sort(events.begin(), events.end(), [](const AccessTrace::Event& a, const AccessTrace::Event& b) { return a.time < b.time; });
+    std::unordered_map<std::string_view, size_t> indexes;
+    for (size_t i = 0; i < names.size(); i++) {
+        // The last of duplicated names wins, like PathIndex
+        indexes[names[i]] = i;
+    }
+    struct Usage {
+        size_t first = SIZE_MAX; // order of first use
+        size_t bursts = 0;
+        size_t last_burst = SIZE_MAX;
+    };
+    std::vector<Usage> usage(names.size());
+    size_t burst = 0;
+    size_t sequence = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (i > 0 && events[i].time - events[i - 1].time > LAYOUT_BURST_GAP) burst++;
+        auto it = indexes.find(trace_names[events[i].file]);
+        if (it == indexes.end()) continue;
+        Usage& u = usage[it->second];
+        if (u.first == SIZE_MAX) u.first = sequence++;
+        if (u.last_burst != burst) {
+            u.bursts++;
+            u.last_burst = burst;
+        }
+    }
+    std::vector<size_t> order(names.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    auto rank = [&](size_t index) {
+        const Usage& u = usage[index];
+        return u.first == SIZE_MAX ? 2 : u.bursts > 1 ? 0 : 1;
+    };
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        int rank_a = rank(a), rank_b = rank(b);
+        if (rank_a != rank_b) return rank_a < rank_b;
+        return usage[a].first < usage[b].first;
+    });
+    return order;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+inline const char* ACCESS_TRACE_MAGIC = "# xp3vfs access trace 1";
+
+inline const char ACCESS_TRACE_OPEN = 'O';
+inline const char ACCESS_TRACE_READ = 'R';
+inline const char ACCESS_TRACE_SEEK = 'S';
+
+/**
+ * @brief Recorder of file opens, reads and seeks inside an archive
+ *
+ * Files are identified by name so a trace recorded on one archive applies to a repacked one.
+ * Recording appends a small record under a short lock.
+ */
+class AccessTrace {
+public:
+    struct Event {
+        uint64_t time; // nanoseconds since the trace was created
+        uint32_t file; // index in GetFileNames
+        char type; // ACCESS_TRACE_*
+        uint64_t offset; // position in the file, the target of a seek
+        uint64_t size; // bytes read
+    };
+    AccessTrace(): start(std::chrono::steady_clock::now()) {}
+    /**
+     * @brief Get the id of a file name, adding it if needed
+     */
+    uint32_t RegisterFile(std::string_view name);
+    void Record(char type, uint32_t file, uint64_t offset, uint64_t size);
+    std::vector<Event> GetEvents();
+    std::vector<std::string> GetFileNames();
+    /**
+     * @brief Save as text: the magic line, "F <id> <name>" lines and "<type> <time> <file> <offset> <size>" lines
+     */
+    bool Save(const std::string& path);
+    /**
+     * @brief Replace the content with a saved trace
+     */
+    bool Load(const std::string& path);
+private:
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point start;
+    std::vector<Event> events;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> name_ids;
+};
+
+// Events further apart than this start a new burst of related reads
+inline const uint64_t LAYOUT_BURST_GAP = 100 * 1000 * 1000;
+
+/**
+ * @brief Order archive data so files read together are contiguous and hot files come first
+ *
+ * The trace is split into bursts at pauses longer than LAYOUT_BURST_GAP. Files used in several bursts
+ * are hot and placed first, then the other traced files in order of first use, which keeps each burst together,
+ * then the files missing from the trace in index order.
+ * @param trace Recorded accesses
+ * @param names File names in index order
+ * @return Permutation of indexes into names, for Xp3Writer::SetDataOrder
+ */
+std::vector<size_t> plan_layout(AccessTrace& trace, const std::vector<std::string>& names);
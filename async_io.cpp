@@ -0,0 +1,444 @@
+#include "async_io.h"
+#include "decompressor.h"
+#include "xp3.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#if HAVE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+struct AsyncReader::Request {
+    AsyncReadCallback callback;
+    std::atomic<size_t> pending;
+    std::atomic<bool> failed{false};
+};
+
+struct AsyncReader::Op {
+    Request* request;
+    Segment seg;
+    // Final location of the segment
+    uint8_t* dst;
+    // Compressed data, empty for stored segments
+    std::vector<uint8_t> packed;
+    // Bytes already read
+    size_t done = 0;
+#if HAVE_IO_URING
+    struct iovec iov;
+#endif
+    uint8_t* buffer() {
+        return packed.empty() ? dst : packed.data();
+    }
+    size_t size() const {
+        return (size_t)seg.packed_size;
+    }
+};
+
+#if HAVE_IO_URING
+/**
+ * @brief Minimal io_uring on the raw system calls
+ *
+ * Submissions must be serialized by the caller, completions are consumed by one thread.
+ */
+class IoUring {
+public:
+    ~IoUring() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+    bool Init(unsigned entries) {
+        io_uring_params params = {};
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) return false;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        if (!sq_ring) return false;
+        cq_ring = single ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        if (!cq_ring) return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)map(sqes_size, IORING_OFF_SQES);
+        if (!sqes) return false;
+        sq_head = (unsigned*)(sq_ring + params.sq_off.head);
+        sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+        cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+        cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+        sq_entries = params.sq_entries;
+        return true;
+    }
+    unsigned Entries() const {
+        return sq_entries;
+    }
+    /**
+     * @brief Queue a SQE. The kernel consumes all queued entries in Submit, so the ring never fills up
+     * while fewer than Entries() are queued between two Submit calls.
+     */
+    io_uring_sqe* Next() {
+        unsigned tail = *sq_tail + queued;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        queued++;
+        return sqe;
+    }
+    bool Submit() {
+        if (!queued) return true;
+        __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+        unsigned to_submit = queued;
+        queued = 0;
+        while (to_submit) {
+            int ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                return false;
+            }
+            to_submit -= ret;
+        }
+        return true;
+    }
+    /**
+     * @brief Take back the SQEs the kernel did not consume after Submit failed
+     * @param callback Called with the user_data of each of them
+     */
+    template <typename F>
+    void DropUnsubmitted(F callback) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+        for (unsigned i = head; i != tail; i++) {
+            callback(sqes[sq_array[i & sq_mask]].user_data);
+        }
+        // Without SQPOLL the kernel only reads the ring inside io_uring_enter
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    }
+    /**
+     * @brief Block until at least one completion is available
+     */
+    bool Wait() {
+        while (true) {
+            if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head) return true;
+            int ret = (int)syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR) return false;
+        }
+    }
+    /**
+     * @brief Consume available completions
+     */
+    template <typename F>
+    void ForEachCompletion(F callback) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            callback(cqe);
+        }
+    }
+private:
+    uint8_t* map(size_t size, off_t offset) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : (uint8_t*)ptr;
+    }
+    int ring_fd = -1;
+    uint8_t* sq_ring = nullptr;
+    uint8_t* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned sq_entries = 0;
+    unsigned queued = 0;
+};
+#endif
+
+AsyncReader::AsyncReader(std::shared_ptr<PositionalReader> reader, const std::string& filename, size_t queue_depth, size_t workers): reader(reader), queue_depth(queue_depth ? queue_depth : 1), decode_pool(workers) {
+#if HAVE_IO_URING
+    if (!filename.empty()) {
+        fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        std::unique_ptr<IoUring> uring(new IoUring());
+        if (fd >= 0 && uring->Init((unsigned)this->queue_depth)) {
+            if (this->queue_depth > uring->Entries()) this->queue_depth = uring->Entries();
+            ring = std::move(uring);
+            reaper = std::thread(&AsyncReader::reap, this);
+            return;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+#endif
+    // Blocking reads, queue depth is the number of threads
+    io_pool.reset(new ThreadPool(std::min<size_t>(this->queue_depth, 64)));
+}
+
+AsyncReader::~AsyncReader() {
+    Wait();
+#if HAVE_IO_URING
+    if (ring) {
+        // A NOP with no op wakes the reaper to exit, it is already gone if the ring failed
+        while (true) {
+            std::unique_lock<std::mutex> guard(submit_mutex);
+            if (ring_failed) break;
+            io_uring_sqe* sqe = ring->Next();
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            inflight++;
+            if (ring->Submit()) break;
+            ring->DropUnsubmitted([this](uint64_t) {
+                inflight--;
+            });
+            guard.unlock();
+            std::this_thread::yield();
+        }
+        reaper.join();
+        ring.reset();
+        ::close(fd);
+    }
+#endif
+    io_pool.reset();
+}
+
+void AsyncReader::Read(const Segment* segments, size_t count, uint8_t* dst, AsyncReadCallback callback) {
+    if (count == 0) {
+        callback(true);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        outstanding++;
+    }
+    Request* request = new Request();
+    request->callback = std::move(callback);
+    request->pending = count;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        Op* op = new Op();
+        op->request = request;
+        op->seg = segments[i];
+        op->dst = dst + offset;
+        offset += segments[i].original_size;
+        if (op->seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB) {
+            op->packed.resize(op->size());
+        } else if (op->seg.packed_size != op->seg.original_size) {
+            finish(op, false);
+            continue;
+        }
+        submit(op);
+    }
+}
+
+void AsyncReader::submit(Op* op) {
+    if (op->size() == 0) {
+        finish(op, op->seg.original_size == 0);
+        return;
+    }
+#if HAVE_IO_URING
+    if (ring) {
+        std::unique_lock<std::mutex> guard(submit_mutex);
+        if (!ring_failed) {
+            std::vector<Op*> failed;
+            pending.push_back(op);
+            submit_pending(failed);
+            guard.unlock();
+            for (Op* failed_op : failed) {
+                complete(failed_op, false);
+            }
+            return;
+        }
+        // The ring failed, io_pool took over
+    }
+#endif
+    io_pool->Submit([this, op] {
+        bool ok = reader->pread(op->buffer(), op->size(), op->seg.start) == op->size();
+        complete(op, ok);
+    });
+}
+
+#if HAVE_IO_URING
+void AsyncReader::submit_pending(std::vector<Op*>& failed) {
+    // Ops the kernel did not take free queue slots, so pending is queued again until it is empty or the queue is full
+    while (!pending.empty() && inflight < queue_depth) {
+        while (!pending.empty() && inflight < queue_depth) {
+            Op* op = pending.front();
+            pending.pop_front();
+            op->iov.iov_base = op->buffer() + op->done;
+            op->iov.iov_len = op->size() - op->done;
+            io_uring_sqe* sqe = ring->Next();
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = op->seg.start + op->done;
+            sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+            sqe->len = 1;
+            sqe->user_data = (uint64_t)(uintptr_t)op;
+            submitted.insert(op);
+            inflight++;
+        }
+        if (!ring->Submit()) {
+            // No completion will come for what the kernel did not take
+            ring->DropUnsubmitted([&](uint64_t user_data) {
+                Op* op = (Op*)(uintptr_t)user_data;
+                submitted.erase(op);
+                inflight--;
+                failed.push_back(op);
+            });
+        }
+    }
+}
+
+void AsyncReader::reap() {
+    bool stopping = false;
+    while (!stopping) {
+        if (!ring->Wait()) {
+            fail_ring();
+            return;
+        }
+        size_t reaped = 0;
+        std::vector<Op*> retry;
+        std::vector<std::pair<Op*, bool>> completed;
+        ring->ForEachCompletion([&](const io_uring_cqe& cqe) {
+            reaped++;
+            Op* op = (Op*)(uintptr_t)cqe.user_data;
+            if (!op) {
+                stopping = true;
+                return;
+            }
+            if (cqe.res == -EAGAIN || cqe.res == -EINTR) {
+                retry.push_back(op);
+            } else if (cqe.res <= 0) {
+                completed.emplace_back(op, false);
+            } else {
+                op->done += cqe.res;
+                if (op->done < op->size()) {
+                    // Short read, queue the rest
+                    retry.push_back(op);
+                } else {
+                    completed.emplace_back(op, true);
+                }
+            }
+        });
+        std::vector<Op*> failed;
+        {
+            std::lock_guard<std::mutex> guard(submit_mutex);
+            inflight -= reaped;
+            // Forget ops before completing them, their address may be reused by new ops
+            for (auto& item : completed) {
+                submitted.erase(item.first);
+            }
+            for (auto op : retry) {
+                submitted.erase(op);
+                pending.push_front(op);
+            }
+            submit_pending(failed);
+        }
+        for (auto& item : completed) {
+            complete(item.first, item.second);
+        }
+        for (auto op : failed) {
+            complete(op, false);
+        }
+    }
+}
+
+void AsyncReader::fail_ring() {
+    std::vector<Op*> failed;
+    {
+        std::lock_guard<std::mutex> guard(submit_mutex);
+        failed.assign(pending.begin(), pending.end());
+        pending.clear();
+        // Later reads use blocking preads, as if io_uring was not available
+        io_pool.reset(new ThreadPool(std::min<size_t>(queue_depth, 64)));
+        ring_failed = true;
+    }
+    for (auto op : failed) {
+        complete(op, false);
+    }
+    // Submitted reads still belong to the kernel and may write into their buffers. They are only
+    // completed when their CQEs show up in the shared completion ring, which is polled without io_uring_enter.
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(submit_mutex);
+            if (submitted.empty()) break;
+        }
+        std::vector<std::pair<Op*, bool>> completed;
+        ring->ForEachCompletion([&](const io_uring_cqe& cqe) {
+            Op* op = (Op*)(uintptr_t)cqe.user_data;
+            if (!op) return;
+            if (cqe.res > 0) {
+                op->done += cqe.res;
+            }
+            // Short reads cannot be resubmitted anymore
+            completed.emplace_back(op, cqe.res > 0 && op->done == op->size());
+        });
+        if (completed.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> guard(submit_mutex);
+            inflight -= completed.size();
+            for (auto& item : completed) {
+                submitted.erase(item.first);
+            }
+        }
+        for (auto& item : completed) {
+            complete(item.first, item.second);
+        }
+    }
+}
+#endif
+
+void AsyncReader::complete(Op* op, bool ok) {
+    if (!ok || op->packed.empty()) {
+        finish(op, ok);
+        return;
+    }
+    decode_pool.Submit([this, op] {
+        static thread_local BufferDecompressor decoder;
+        bool ok = decoder.Decompress(op->packed.data(), op->packed.size(), op->dst, (size_t)op->seg.original_size);
+        finish(op, ok);
+    });
+}
+
+void AsyncReader::finish(Op* op, bool ok) {
+    Request* request = op->request;
+    delete op;
+    if (!ok) request->failed = true;
+    if (--request->pending > 0) return;
+    request->callback(!request->failed);
+    delete request;
+    std::lock_guard<std::mutex> guard(mutex);
+    if (--outstanding == 0) {
+        done_cv.notify_all();
+    }
+}
+
+void AsyncReader::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return outstanding == 0; });
+}
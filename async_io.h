@@ -0,0 +1,103 @@
+#pragma once
+#include "positional.h"
+#include "thread_pool.h"
+#include "xp3vfs_config.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+struct Segment;
+
+/**
+ * @brief Completion callback of an asynchronous read
+ * @param ok Whether the whole file was read and decompressed
+ */
+typedef std::function<void(bool ok)> AsyncReadCallback;
+
+#if HAVE_IO_URING
+class IoUring;
+#endif
+
+/**
+ * @brief Asynchronous whole-file reads with decompression on a worker pool
+ *
+ * Segment reads are queued on io_uring when it is available (Linux, opened from a file name),
+ * otherwise on a pool of threads doing pread. Up to queue_depth reads are in flight at once.
+ * Callbacks run on internal threads and should not block.
+ */
+class AsyncReader {
+public:
+    /**
+     * @param reader Reader of the archive, used by the pread fallback
+     * @param filename Path of the archive for io_uring. Empty to always use the fallback.
+     * @param queue_depth Maximum number of reads in flight
+     * @param workers Number of decompression threads. 0 to use the number of hardware threads.
+     */
+    AsyncReader(std::shared_ptr<PositionalReader> reader, const std::string& filename, size_t queue_depth, size_t workers);
+    /// Waits for all reads
+    ~AsyncReader();
+    /**
+     * @brief Read a file into dst
+     * @param segments Segments of the file
+     * @param count Number of segments
+     * @param dst Receives the whole file, must stay valid until the callback
+     * @param callback Called once when the read is finished
+     */
+    void Read(const Segment* segments, size_t count, uint8_t* dst, AsyncReadCallback callback);
+    /**
+     * @brief Wait until all reads are finished and their callbacks returned
+     */
+    void Wait();
+    bool UsesIoUring() const {
+#if HAVE_IO_URING
+        return ring != nullptr;
+#else
+        return false;
+#endif
+    }
+private:
+    struct Request;
+    struct Op;
+    void submit(Op* op);
+    void complete(Op* op, bool ok);
+    void finish(Op* op, bool ok);
+#if HAVE_IO_URING
+    void reap();
+    /**
+     * @brief Queue pending ops up to queue_depth and submit them
+     * @param failed Receives ops the kernel did not take, to complete once submit_mutex is released
+     */
+    void submit_pending(std::vector<Op*>& failed);
+    /**
+     * @brief Fall back to io_pool when completions cannot be waited for
+     *
+     * Queued ops are failed at once, submitted ops are completed as their CQEs arrive.
+     */
+    void fail_ring();
+    std::unique_ptr<IoUring> ring;
+    int fd = -1;
+    std::thread reaper;
+    // Guards the submission queue, pending, submitted, inflight, ring_failed and io_pool after a ring failure
+    std::mutex submit_mutex;
+    std::deque<Op*> pending;
+    // Ops handed to the kernel and not reaped yet
+    std::unordered_set<Op*> submitted;
+    size_t inflight = 0;
+    bool ring_failed = false;
+#endif
+    std::shared_ptr<PositionalReader> reader;
+    size_t queue_depth;
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    size_t outstanding = 0;
+    // Runs pread for the fallback
+    std::unique_ptr<ThreadPool> io_pool;
+    ThreadPool decode_pool;
+};
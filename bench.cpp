@@ -0,0 +1,1200 @@
+#include "xp3.h"
+#include "decompressor.h"
+#include "utf16.h"
+#include "fileop.h"
+#include "time_util.h"
+#include "zlib.h"
+#if _WIN32
+#include "wchar_util.h"
+#else
+#include "encoding.h"
+#endif
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#if !_WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Bump when a metric changes meaning so old baselines are not compared against it.
+inline const int BENCH_REPORT_VERSION = 1;
+
+/**
+ * @brief Synthetic archive layout
+ */
+struct BenchProfile {
+    const char* name;
+    size_t small_count;
+    uint64_t small_min;
+    uint64_t small_max;
+    size_t medium_count;
+    uint64_t medium_min;
+    uint64_t medium_max;
+    size_t large_count;
+    uint64_t large_size;
+    // Large files are split into segments of this size. 0 for one segment.
+    uint64_t segment_size;
+    int raw_percent;
+    int zstd_percent; // ignored without zstd support
+    int shared_percent; // files reusing the segments of an earlier file
+};
+
+static const BenchProfile profiles[] = {
+    { "small", 20000, 16, 8192, 0, 0, 0, 0, 0, 0, 30, 0, 5 },
+    { "mixed", 600, 64, 64 << 10, 120, 64 << 10, 1 << 20, 4, 8 << 20, 1 << 20, 20, 30, 10 },
+    { "large", 0, 0, 0, 0, 0, 0, 4, 16 << 20, 0, 0, 0, 0 },
+    { "raw", 0, 0, 0, 200, 64 << 10, 1 << 20, 0, 0, 0, 100, 0, 0 },
+};
+
+// xorshift64*, fixed seeds keep archives and access patterns identical between runs
+class Rng {
+public:
+    Rng(uint64_t seed): state(seed ? seed : 1) {}
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    uint64_t range(uint64_t min, uint64_t max) {
+        if (max <= min) return min;
+        return min + next() % (max - min + 1);
+    }
+    // Log-uniform, most files are small as in real game archives
+    uint64_t log_range(uint64_t min, uint64_t max) {
+        if (max <= min) return min;
+        double r = (double)(next() >> 11) / (double)(1ULL << 53);
+        double value = (double)min * pow((double)max / (double)min, r);
+        return std::min(max, std::max(min, (uint64_t)value));
+    }
+    bool percent(int p) {
+        return (int)(next() % 100) < p;
+    }
+private:
+    uint64_t state;
+};
+
+// Script-like text with some binary noise
+static void fill_content(Rng& rng, uint8_t* buf, size_t size) {
+    static const char* words[] = { "@bg storage=", "[r]", "\r\n", "kirikiri ", "*label|", "[p]", "@wait time=", "0123456789", "char", "voice_", "[l]", "; comment " };
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t r = rng.next();
+        if ((r & 7) == 0) {
+            buf[pos++] = (uint8_t)(r >> 8);
+            continue;
+        }
+        const char* word = words[(r >> 8) % (sizeof(words) / sizeof(words[0]))];
+        size_t len = std::min(strlen(word), size - pos);
+        memcpy(buf + pos, word, len);
+        pos += len;
+    }
+}
+
+static void put_u16(std::vector<uint8_t>& out, uint16_t value) {
+    for (int i = 0; i < 2; i++) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static void put_chunk(std::vector<uint8_t>& out, const char* name, const std::vector<uint8_t>& body) {
+    out.insert(out.end(), name, name + 4);
+    put_u64(out, body.size());
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+struct BenchEntry {
+    std::string name;
+    uint64_t size;
+    uint32_t adler;
+    std::vector<Segment> segments;
+};
+
+class ArchiveGenerator {
+public:
+    ArchiveGenerator(const BenchProfile& profile, bool quick): profile(profile), quick(quick), rng(0x58503356ULL) {}
+    bool Generate(const std::string& path);
+    uint64_t GetDataSize() const {
+        return data_size;
+    }
+private:
+    bool write_segment(const uint8_t* data, size_t size, Segment& seg);
+    bool add_file(std::string name, uint64_t size, uint64_t segment_size);
+    bool write_index();
+    const BenchProfile& profile;
+    bool quick;
+    Rng rng;
+    FILE* fp = nullptr;
+    uint64_t offset = 0;
+    uint64_t data_size = 0;
+    std::vector<BenchEntry> entries;
+    // Entries whose segments may be shared
+    std::vector<size_t> shareable;
+    std::vector<uint8_t> content;
+    std::vector<uint8_t> packed;
+};
+
+bool ArchiveGenerator::write_segment(const uint8_t* data, size_t size, Segment& seg) {
+    seg.start = offset;
+    seg.original_size = size;
+    const uint8_t* out = data;
+    size_t out_size = size;
+    seg.flag = TVP_XP3_SEGM_ENCODE_RAW;
+    if (size && !rng.percent(profile.raw_percent)) {
+        seg.flag = TVP_XP3_SEGM_ENCODE_ZLIB;
+#if HAVE_ZSTD
+        if (rng.percent(profile.zstd_percent)) {
+            packed.resize(ZSTD_compressBound(size));
+            size_t r = ZSTD_compress(packed.data(), packed.size(), data, size, 3);
+            if (ZSTD_isError(r)) {
+                printf("ZSTD_compress failed: %s\n", ZSTD_getErrorName(r));
+                return false;
+            }
+            out = packed.data();
+            out_size = r;
+        } else
+#endif
+        {
+            uLongf dest_len = compressBound((uLong)size);
+            packed.resize(dest_len);
+            if (compress2(packed.data(), &dest_len, data, (uLong)size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+                printf("compress2 failed\n");
+                return false;
+            }
+            out = packed.data();
+            out_size = dest_len;
+        }
+    }
+    seg.packed_size = out_size;
+    if (out_size && fwrite(out, 1, out_size, fp) != out_size) {
+        return false;
+    }
+    offset += out_size;
+    return true;
+}
+
+bool ArchiveGenerator::add_file(std::string name, uint64_t size, uint64_t segment_size) {
+    BenchEntry entry;
+    entry.name = std::move(name);
+    if (!shareable.empty() && rng.percent(profile.shared_percent)) {
+        const BenchEntry& source = entries[shareable[rng.next() % shareable.size()]];
+        entry.size = source.size;
+        entry.adler = source.adler;
+        entry.segments = source.segments;
+        entries.push_back(std::move(entry));
+        return true;
+    }
+    entry.size = size;
+    content.resize(size);
+    fill_content(rng, content.data(), size);
+    entry.adler = adler32(adler32(0, nullptr, 0), content.data(), (uInt)size);
+    if (segment_size == 0) segment_size = size ? size : 1;
+    for (uint64_t pos = 0; pos < size || entry.segments.empty(); pos += segment_size) {
+        Segment seg;
+        size_t len = (size_t)std::min(segment_size, size - pos);
+        if (!write_segment(content.data() + pos, len, seg)) {
+            return false;
+        }
+        entry.segments.push_back(seg);
+    }
+    data_size += size;
+    if (entry.segments.size() == 1) {
+        shareable.push_back(entries.size());
+    }
+    entries.push_back(std::move(entry));
+    return true;
+}
+
+bool ArchiveGenerator::write_index() {
+    std::vector<uint8_t> index;
+    for (auto& entry: entries) {
+        std::vector<uint8_t> info, segm, adlr, file;
+        uint64_t packed_size = 0;
+        for (auto& seg: entry.segments) {
+            packed_size += seg.packed_size;
+        }
+        put_u32(info, 0);
+        put_u64(info, entry.size);
+        put_u64(info, packed_size);
+        put_u16(info, (uint16_t)entry.name.size());
+        // Names are ASCII, widening is a valid UTF-16LE conversion
+        for (char c : entry.name) {
+            put_u16(info, (uint8_t)c);
+        }
+        for (auto& seg: entry.segments) {
+            put_u32(segm, seg.flag);
+            put_u64(segm, seg.start);
+            put_u64(segm, seg.original_size);
+            put_u64(segm, seg.packed_size);
+        }
+        put_u32(adlr, entry.adler);
+        put_chunk(file, CHUNK_INFO, info);
+        put_chunk(file, CHUNK_SEGM, segm);
+        put_chunk(file, CHUNK_ADLR, adlr);
+        put_chunk(index, CHUNK_FILE, file);
+    }
+    uLongf dest_len = compressBound((uLong)index.size());
+    packed.resize(dest_len);
+    if (compress2(packed.data(), &dest_len, index.data(), (uLong)index.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        printf("compress2 failed\n");
+        return false;
+    }
+    std::vector<uint8_t> header;
+    header.push_back(TVP_XP3_INDEX_ENCODE_ZLIB);
+    put_u64(header, dest_len);
+    put_u64(header, index.size());
+    uint64_t index_offset = offset;
+    if (fwrite(header.data(), 1, header.size(), fp) != header.size() || fwrite(packed.data(), 1, dest_len, fp) != dest_len) {
+        return false;
+    }
+    std::vector<uint8_t> offset_bytes;
+    put_u64(offset_bytes, index_offset);
+    // Patch the index offset after the continue header
+    return !fseek(fp, 32, SEEK_SET) && fwrite(offset_bytes.data(), 1, 8, fp) == 8;
+}
+
+bool ArchiveGenerator::Generate(const std::string& path) {
+    fp = fileop::fopen(path, "wb");
+    if (!fp) {
+        printf("Failed to create %s\n", path.c_str());
+        return false;
+    }
+    std::vector<uint8_t> header(XP3_MAGIC, XP3_MAGIC + 11);
+    put_u64(header, TVP_XP3_CURRENT_HEADER_VERSION);
+    put_u32(header, 1);
+    header.push_back(TVP_XP3_INDEX_CONTINUE);
+    put_u64(header, 0);
+    put_u64(header, 0);
+    bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size();
+    offset = header.size();
+    size_t div = quick ? 4 : 1;
+    char name[128];
+    for (size_t i = 0; ok && i < profile.small_count / div; i++) {
+        snprintf(name, sizeof(name), "%s/dir%02zu/file_%05zu.ks", profile.name, i % 32, i);
+        ok = add_file(name, rng.log_range(profile.small_min, profile.small_max), 0);
+    }
+    for (size_t i = 0; ok && i < profile.medium_count / div; i++) {
+        snprintf(name, sizeof(name), "%s/image/img_%05zu.png", profile.name, i);
+        ok = add_file(name, rng.log_range(profile.medium_min, profile.medium_max), 0);
+    }
+    for (size_t i = 0; ok && i < profile.large_count; i++) {
+        snprintf(name, sizeof(name), "%s/video/movie_%02zu.mpg", profile.name, i);
+        ok = add_file(name, profile.large_size / div, profile.segment_size / div);
+    }
+    ok = ok && write_index();
+    if (fclose(fp)) ok = false;
+    fp = nullptr;
+    if (!ok) {
+        printf("Failed to write %s\n", path.c_str());
+    }
+    return ok;
+}
+
+struct ReportLine {
+    std::string scenario;
+    std::string metric;
+    double value;
+    std::string unit;
+};
+
+class Report {
+public:
+    void Add(const std::string& scenario, const std::string& metric, double value, const char* unit) {
+        lines.push_back({scenario, metric, value, unit});
+        printf("%-8s %-28s %14.3f %s\n", scenario.c_str(), metric.c_str(), value, unit);
+        fflush(stdout);
+    }
+    bool Save(const std::string& path) const;
+    static bool Load(const std::string& path, std::vector<ReportLine>& lines);
+    const std::vector<ReportLine>& GetLines() const {
+        return lines;
+    }
+private:
+    std::vector<ReportLine> lines;
+};
+
+bool Report::Save(const std::string& path) const {
+    FILE* fp = fileop::fopen(path, "w");
+    if (!fp) {
+        printf("Failed to create %s\n", path.c_str());
+        return false;
+    }
+    fprintf(fp, "# xp3vfs-bench report %d\n", BENCH_REPORT_VERSION);
+    fprintf(fp, "# scenario metric value unit\n");
+    for (auto& line: lines) {
+        fprintf(fp, "%s %s %.3f %s\n", line.scenario.c_str(), line.metric.c_str(), line.value, line.unit.c_str());
+    }
+    return !fclose(fp);
+}
+
+bool Report::Load(const std::string& path, std::vector<ReportLine>& lines) {
+    FILE* fp = fileop::fopen(path, "r");
+    if (!fp) {
+        printf("Failed to open %s\n", path.c_str());
+        return false;
+    }
+    char buf[512];
+    bool ok = false;
+    while (fgets(buf, sizeof(buf), fp)) {
+        int version;
+        if (sscanf(buf, "# xp3vfs-bench report %d", &version) == 1) {
+            ok = version == BENCH_REPORT_VERSION;
+            if (!ok) printf("Report %s has version %d, expected %d\n", path.c_str(), version, BENCH_REPORT_VERSION);
+            continue;
+        }
+        if (buf[0] == '#') continue;
+        char scenario[128], metric[128], unit[32];
+        double value;
+        if (sscanf(buf, "%127s %127s %lf %31s", scenario, metric, &value, unit) == 4) {
+            lines.push_back({scenario, metric, value, unit});
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+static double elapsed_ms(uint64_t start, uint64_t end) {
+    return (end - start) / 1e6;
+}
+
+static double percentile_us(std::vector<uint64_t>& latencies, int p) {
+    if (latencies.empty()) return 0;
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[(latencies.size() - 1) * p / 100] / 1e3;
+}
+
+// Random operations run until max_ops or the time budget is used
+inline const size_t BENCH_MAX_OPS = 5000;
+inline const uint64_t BENCH_TIME_BUDGET = 2000000000ULL;
+
+static bool bench_index(const std::string& path, const std::string& scenario, Report& report) {
+    std::vector<uint64_t> times;
+    size_t count = 0;
+    // Paths opened after a lazy index load, like a tool pulling a few files out of a big archive
+    std::vector<std::string> wanted;
+    for (int i = 0; i < 5; i++) {
+        Xp3Archive archive(path.c_str());
+        auto start = time_util::time_ns64();
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", path.c_str());
+            return false;
+        }
+        times.push_back(time_util::time_ns64() - start);
+        count = archive.GetFileCount();
+        if (wanted.empty()) {
+            Rng rng(7);
+            for (size_t n = 0; n < 16 && count > 0; n++) {
+                wanted.emplace_back(archive.GetFileName(rng.next() % count));
+            }
+        }
+    }
+    std::sort(times.begin(), times.end());
+    report.Add(scenario, "entries", (double)count, "count");
+    report.Add(scenario, "index_parse", times[times.size() / 2] / 1e6, "ms");
+    std::vector<uint64_t> lazy_times;
+    std::vector<uint64_t> open_times;
+    for (int i = 0; i < 5; i++) {
+        Xp3Archive archive(path.c_str());
+        archive.SetLazyIndex(true);
+        auto start = time_util::time_ns64();
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", path.c_str());
+            return false;
+        }
+        auto parsed = time_util::time_ns64();
+        for (const auto& name : wanted) {
+            Xp3File* file = archive.OpenFile(std::string_view(name));
+            if (!file) {
+                printf("Failed to open %s with lazy index\n", name.c_str());
+                return false;
+            }
+            delete file;
+        }
+        lazy_times.push_back(parsed - start);
+        open_times.push_back(time_util::time_ns64() - start);
+    }
+    std::sort(lazy_times.begin(), lazy_times.end());
+    std::sort(open_times.begin(), open_times.end());
+    report.Add(scenario, "index_parse.lazy", lazy_times[lazy_times.size() / 2] / 1e6, "ms");
+    report.Add(scenario, "index_lazy_open16", open_times[open_times.size() / 2] / 1e6, "ms");
+    return true;
+}
+
+static bool bench_open(Xp3Archive& archive, const std::string& scenario, Report& report) {
+    std::vector<size_t> order(archive.GetFileCount());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    Rng rng(1);
+    for (size_t i = order.size(); i > 1; i--) {
+        std::swap(order[i - 1], order[rng.next() % i]);
+    }
+    if (order.size() > BENCH_MAX_OPS) order.resize(BENCH_MAX_OPS);
+    auto start = time_util::time_ns64();
+    for (size_t index : order) {
+        Xp3File* file = archive.OpenFile(index);
+        if (!file) {
+            printf("Failed to open file %zu\n", index);
+            return false;
+        }
+        delete file;
+    }
+    auto end = time_util::time_ns64();
+    report.Add(scenario, "open", order.empty() ? 0 : elapsed_ms(start, end) * 1e3 / order.size(), "us");
+    return true;
+}
+
+static bool read_whole(Xp3Archive& archive, size_t index, uint8_t* buffer, size_t buffer_size, uint64_t& total) {
+    Xp3File* file = archive.OpenFile(index);
+    if (!file) return false;
+    uint64_t read = 0;
+    while (true) {
+        size_t r = file->read(buffer, buffer_size);
+        if (r == 0) break;
+        read += r;
+    }
+    bool ok = !file->error() && read == archive.GetFileEntry(index).original_size;
+    delete file;
+    total += read;
+    return ok;
+}
+
+static bool bench_sequential(Xp3Archive& archive, const std::string& scenario, const char* backend, Report& report) {
+    std::vector<uint8_t> buffer(64 << 10);
+    double best = 0;
+    // Best of 3 passes, a single pass over a small archive is noisy
+    for (int pass = 0; pass < 3; pass++) {
+        uint64_t total = 0;
+        auto start = time_util::time_ns64();
+        for (size_t i = 0; i < archive.GetFileCount(); i++) {
+            if (!read_whole(archive, i, buffer.data(), buffer.size(), total)) {
+                printf("Failed to read file %zu\n", i);
+                return false;
+            }
+        }
+        auto end = time_util::time_ns64();
+        best = std::max(best, total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+    }
+    report.Add(scenario, std::string("seq_read.") + backend, best, "MB/s");
+    return true;
+}
+
+// Whole files in archive order through ReadMany, in batches as a scene change would load them
+static bool bench_bulk(Xp3Archive& archive, const std::string& scenario, const char* backend, Report& report) {
+    const size_t batch_files = 256;
+    const uint64_t batch_bytes = 16 << 20;
+    std::vector<uint8_t> buffer;
+    std::vector<Xp3ReadRequest> requests;
+    double best = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        uint64_t total = 0;
+        auto start = time_util::time_ns64();
+        for (size_t i = 0; i < archive.GetFileCount();) {
+            requests.clear();
+            uint64_t bytes = 0;
+            size_t first = i;
+            for (; i < archive.GetFileCount() && requests.size() < batch_files && (bytes == 0 || bytes < batch_bytes); i++) {
+                bytes += archive.GetFileEntry(i).original_size;
+                requests.push_back({ i, nullptr, 0, false });
+            }
+            buffer.resize(bytes);
+            uint64_t offset = 0;
+            for (auto& request : requests) {
+                request.size = archive.GetFileEntry(request.index).original_size;
+                request.dst = buffer.data() + offset;
+                offset += request.size;
+            }
+            if (!archive.ReadMany(requests)) {
+                printf("ReadMany failed for files %zu to %zu\n", first, i - 1);
+                return false;
+            }
+            total += bytes;
+        }
+        auto end = time_util::time_ns64();
+        best = std::max(best, total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+    }
+    report.Add(scenario, std::string("bulk_read.") + backend, best, "MB/s");
+    return true;
+}
+
+// Every zlib segment decoded by the streaming decoder and by the one-shot backend
+static bool bench_inflate(const std::string& path, const std::string& scenario, Report& report) {
+    Xp3Archive archive(path.c_str());
+    if (!archive.ReadIndex()) {
+        printf("Failed to read index from %s\n", path.c_str());
+        return false;
+    }
+    std::vector<Segment> segments;
+    for (size_t i = 0; i < archive.GetFileCount(); i++) {
+        for (auto& seg : archive.GetFileEntry(i).segments) {
+            if (seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB && seg.packed_size > 0) segments.push_back(seg);
+        }
+    }
+    std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.start < b.start; });
+    segments.erase(std::unique(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.start == b.start; }), segments.end());
+    // Packed data is loaded first so only decoding is measured
+    FilePositionalReader file(path.c_str());
+    std::vector<std::pair<Segment, std::vector<uint8_t>>> packed;
+    for (auto& seg : segments) {
+        std::vector<uint8_t> data((size_t)seg.packed_size);
+        if (file.pread(data.data(), data.size(), seg.start) != data.size()) {
+            printf("Failed to read segment at %" PRIu64 "\n", seg.start);
+            return false;
+        }
+        if (!is_zstd_data(data.data(), data.size())) {
+            packed.emplace_back(seg, std::move(data));
+        }
+    }
+    if (packed.empty()) return true;
+    std::vector<uint8_t> out;
+    BufferDecompressor decoder;
+    for (int oneshot = 0; oneshot < 2; oneshot++) {
+        double best = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            uint64_t total = 0;
+            auto start = time_util::time_ns64();
+            for (auto& item : packed) {
+                size_t size = (size_t)item.first.original_size;
+                if (out.size() < size) out.resize(size);
+                bool ok;
+                if (oneshot) {
+                    ok = decoder.Decompress(item.second.data(), item.second.size(), out.data(), size);
+                } else {
+                    ZlibDecompressor stream(item.second.data(), item.second.size());
+                    size_t done = 0;
+                    while (done < size) {
+                        size_t r = stream.read(out.data() + done, size - done);
+                        if (r == 0) break;
+                        done += r;
+                    }
+                    ok = done == size && !stream.error();
+                }
+                if (!ok) {
+                    printf("Failed to decode segment at %" PRIu64 "\n", item.first.start);
+                    return false;
+                }
+                total += size;
+            }
+            auto end = time_util::time_ns64();
+            best = std::max(best, total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+        }
+        report.Add(scenario, oneshot ? "inflate.oneshot" : "inflate.streaming", best, "MB/s");
+    }
+    return true;
+}
+
+// Entry names decoded from UTF-16LE by the conversion ReadIndex used before and by the built-in transcoder
+static bool bench_names(Xp3Archive& archive, const std::string& scenario, Report& report) {
+    // Generated names are ASCII, the mixed set adds Japanese directories and a supplementary character like real games
+    static const uint16_t prefix[] = { 0x7ACB, 0x3061, 0x7D75, '/', 0x30AD, 0x30E3, 0x30E9, '_' };
+    static const uint16_t suffix[] = { '_', 0xD83C, 0xDF38 };
+    for (int mixed = 0; mixed < 2; mixed++) {
+        std::vector<std::string> names;
+        uint64_t input_size = 0;
+        for (size_t i = 0; i < archive.GetFileCount(); i++) {
+            std::vector<uint16_t> units;
+            if (mixed) units.assign(prefix, prefix + sizeof(prefix) / sizeof(prefix[0]));
+            for (char c : archive.GetFileName(i)) units.push_back((uint8_t)c);
+            if (mixed) units.insert(units.end(), suffix, suffix + sizeof(suffix) / sizeof(suffix[0]));
+            std::string name;
+            for (uint16_t unit : units) {
+                name.push_back((char)(unit & 0xFF));
+                name.push_back((char)(unit >> 8));
+            }
+            input_size += name.size();
+            names.push_back(std::move(name));
+        }
+        if (names.empty()) return true;
+        for (int builtin = 0; builtin < 2; builtin++) {
+            double best = 0;
+            std::string out;
+            for (int pass = 0; pass < 3; pass++) {
+                auto start = time_util::time_ns64();
+                for (auto& name : names) {
+                    out.clear();
+                    bool ok;
+                    if (builtin) {
+                        ok = append_utf16le_to_utf8((const uint8_t*)name.data(), name.size() / 2, out);
+                    } else {
+#if _WIN32
+                        std::wstring wname((const wchar_t*)name.data(), name.size() / 2);
+                        ok = wchar_util::wstr_to_str(out, wname, 65001);
+#else
+                        ok = encoding::convert(name, out, "UTF-16LE", "UTF-8");
+#endif
+                    }
+                    if (!ok) {
+                        printf("Failed to convert a name\n");
+                        return false;
+                    }
+                }
+                auto end = time_util::time_ns64();
+                best = std::max(best, input_size / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+            }
+            std::string metric = std::string("names.") + (mixed ? "mixed." : "ascii.") + (builtin ? get_utf16_backend() : "system");
+            report.Add(scenario, metric, best, "MB/s");
+        }
+    }
+    return true;
+}
+
+// Multi-segment files decoded with segments spread over threads, against ReadAll on one thread
+static bool bench_parallel_decode(const std::string& path, const std::string& scenario, Report& report) {
+    Xp3Archive archive(path.c_str());
+    if (!archive.ReadIndex()) {
+        printf("Failed to read index from %s\n", path.c_str());
+        return false;
+    }
+    std::vector<size_t> multi;
+    for (size_t i = 0; i < archive.GetFileCount(); i++) {
+        if (archive.GetFileEntry(i).segments.size() > 1) multi.push_back(i);
+    }
+    if (multi.empty()) return true;
+    archive.EnableParallelDecode();
+    std::vector<uint8_t> data;
+    for (int parallel = 0; parallel < 2; parallel++) {
+        double best = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            uint64_t total = 0;
+            auto start = time_util::time_ns64();
+            for (size_t index : multi) {
+                if (!(parallel ? archive.ReadParallel(index, data) : archive.ReadAll(index, data))) {
+                    printf("Failed to read file %zu\n", index);
+                    return false;
+                }
+                total += data.size();
+            }
+            auto end = time_util::time_ns64();
+            best = std::max(best, total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+        }
+        report.Add(scenario, parallel ? "multi_segment.parallel" : "multi_segment.serial", best, "MB/s");
+    }
+    return true;
+}
+
+// Whole files through ReadAsync with many reads in flight
+static bool bench_async(const std::string& path, const std::string& scenario, Report& report) {
+    Xp3Archive archive(path.c_str());
+    if (!archive.ReadIndex()) {
+        printf("Failed to read index from %s\n", path.c_str());
+        return false;
+    }
+    archive.EnableAsyncIo(64);
+    printf("Async engine: %s\n", archive.IsAsyncIoUring() ? "io_uring" : "thread pool");
+    const uint64_t batch_bytes = 64 << 20;
+    std::vector<uint8_t> buffer;
+    std::atomic<bool> failed(false);
+    double best = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        uint64_t total = 0;
+        auto start = time_util::time_ns64();
+        for (size_t i = 0; i < archive.GetFileCount();) {
+            size_t first = i;
+            uint64_t bytes = 0;
+            for (; i < archive.GetFileCount() && (bytes == 0 || bytes < batch_bytes); i++) {
+                bytes += archive.GetFileEntry(i).original_size;
+            }
+            buffer.resize(bytes);
+            uint64_t offset = 0;
+            for (size_t n = first; n < i; n++) {
+                uint64_t size = archive.GetFileEntry(n).original_size;
+                archive.ReadAsync(n, buffer.data() + offset, size, [&failed](bool ok) {
+                    if (!ok) failed = true;
+                });
+                offset += size;
+            }
+            archive.WaitAsync();
+            total += bytes;
+        }
+        auto end = time_util::time_ns64();
+        if (failed) {
+            printf("ReadAsync failed\n");
+            return false;
+        }
+        best = std::max(best, total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024));
+    }
+    report.Add(scenario, "async_read", best, "MB/s");
+    return true;
+}
+
+// Open, seek to a random offset and read 4 KiB, as an engine loading part of a resource does
+static bool bench_random(Xp3Archive& archive, const std::string& scenario, const char* backend, Report& report) {
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < archive.GetFileCount(); i++) {
+        if (archive.GetFileEntry(i).original_size > 0) candidates.push_back(i);
+    }
+    if (candidates.empty()) return true;
+    Rng rng(2);
+    uint8_t buffer[4096];
+    std::vector<uint64_t> latencies;
+    auto start = time_util::time_ns64();
+    uint64_t now = start;
+    while (latencies.size() < BENCH_MAX_OPS && now - start < BENCH_TIME_BUDGET) {
+        size_t index = candidates[rng.next() % candidates.size()];
+        uint64_t size = archive.GetFileEntry(index).original_size;
+        uint64_t offset = rng.next() % size;
+        uint64_t op_start = time_util::time_ns64();
+        Xp3File* file = archive.OpenFile(index);
+        if (!file || !file->seek(offset, SEEK_SET) || file->read(buffer, sizeof(buffer)) == 0) {
+            printf("Random read failed: file %zu offset %" PRIu64 "\n", index, offset);
+            delete file;
+            return false;
+        }
+        delete file;
+        now = time_util::time_ns64();
+        latencies.push_back(now - op_start);
+    }
+    std::string prefix = std::string("random_read.") + backend;
+    report.Add(scenario, prefix, latencies.size() / (elapsed_ms(start, now) / 1e3), "ops/s");
+    report.Add(scenario, prefix + ".p50", percentile_us(latencies, 50), "us");
+    report.Add(scenario, prefix + ".p99", percentile_us(latencies, 99), "us");
+    return true;
+}
+
+// Seek and read one byte in already opened large files
+static bool bench_seek(Xp3Archive& archive, const std::string& scenario, const char* variant, Report& report) {
+    std::vector<Xp3File*> files;
+    std::vector<uint64_t> sizes;
+    for (size_t i = 0; i < archive.GetFileCount(); i++) {
+        uint64_t size = archive.GetFileEntry(i).original_size;
+        if (size < (1 << 20)) continue;
+        Xp3File* file = archive.OpenFile(i);
+        if (!file) {
+            printf("Failed to open file %zu\n", i);
+            for (auto f : files) delete f;
+            return false;
+        }
+        files.push_back(file);
+        sizes.push_back(size);
+    }
+    if (files.empty()) return true;
+    Rng rng(3);
+    bool ok = true;
+    std::vector<uint64_t> latencies;
+    auto start = time_util::time_ns64();
+    uint64_t now = start;
+    while (latencies.size() < BENCH_MAX_OPS && now - start < BENCH_TIME_BUDGET) {
+        size_t n = rng.next() % files.size();
+        uint64_t offset = rng.next() % sizes[n];
+        uint8_t byte;
+        uint64_t op_start = time_util::time_ns64();
+        if (!files[n]->seek(offset, SEEK_SET) || files[n]->read(&byte, 1) != 1) {
+            printf("Seek failed: offset %" PRIu64 "\n", offset);
+            ok = false;
+            break;
+        }
+        now = time_util::time_ns64();
+        latencies.push_back(now - op_start);
+    }
+    for (auto f : files) delete f;
+    if (!ok) return false;
+    std::string prefix = std::string("seek.") + variant;
+    report.Add(scenario, prefix + ".p50", percentile_us(latencies, 50), "us");
+    report.Add(scenario, prefix + ".p99", percentile_us(latencies, 99), "us");
+    return true;
+}
+
+// Forward scan of multi-segment files with random gaps, as a player skipping through a movie would do
+static bool bench_skip(Xp3Archive& archive, const std::string& scenario, Report& report) {
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < archive.GetFileCount(); i++) {
+        if (archive.GetFileEntry(i).segments.size() > 1) candidates.push_back(i);
+    }
+    if (candidates.empty()) return true;
+    Rng rng(4);
+    uint8_t buffer[4096];
+    std::vector<uint64_t> latencies;
+    uint64_t covered = 0;
+    auto start = time_util::time_ns64();
+    uint64_t now = start;
+    for (size_t n = 0; latencies.size() < BENCH_MAX_OPS && now - start < BENCH_TIME_BUDGET; n++) {
+        size_t index = candidates[n % candidates.size()];
+        Xp3File* file = archive.OpenFile(index);
+        if (!file) {
+            printf("Failed to open file %zu\n", index);
+            return false;
+        }
+        uint64_t size = file->get_original_size();
+        for (uint64_t offset = rng.next() % (256 << 10); offset < size; offset += sizeof(buffer) + rng.next() % (256 << 10)) {
+            uint64_t op_start = time_util::time_ns64();
+            // The second seek replaces the first one before anything is read
+            if (!file->seek(std::min(size, offset + rng.next() % (64 << 10)), SEEK_SET) || !file->seek(offset, SEEK_SET) || file->read(buffer, sizeof(buffer)) == 0) {
+                printf("Skip failed: file %zu offset %" PRIu64 "\n", index, offset);
+                delete file;
+                return false;
+            }
+            now = time_util::time_ns64();
+            latencies.push_back(now - op_start);
+        }
+        covered += size;
+        delete file;
+    }
+    report.Add(scenario, "skip_scan", covered / (elapsed_ms(start, now) / 1e3) / (1024 * 1024), "MB/s");
+    report.Add(scenario, "skip_scan.p50", percentile_us(latencies, 50), "us");
+    report.Add(scenario, "skip_scan.p99", percentile_us(latencies, 99), "us");
+    return true;
+}
+
+// Whole-file reads shared by N threads through one archive
+static bool bench_threads(Xp3Archive& archive, const std::string& scenario, Report& report) {
+    unsigned max_threads = std::min(16u, std::max(1u, std::thread::hardware_concurrency()));
+    double base = 0;
+    for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        std::atomic<size_t> next(0);
+        std::atomic<uint64_t> total(0);
+        std::atomic<bool> failed(false);
+        std::vector<std::thread> workers;
+        auto start = time_util::time_ns64();
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&] {
+                std::vector<uint8_t> buffer(64 << 10);
+                uint64_t read = 0;
+                while (!failed) {
+                    size_t n = next++;
+                    if (n >= archive.GetFileCount()) break;
+                    if (!read_whole(archive, n, buffer.data(), buffer.size(), read)) failed = true;
+                }
+                total += read;
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        auto end = time_util::time_ns64();
+        if (failed) {
+            printf("Multi-threaded read failed with %u threads\n", threads);
+            return false;
+        }
+        double speed = total / (elapsed_ms(start, end) / 1e3) / (1024 * 1024);
+        if (threads == 1) base = speed;
+        report.Add(scenario, "mt_read." + std::to_string(threads), speed, "MB/s");
+        report.Add(scenario, "mt_scaling." + std::to_string(threads), base > 0 ? speed / base : 0, "x");
+        if (threads == max_threads) break;
+    }
+    return true;
+}
+
+static bool run_scenario(const BenchProfile& profile, const std::string& dir, bool quick, bool keep, Report& report) {
+    std::string path = fileop::join(dir, std::string("bench_") + profile.name + ".xp3");
+    ArchiveGenerator generator(profile, quick);
+    auto start = time_util::time_ns64();
+    if (!generator.Generate(path)) {
+        return false;
+    }
+    size_t archive_size = 0;
+    fileop::get_file_size(path, archive_size);
+    printf("Generated %s: %" PRIu64 " bytes of data, %zu bytes archive in %.3f seconds\n", path.c_str(), generator.GetDataSize(), archive_size, elapsed_ms(start, time_util::time_ns64()) / 1e3);
+    report.Add(profile.name, "data_size", (double)generator.GetDataSize(), "bytes");
+    bool ok = bench_index(path, profile.name, report);
+    for (int use_mmap = 0; ok && use_mmap < 2; use_mmap++) {
+        const char* backend = use_mmap ? "mmap" : "pread";
+        Xp3Archive archive(path.c_str(), true, use_mmap);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", path.c_str());
+            ok = false;
+            break;
+        }
+        if (!use_mmap) {
+            ok = ok && bench_open(archive, profile.name, report);
+            ok = ok && bench_names(archive, profile.name, report);
+            ok = ok && bench_threads(archive, profile.name, report);
+            ok = ok && bench_seek(archive, profile.name, "plain", report);
+            ok = ok && bench_skip(archive, profile.name, report);
+        }
+        ok = ok && bench_sequential(archive, profile.name, backend, report);
+        ok = ok && bench_bulk(archive, profile.name, backend, report);
+        ok = ok && bench_random(archive, profile.name, backend, report);
+    }
+    ok = ok && bench_async(path, profile.name, report);
+    ok = ok && bench_parallel_decode(path, profile.name, report);
+    ok = ok && bench_inflate(path, profile.name, report);
+    if (ok) {
+        Xp3Archive archive(path.c_str());
+        ok = archive.ReadIndex();
+        archive.EnableInflateCheckpoints();
+        ok = ok && bench_seek(archive, profile.name, "checkpoints", report);
+    }
+    if (!keep) {
+        remove(path.c_str());
+    }
+    return ok;
+}
+
+// Archive reads closer than this to the end of the previous one count as sequential, read-ahead absorbs the gap
+inline const uint64_t REPLAY_SEEK_TOLERANCE = 128 << 10;
+
+// Evict the archive from the page cache so the next replay reads from disk
+static bool drop_page_cache(const std::string& path) {
+#if _WIN32
+    return false;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    // Dirty pages are not dropped
+    fsync(fd);
+    bool ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+/**
+ * @brief Count the archive seeks of the traced reads from the segment layout
+ *
+ * Offsets inside compressed segments are mapped proportionally to the packed data.
+ */
+static void count_replay_seeks(const std::vector<AccessTrace::Event>& events, const std::vector<FileEntry>& entries, uint64_t& seeks, uint64_t& distance) {
+    seeks = 0;
+    distance = 0;
+    uint64_t last_end = UINT64_MAX;
+    for (auto& event: events) {
+        if (event.type != ACCESS_TRACE_READ || event.size == 0 || entries[event.file].segments.empty()) continue;
+        const FileEntry& entry = entries[event.file];
+        uint64_t begin = event.offset;
+        uint64_t end = event.offset + event.size;
+        uint64_t seg_pos = 0;
+        for (auto& seg: entry.segments) {
+            uint64_t seg_end = seg_pos + seg.original_size;
+            if (seg_end > begin && seg_pos < end && seg.original_size > 0) {
+                uint64_t a = std::max(begin, seg_pos) - seg_pos;
+                uint64_t b = std::min(end, seg_end) - seg_pos;
+                double ratio = (double)seg.packed_size / seg.original_size;
+                uint64_t start = seg.start + (uint64_t)(a * ratio);
+                uint64_t stop = seg.start + (uint64_t)(b * ratio);
+                if (last_end != UINT64_MAX) {
+                    uint64_t gap = start > last_end ? start - last_end : last_end - start;
+                    if (gap > REPLAY_SEEK_TOLERANCE) {
+                        seeks++;
+                        distance += gap;
+                    }
+                }
+                last_end = stop;
+            }
+            seg_pos = seg_end;
+        }
+    }
+}
+
+// Perform the traced opens, seeks and reads as fast as possible
+static bool replay_events(Xp3Archive& archive, const std::vector<AccessTrace::Event>& events, const std::vector<size_t>& indexes, uint64_t& total) {
+    std::vector<std::unique_ptr<Xp3File>> open_files(indexes.size());
+    std::vector<uint8_t> buffer(1 << 20);
+    total = 0;
+    for (auto& event: events) {
+        if (indexes[event.file] == SIZE_MAX) continue;
+        auto& file = open_files[event.file];
+        if (event.type == ACCESS_TRACE_OPEN || !file) {
+            file.reset(archive.OpenFile(indexes[event.file]));
+        }
+        // Reads at the end of the file return nothing
+        if (event.type == ACCESS_TRACE_READ && event.size == 0) continue;
+        if (event.type == ACCESS_TRACE_SEEK || (event.type == ACCESS_TRACE_READ && (uint64_t)file->tell() != event.offset)) {
+            if (!file->seek(event.offset, SEEK_SET)) return false;
+        }
+        if (event.type != ACCESS_TRACE_READ) continue;
+        uint64_t left = event.size;
+        while (left > 0) {
+            size_t r = file->read(buffer.data(), (size_t)std::min<uint64_t>(left, buffer.size()));
+            if (r == 0) {
+                // The traced file can be shorter here, e.g. a duplicated name resolves to its last entry
+                if (file->error()) return false;
+                break;
+            }
+            left -= r;
+            total += r;
+        }
+    }
+    return true;
+}
+
+static bool run_replay(const std::string& trace_path, const std::vector<std::string>& archives, Report& report) {
+    AccessTrace trace;
+    if (!trace.Load(trace_path)) {
+        return false;
+    }
+    auto events = trace.GetEvents();
+    auto names = trace.GetFileNames();
+    std::stable_sort(events.begin(), events.end(), [](const AccessTrace::Event& a, const AccessTrace::Event& b) { return a.time < b.time; });
+    uint64_t first_seeks = 0;
+    double first_cold = 0;
+    for (size_t n = 0; n < archives.size(); n++) {
+        const std::string& path = archives[n];
+        Xp3Archive archive(path.c_str(), false);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", path.c_str());
+            return false;
+        }
+        std::vector<size_t> indexes(names.size(), SIZE_MAX);
+        std::vector<FileEntry> entries(names.size());
+        size_t missing = 0;
+        for (size_t i = 0; i < names.size(); i++) {
+            if (archive.Find(names[i], indexes[i])) {
+                entries[i] = archive.GetFileEntry(indexes[i]);
+            } else {
+                indexes[i] = SIZE_MAX;
+                missing++;
+            }
+        }
+        if (missing) {
+            printf("%s: %zu traced files not found\n", path.c_str(), missing);
+        }
+        std::string label = fileop::filename(path);
+        std::replace(label.begin(), label.end(), ' ', '_');
+        uint64_t seeks, distance;
+        count_replay_seeks(events, entries, seeks, distance);
+        report.Add("replay", label + ".seeks", (double)seeks, "seeks");
+        report.Add("replay", label + ".seek_distance", distance / 1048576.0, "MiB");
+        bool cold = drop_page_cache(path);
+        uint64_t total;
+        uint64_t start = time_util::time_ns64();
+        if (!replay_events(archive, events, indexes, total)) {
+            printf("Replay failed on %s\n", path.c_str());
+            return false;
+        }
+        double cold_ms = elapsed_ms(start, time_util::time_ns64());
+        if (cold) {
+            report.Add("replay", label + ".cold_load", cold_ms, "ms");
+        } else {
+            printf("Page cache could not be dropped, no cold load time for %s\n", path.c_str());
+        }
+        double best = 0;
+        for (int pass = 0; pass < 3; pass++) {
+            start = time_util::time_ns64();
+            replay_events(archive, events, indexes, total);
+            double ms = elapsed_ms(start, time_util::time_ns64());
+            if (pass == 0 || ms < best) best = ms;
+        }
+        report.Add("replay", label + ".warm_load", best, "ms");
+        if (n == 0) {
+            first_seeks = seeks;
+            first_cold = cold ? cold_ms : 0;
+        } else {
+            printf("%s vs %s: %.1f%% fewer seeks", label.c_str(), fileop::filename(archives[0]).c_str(), first_seeks ? 100.0 * ((double)first_seeks - (double)seeks) / first_seeks : 0.0);
+            if (cold && first_cold > 0) printf(", %.1f%% faster cold load", 100.0 * (first_cold - cold_ms) / first_cold);
+            printf("\n");
+        }
+    }
+    return true;
+}
+
+// Units where a larger value is better, the rest are latencies
+static bool higher_is_better(const std::string& unit) {
+    return unit == "MB/s" || unit == "ops/s" || unit == "x";
+}
+
+static bool compare_reports(const std::vector<ReportLine>& baseline, const std::vector<ReportLine>& current, double threshold) {
+    std::map<std::string, const ReportLine*> base;
+    for (auto& line: baseline) {
+        base[line.scenario + " " + line.metric] = &line;
+    }
+    size_t regressions = 0;
+    printf("\n%-37s %14s %14s %9s\n", "metric", "baseline", "current", "change");
+    for (auto& line: current) {
+        if (line.unit == "count" || line.unit == "bytes") continue;
+        auto it = base.find(line.scenario + " " + line.metric);
+        if (it == base.end() || it->second->value <= 0) continue;
+        double change = (line.value - it->second->value) / it->second->value * 100;
+        double worse = higher_is_better(line.unit) ? -change : change;
+        bool regression = worse > threshold;
+        if (regression) regressions++;
+        printf("%-37s %14.3f %14.3f %+8.1f%%%s\n", (line.scenario + " " + line.metric).c_str(), it->second->value, line.value, change, regression ? " REGRESSION" : "");
+    }
+    printf("%zu regressions over %.1f%%\n", regressions, threshold);
+    return regressions == 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args(argv, argv + argc);
+    std::string dir = ".";
+    std::string output;
+    std::string baseline;
+    std::string only;
+    double threshold = 10;
+    bool quick = false;
+    bool keep = false;
+    std::string replay_trace;
+    std::vector<std::string> replay_archives;
+    for (size_t i = 1; i < args.size(); i++) {
+        bool has_value = i + 1 < args.size();
+        if (args[i] == "--quick") {
+            quick = true;
+        } else if (args[i] == "--keep") {
+            keep = true;
+        } else if (args[i] == "--dir" && has_value) {
+            dir = args[++i];
+        } else if (args[i] == "-o" && has_value) {
+            output = args[++i];
+        } else if (args[i] == "--compare" && has_value) {
+            baseline = args[++i];
+        } else if (args[i] == "--threshold" && has_value) {
+            threshold = atof(args[++i].c_str());
+        } else if (args[i] == "--scenario" && has_value) {
+            only = args[++i];
+        } else if (args[i] == "--replay" && has_value) {
+            replay_trace = args[++i];
+        } else if (!replay_trace.empty() && args[i][0] != '-') {
+            replay_archives.push_back(args[i]);
+        } else {
+            printf("Usage: %s [--quick] [--dir DIR] [--keep] [--scenario NAME] [-o REPORT] [--compare BASELINE] [--threshold PERCENT]\n", args[0].c_str());
+            printf("       %s --replay TRACE ARCHIVE... [-o REPORT] [--compare BASELINE] [--threshold PERCENT]\n", args[0].c_str());
+            printf("  Generates synthetic archives in DIR and measures index parse time, open latency,\n");
+            printf("  sequential and random read throughput, seek latency and multi-threaded scaling.\n");
+            printf("  Scenarios:");
+            for (auto& profile: profiles) printf(" %s", profile.name);
+            printf("\n  --replay replays an access trace on each archive and reports seeks, cold and warm load time.\n");
+            printf("  --compare exits with 1 if a metric is worse than BASELINE by more than PERCENT (default 10).\n");
+            return 1;
+        }
+    }
+    Report report;
+    if (!replay_trace.empty()) {
+        if (replay_archives.empty()) {
+            printf("No archives to replay %s on\n", replay_trace.c_str());
+            return 1;
+        }
+        printf("xp3vfs-bench report %d, replay of %s\n", BENCH_REPORT_VERSION, replay_trace.c_str());
+        if (!run_replay(replay_trace, replay_archives, report)) {
+            return 1;
+        }
+    } else {
+        printf("xp3vfs-bench report %d%s, warm page cache, inflate backend %s\n", BENCH_REPORT_VERSION, quick ? " (quick)" : "", get_inflate_backend());
+        bool found = false;
+        for (auto& profile: profiles) {
+            if (!only.empty() && only != profile.name) continue;
+            found = true;
+            if (!run_scenario(profile, dir, quick, keep, report)) {
+                printf("Scenario %s failed\n", profile.name);
+                return 1;
+            }
+        }
+        if (!found) {
+            printf("Unknown scenario %s\n", only.c_str());
+            return 1;
+        }
+    }
+    if (!output.empty() && !report.Save(output)) {
+        return 1;
+    }
+    if (!baseline.empty()) {
+        std::vector<ReportLine> lines;
+        if (!Report::Load(baseline, lines)) {
+            return 1;
+        }
+        if (!compare_reports(lines, report.GetLines(), threshold)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -8,6 +8,95 @@
 #include <inttypes.h>
 #include "time_util.h"
 #include "zlib.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include "thread_pool.h"
+#include "decompressor.h"
+#include "xp3_writer.h"
+#include "overlay.h"
+#include <filesystem>
+
+// Parse "-j N" after position start. 0 means all hardware threads.
+static unsigned parse_jobs(const std::vector<std::string>& args, size_t start) {
+    for (size_t i = start; i + 1 < args.size(); i++) {
+        if (args[i] == "-j") {
+            unsigned jobs = (unsigned)strtoul(args[i + 1].c_str(), nullptr, 10);
+            if (jobs == 0) {
+                jobs = std::thread::hardware_concurrency();
+            }
+            return jobs ? jobs : 1;
+        }
+    }
+    return 1;
+}
+
+static bool has_flag(const std::vector<std::string>& args, size_t start, const char* flag) {
+    for (size_t i = start; i < args.size(); i++) {
+        if (args[i] == flag) return true;
+    }
+    return false;
+}
+
+// Value after "name" at or after position start, nullptr if absent
+static const char* get_option(const std::vector<std::string>& args, size_t start, const char* name) {
+    for (size_t i = start; i + 1 < args.size(); i++) {
+        if (args[i] == name) return args[i + 1].c_str();
+    }
+    return nullptr;
+}
+
+// Parse the options of pack and repack after position start
+static bool parse_writer_options(const std::vector<std::string>& args, size_t start, Xp3WriterOptions& options) {
+    options.threads = get_option(args, start, "-j") ? parse_jobs(args, start) : 0;
+    if (auto method = get_option(args, start, "--method")) {
+        std::string name = method;
+        if (name == "store") {
+            options.compression = Xp3Compression::Store;
+        } else if (name == "zlib") {
+            options.compression = Xp3Compression::Zlib;
+        } else if (name == "zstd") {
+            options.compression = Xp3Compression::Zstd;
+        } else {
+            printf("Unknown compression method %s\n", method);
+            return false;
+        }
+    }
+    if (auto level = get_option(args, start, "--level")) {
+        options.level = atoi(level);
+    }
+    if (auto size = get_option(args, start, "--segment-size")) {
+        options.segment_size = strtoull(size, nullptr, 10);
+    }
+    options.deduplicate = !has_flag(args, start, "--no-dedup");
+    return true;
+}
+
+static void print_writer_stats(const Xp3Writer& writer, double elapsed_sec) {
+    auto stats = writer.GetStats();
+    printf("Packed %" PRIu64 " files (%" PRIu64 " bytes) into %" PRIu64 " bytes of segments and a %" PRIu64 " byte index in %.6f seconds\n", stats.files, stats.original_bytes, stats.written_bytes, stats.index_bytes, elapsed_sec);
+    printf("Segments: %" PRIu64 ", shared: %" PRIu64 "\n", stats.segments, stats.shared_segments);
+}
+
+static std::string json_escape(const std::string& str) {
+    std::string result;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result.push_back('\\');
+            result.push_back(c);
+        } else if ((uint8_t)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)(uint8_t)c);
+            result += buf;
+        } else {
+            result.push_back(c);
+        }
+    }
+    return result;
+}
 
 int main(int argc, char* argv[]) {
 #if _WIN32
@@ -26,10 +115,22 @@ int main(int argc, char* argv[]) {
     }
 #endif
     if (args.size() < 3) {
-        printf("Usage: %s extract <xp3 file> Extract files\n", args[0].c_str());
+        printf("Usage: %s extract <xp3 file> [-j N] Extract files with N threads (0 for all cores)\n", args[0].c_str());
         printf("       %s ls <xp3 file> List files in the archive\n", args[0].c_str());
-        printf("       %s speedtest <xp3 file> Test extraction speed (no files will be written)\n", args[0].c_str());
-        printf("       %s verify <xp3 file> Verify integrity of files in the archive\n", args[0].c_str());
+        printf("       %s speedtest <xp3 file> [--trace OUT] Test extraction speed (no files will be written), optionally recording an access trace\n", args[0].c_str());
+        printf("       %s verify <xp3 file> [-j N] [--json] Verify integrity of files in the archive\n", args[0].c_str());
+        printf("       %s lsdir <xp3 file> [directory] List a directory in the archive\n", args[0].c_str());
+        printf("       %s find <xp3 file> <path> Find a file by path (case-insensitive)\n", args[0].c_str());
+        printf("       %s indexstat <xp3 file> [cache file] Report index parse time and memory usage\n", args[0].c_str());
+        printf("       %s cachetest <xp3 file> [rounds] Read all files several times through the shared segment cache\n", args[0].c_str());
+        printf("       %s scaletest <xp3 file> [max threads] Test read throughput with increasing thread count\n", args[0].c_str());
+        printf("       %s pack <directory> <xp3 file> [options] Pack a directory into a new archive\n", args[0].c_str());
+        printf("       %s repack <xp3 file> <new xp3 file> [options] Rewrite an archive\n", args[0].c_str());
+        printf("         options: -j N (default all cores), --method store|zlib|zstd, --level N, --segment-size BYTES (0 to not split), --no-dedup\n");
+        printf("         repack --layout-from TRACE orders the data by an access trace, recorded with speedtest --trace\n");
+        printf("       %s dictstat <xp3 file> [dictionary files...] Read all files and report zstd dictionary decode speed\n", args[0].c_str());
+        printf("       %s overlay <xp3 file> [patch xp3 files...] List the merged files, later archives override earlier ones\n", args[0].c_str());
+        printf("       %s stats <xp3 file> [-j N] [--atomic] Read, seek and bulk read every file, then print I/O and decode counters\n", args[0].c_str());
         return 1;
     }
     std::string action = args[1];
@@ -52,47 +153,147 @@ int main(int argc, char* argv[]) {
                 printf("  Segment: start=%" PRIu64 ", original_size=%" PRIu64 ", packed_size=%" PRIu64 ", flag=0x%X, count=%" PRIu64 "\n", seg.start, seg.original_size, seg.packed_size, seg.flag, seg_counter[seg.start]);
             }
         }
-    } else if (action == "extract") {
-        const size_t chunk_size = 8192;
-        uint8_t buffer[chunk_size];
+    } else if (action == "lsdir") {
         Xp3Archive archive(xp3file.c_str(), false);
+        archive.SetPathFlags(XP3_PATH_CASE_INSENSITIVE | XP3_PATH_NORMALIZE_SEPARATOR);
         if (!archive.ReadIndex()) {
             printf("Failed to read index from %s\n", xp3file.c_str());
             return 1;
         }
-        for (const auto& file: archive.files) {
-            printf("Extracting %s ... ", file.filename.c_str());
-            Xp3File* inf = archive.OpenFile(file);
+        std::string dir = args.size() > 3 ? args[3] : "";
+        DirectoryTree::Node node;
+        if (!archive.ListDirectory(dir, node)) {
+            printf("Directory %s not found\n", dir.c_str());
+            return 1;
+        }
+        for (const auto& sub : node.subdirs) {
+            printf("%s/\n", sub.c_str());
+        }
+        for (auto index : node.files) {
+            const auto& file = archive.files[index];
+            printf("%s (original size: %" PRIu64 ", packed size: %" PRIu64 ")\n", file.filename.c_str(), file.original_size, file.packed_size);
+        }
+    } else if (action == "find") {
+        if (args.size() < 4) {
+            printf("Usage: %s find <xp3 file> <path>\n", args[0].c_str());
+            return 1;
+        }
+        Xp3Archive archive(xp3file.c_str(), false);
+        archive.SetPathFlags(XP3_PATH_CASE_INSENSITIVE | XP3_PATH_NORMALIZE_SEPARATOR);
+        // Only the entry found is decoded
+        archive.SetLazyIndex(true);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        size_t index;
+        if (!archive.Find(args[3], index)) {
+            printf("%s not found\n", args[3].c_str());
+            return 1;
+        }
+        FileEntry file = archive.GetFileEntry(index);
+        printf("%s (index: %zu, original size: %" PRIu64 ", packed size: %" PRIu64 ", segments: %zu)\n", file.filename.c_str(), index, file.original_size, file.packed_size, file.segments.size());
+    } else if (action == "extract") {
+        unsigned jobs = parse_jobs(args, 3);
+        Xp3Archive archive(xp3file.c_str(), jobs > 1);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        archive.LoadZstdDictionaries();
+        std::string output_dir = fileop::filename(xp3file);
+        std::vector<std::string> output_paths(archive.files.size());
+        std::unordered_set<std::string> created_dirs;
+        for (size_t i = 0; i < archive.files.size(); i++) {
+            output_paths[i] = fileop::join(output_dir, archive.files[i].filename);
+            size_t sep = output_paths[i].find_last_of("/\\");
+            std::string dir = sep == std::string::npos ? std::string() : output_paths[i].substr(0, sep);
+            if (created_dirs.insert(dir).second) {
+                fileop::mkdir_for_file(output_paths[i], 0);
+            }
+        }
+        // Archives may hold several entries with the same name. Only the last one is written, it is the
+        // one Find resolves to, and no two workers write the same output file.
+        std::unordered_map<std::string, size_t> last_entry;
+        for (size_t i = 0; i < output_paths.size(); i++) {
+            last_entry[output_paths[i]] = i;
+        }
+        std::vector<size_t> order;
+        order.reserve(archive.files.size());
+        for (size_t i = 0; i < archive.files.size(); i++) {
+            if (last_entry[output_paths[i]] == i) {
+                order.push_back(i);
+            } else {
+                printf("Skipping %s, overridden by a later entry\n", archive.files[i].filename.c_str());
+            }
+        }
+        if (jobs > 1) {
+            // Largest first keeps workers busy until the end
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return archive.files[a].packed_size > archive.files[b].packed_size; });
+        }
+        std::mutex print_mutex;
+        auto extract_file = [&](size_t index, std::vector<uint8_t>& buffer) {
+            const auto& file = archive.files[index];
+            const std::string& filename = output_paths[index];
+            Xp3File* inf = archive.OpenFile(index);
             if (!inf) {
+                std::lock_guard<std::mutex> guard(print_mutex);
                 printf("Failed to open file %s\n", file.filename.c_str());
-                continue;
+                return;
             }
-            std::string filename = fileop::join(fileop::filename(xp3file), file.filename);
-            fileop::mkdir_for_file(filename, 0);
             FILE* outfp = fileop::fopen(filename, "wb");
             if (!outfp) {
+                std::lock_guard<std::mutex> guard(print_mutex);
                 printf("Failed to open output file %s\n", filename.c_str());
                 delete inf;
-                continue;
+                return;
             }
+            // Writes are already in large chunks
+            setvbuf(outfp, nullptr, _IONBF, 0);
             uint64_t total_written = 0;
+            bool write_failed = false;
             while (true) {
-                size_t r = inf->read(buffer, chunk_size);
+                size_t r = inf->read(buffer.data(), buffer.size());
                 if (r == 0) break;
-                size_t written = fwrite(buffer, 1, r, outfp);
+                size_t written = fwrite(buffer.data(), 1, r, outfp);
                 if (written != r) {
-                    printf("Failed to write to output file %s\n", filename.c_str());
+                    write_failed = true;
                     break;
                 }
                 total_written += written;
             }
             fclose(outfp);
-            if (total_written != file.original_size) {
+            delete inf;
+            std::lock_guard<std::mutex> guard(print_mutex);
+            printf("Extracting %s ... ", file.filename.c_str());
+            if (write_failed) {
+                printf("Failed to write to output file %s\n", filename.c_str());
+            } else if (total_written != file.original_size) {
                 printf("Warning: extracted size (%" PRIu64 ") does not match original size (%" PRIu64 ")\n", total_written, file.original_size);
             } else {
                 printf("Done (%" PRIu64 " bytes)\n", total_written);
             }
-            delete inf;
+        };
+        const size_t chunk_size = 1 << 20;
+        if (jobs <= 1) {
+            std::vector<uint8_t> buffer(chunk_size);
+            for (auto index : order) {
+                extract_file(index, buffer);
+            }
+        } else {
+            std::atomic<size_t> next(0);
+            ThreadPool pool(jobs);
+            for (size_t i = 0; i < pool.Size(); i++) {
+                pool.Submit([&]() {
+                    std::vector<uint8_t> buffer(chunk_size);
+                    while (true) {
+                        size_t n = next++;
+                        if (n >= order.size()) break;
+                        extract_file(order[n], buffer);
+                    }
+                });
+            }
+            pool.Wait();
         }
     } else if (action == "speedtest") {
         const size_t chunk_size = 8192;
@@ -103,6 +304,13 @@ int main(int argc, char* argv[]) {
             printf("Failed to read index from %s\n", xp3file.c_str());
             return 1;
         }
+        archive.LoadZstdDictionaries();
+        auto trace_path = get_option(args, 3, "--trace");
+        std::shared_ptr<AccessTrace> trace;
+        if (trace_path) {
+            trace = std::make_shared<AccessTrace>();
+            archive.SetAccessTrace(trace);
+        }
         uint64_t total_size = 0;
         for (const auto& file: archive.files) {
             Xp3File* inf = archive.OpenFile(file);
@@ -119,17 +327,175 @@ int main(int argc, char* argv[]) {
             total_size += total_read;
             delete inf;
         }
-        auto end_time = time_util::time_ns();
+        auto end_time = time_util::time_ns64();
         double elapsed_sec = (end_time - start_time) / 1e9;
         double speed = total_size / elapsed_sec / (1024 * 1024);
         printf("Extracted %" PRIu64 " bytes in %.6f seconds (%.2f MB/s)\n", total_size, elapsed_sec, speed);
+        auto pool_stats = DecompressorPool::GetStats();
+        printf("Decompressor contexts: %" PRIu64 " created, %" PRIu64 " reused\n", pool_stats.created, pool_stats.reused);
+        if (trace) {
+            if (!trace->Save(trace_path)) {
+                printf("Failed to save access trace to %s\n", trace_path);
+                return 1;
+            }
+            printf("Saved access trace to %s\n", trace_path);
+        }
         return 0;
-    } else if (action == "verify") {
+    } else if (action == "indexstat") {
+        for (int compact = 0; compact < 2; compact++) {
+            Xp3Archive archive(xp3file.c_str(), false);
+            archive.SetCompactIndex(compact);
+            auto start_time = time_util::time_ns64();
+            if (!archive.ReadIndex()) {
+                printf("Failed to read index from %s\n", xp3file.c_str());
+                return 1;
+            }
+            auto end_time = time_util::time_ns64();
+            printf("%s index: %zu files, parsed in %.6f seconds, %zu bytes of memory\n", compact ? "Compact" : "Default", archive.GetFileCount(), (end_time - start_time) / 1e9, archive.GetIndexMemoryUsage());
+        }
+        for (int compact = 0; compact < 2; compact++) {
+            Xp3Archive archive(xp3file.c_str());
+            archive.SetCompactIndex(compact);
+            auto start_time = time_util::time_ns64();
+            if (!archive.ReadIndexInBackground()) {
+                printf("Failed to read index from %s\n", xp3file.c_str());
+                return 1;
+            }
+            Xp3File* first = archive.OpenFile((size_t)0);
+            auto first_time = time_util::time_ns64();
+            if (first) {
+                first->close();
+                delete first;
+            }
+            if (!archive.WaitIndex()) {
+                printf("Failed to read index from %s\n", xp3file.c_str());
+                return 1;
+            }
+            auto end_time = time_util::time_ns64();
+            printf("%s streaming index: %zu files, first file opened after %.6f seconds, parsed in %.6f seconds, %zu bytes of memory\n", compact ? "Compact" : "Default", archive.GetFileCount(), (first_time - start_time) / 1e9, (end_time - start_time) / 1e9, archive.GetIndexMemoryUsage());
+        }
+        {
+            Xp3Archive archive(xp3file.c_str(), false);
+            archive.SetLazyIndex(true);
+            auto start_time = time_util::time_ns64();
+            if (!archive.ReadIndex()) {
+                printf("Failed to read index from %s\n", xp3file.c_str());
+                return 1;
+            }
+            auto end_time = time_util::time_ns64();
+            double open_time = 0;
+            if (archive.GetFileCount() > 0) {
+                std::string path(archive.GetFileName(archive.GetFileCount() / 2));
+                auto open_start = time_util::time_ns64();
+                Xp3File* file = archive.OpenFile(std::string_view(path));
+                open_time = (time_util::time_ns64() - open_start) / 1e9;
+                if (file) {
+                    file->close();
+                    delete file;
+                }
+            }
+            printf("Lazy index: %zu files, first pass in %.6f seconds, file opened by path in %.6f seconds, %zu entries decoded, %zu bytes of memory\n", archive.GetFileCount(), (end_time - start_time) / 1e9, open_time, archive.GetDecodedFileCount(), archive.GetIndexMemoryUsage());
+        }
+        if (args.size() > 3) {
+            for (int pass = 0; pass < 2; pass++) {
+                Xp3Archive archive(xp3file.c_str(), false);
+                archive.SetCompactIndex(true);
+                archive.SetIndexCache(args[3]);
+                auto start_time = time_util::time_ns64();
+                if (!archive.ReadIndex()) {
+                    printf("Failed to read index from %s\n", xp3file.c_str());
+                    return 1;
+                }
+                auto end_time = time_util::time_ns64();
+                printf("Cached index: %zu files, %s in %.6f seconds\n", archive.GetFileCount(), archive.IsIndexFromCache() ? "loaded from cache" : "parsed", (end_time - start_time) / 1e9);
+            }
+        }
+    } else if (action == "cachetest") {
+        int rounds = 3;
+        if (args.size() > 3) {
+            rounds = atoi(args[3].c_str());
+        }
         Xp3Archive archive(xp3file.c_str(), false);
+        archive.EnableSegmentCache(64 << 20);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        const size_t chunk_size = 65536;
+        std::vector<uint8_t> buffer(chunk_size);
+        for (int round = 0; round < rounds; round++) {
+            auto start_time = time_util::time_ns64();
+            uint64_t total_size = 0;
+            for (size_t i = 0; i < archive.files.size(); i++) {
+                Xp3File* inf = archive.OpenFile(i);
+                while (true) {
+                    size_t r = inf->read(buffer.data(), chunk_size);
+                    if (r == 0) break;
+                    total_size += r;
+                }
+                delete inf;
+            }
+            auto end_time = time_util::time_ns64();
+            double elapsed_sec = (end_time - start_time) / 1e9;
+            SegmentCache::Stats stats;
+            archive.GetSegmentCacheStats(stats);
+            printf("Round %d: %.2f MB/s, hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64 ", cached: %zu segments (%zu bytes)\n", round + 1, total_size / elapsed_sec / (1024 * 1024), stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+        }
+    } else if (action == "scaletest") {
+        unsigned max_threads = std::thread::hardware_concurrency();
+        if (args.size() > 3) {
+            max_threads = (unsigned)strtoul(args[3].c_str(), nullptr, 10);
+        }
+        if (max_threads == 0) max_threads = 1;
+        Xp3Archive archive(xp3file.c_str(), true);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        for (unsigned threads = 1;; threads = threads * 2 > max_threads ? max_threads : threads * 2) {
+            std::atomic<size_t> next_file(0);
+            std::atomic<uint64_t> total_size(0);
+            auto worker = [&]() {
+                const size_t chunk_size = 65536;
+                std::vector<uint8_t> buffer(chunk_size);
+                uint64_t total_read = 0;
+                while (true) {
+                    size_t index = next_file++;
+                    if (index >= archive.files.size()) break;
+                    Xp3File* inf = archive.OpenFile(index);
+                    if (!inf) continue;
+                    while (true) {
+                        size_t r = inf->read(buffer.data(), chunk_size);
+                        if (r == 0) break;
+                        total_read += r;
+                    }
+                    delete inf;
+                }
+                total_size += total_read;
+            };
+            auto start_time = time_util::time_ns64();
+            std::vector<std::thread> workers;
+            for (unsigned i = 0; i < threads; i++) {
+                workers.emplace_back(worker);
+            }
+            for (auto& t : workers) {
+                t.join();
+            }
+            auto end_time = time_util::time_ns64();
+            double elapsed_sec = (end_time - start_time) / 1e9;
+            double speed = total_size / elapsed_sec / (1024 * 1024);
+            printf("%2u threads: %" PRIu64 " bytes in %.6f seconds (%.2f MB/s)\n", threads, total_size.load(), elapsed_sec, speed);
+            if (threads == max_threads) break;
+        }
+    } else if (action == "verify") {
+        unsigned jobs = parse_jobs(args, 3);
+        bool json = has_flag(args, 3, "--json");
+        Xp3Archive archive(xp3file.c_str(), jobs > 1);
         if (!archive.ReadIndex()) {
             printf("Failed to read index from %s\n", xp3file.c_str());
             return 1;
         }
+        archive.LoadZstdDictionaries();
         bool is_all_zero = true;
         for (const auto& f : archive.files) {
             if (f.adler32 != 0) {
@@ -138,44 +504,341 @@ int main(int argc, char* argv[]) {
             }
         }
         if (is_all_zero) {
-            printf("No checksums found in the archive.\n");
+            if (json) {
+                printf("{\"summary\":true,\"ok\":0,\"failed\":0,\"skipped\":%zu,\"bytes\":0,\"seconds\":0,\"mb_per_s\":0}\n", archive.files.size());
+            } else {
+                printf("No checksums found in the archive.\n");
+            }
             return 0;
         }
-        const size_t chunk_size = 8192;
-        uint8_t buffer[chunk_size];
-        uint64_t ok_files = 0, failed_files = 0;
-        for (const auto& f : archive.files) {
+        // Multi-segment files at least this large are verified per segment and merged with adler32_combine
+        const uint64_t split_size = 4 << 20;
+        struct VerifyState {
+            size_t index;
+            std::vector<uint32_t> adlers;
+            std::vector<uint64_t> sizes;
+            std::vector<uint64_t> readed;
+            std::atomic<size_t> remaining;
+            std::atomic<bool> failed;
+        };
+        struct VerifyTask {
+            VerifyState* state;
+            size_t part;
+            uint64_t offset;
+            uint64_t length;
+        };
+        std::vector<std::unique_ptr<VerifyState>> states;
+        std::vector<VerifyTask> tasks;
+        uint64_t skipped_files = 0;
+        for (size_t i = 0; i < archive.files.size(); i++) {
+            const auto& f = archive.files[i];
             if (f.adler32 == 0) {
-                printf("Skipping %s (no checksum)\n", f.filename.c_str());
+                if (json) {
+                    printf("{\"file\":\"%s\",\"status\":\"skipped\"}\n", json_escape(f.filename).c_str());
+                } else {
+                    printf("Skipping %s (no checksum)\n", f.filename.c_str());
+                }
+                skipped_files++;
                 continue;
             }
-            printf("Verifying %s ... ", f.filename.c_str());
-            Xp3File* inf = archive.OpenFile(f);
-            if (!inf) {
-                printf("Failed to open file %s\n", f.filename.c_str());
-                continue;
+            std::unique_ptr<VerifyState> state(new VerifyState());
+            state->index = i;
+            state->failed = false;
+            if (jobs > 1 && f.segments.size() > 1 && f.original_size >= split_size) {
+                uint64_t offset = 0;
+                for (size_t k = 0; k < f.segments.size(); k++) {
+                    tasks.push_back({ state.get(), k, offset, f.segments[k].original_size });
+                    state->sizes.push_back(f.segments[k].original_size);
+                    offset += f.segments[k].original_size;
+                }
+            } else {
+                // Read to the end like a normal reader would
+                tasks.push_back({ state.get(), 0, 0, UINT64_MAX });
+                state->sizes.push_back(f.original_size);
             }
-            uint32_t adler = 1;
-            uint64_t total_read = 0;
-            while (true) {
-                size_t r = inf->read(buffer, chunk_size);
-                if (r == 0) break;
-                adler = adler32(adler, buffer, (uInt)r);
-                total_read += r;
+            state->adlers.resize(state->sizes.size());
+            state->readed.resize(state->sizes.size());
+            state->remaining = state->sizes.size();
+            states.push_back(std::move(state));
+        }
+        std::stable_sort(tasks.begin(), tasks.end(), [&](const VerifyTask& a, const VerifyTask& b) {
+            return std::min(a.length, archive.files[a.state->index].original_size) > std::min(b.length, archive.files[b.state->index].original_size);
+        });
+        std::mutex print_mutex;
+        std::atomic<uint64_t> ok_files(0), failed_files(0), total_bytes(0);
+        auto finish_file = [&](VerifyState& state) {
+            const auto& f = archive.files[state.index];
+            uint32_t adler = state.adlers[0];
+            uint64_t total_read = state.readed[0];
+            for (size_t k = 1; k < state.adlers.size(); k++) {
+                adler = adler32_combine(adler, state.adlers[k], (z_off_t)state.readed[k]);
+                total_read += state.readed[k];
             }
-            delete inf;
-            if (total_read != f.original_size) {
-                printf("Failed (extracted size %" PRIu64 " does not match original size %" PRIu64 ")\n", total_read, f.original_size);
+            std::lock_guard<std::mutex> guard(print_mutex);
+            const char* status = "ok";
+            if (state.failed) {
+                status = "error";
+                failed_files++;
+            } else if (total_read != f.original_size || adler != f.adler32) {
+                status = "failed";
                 failed_files++;
-            } else if (adler != f.adler32) {
-                printf("Failed (checksum mismatch: calculated 0x%08X, expected 0x%08X)\n", adler, f.adler32);
-                failed_files++; 
             } else {
-                printf("OK\n");
                 ok_files++;
             }
+            if (json) {
+                printf("{\"file\":\"%s\",\"status\":\"%s\",\"size\":%" PRIu64 ",\"read\":%" PRIu64 ",\"expected\":\"0x%08X\",\"actual\":\"0x%08X\",\"segments\":%zu}\n", json_escape(f.filename).c_str(), status, f.original_size, total_read, f.adler32, adler, f.segments.size());
+            } else if (state.failed) {
+                printf("Verifying %s ... Failed to open file\n", f.filename.c_str());
+            } else if (total_read != f.original_size) {
+                printf("Verifying %s ... Failed (extracted size %" PRIu64 " does not match original size %" PRIu64 ")\n", f.filename.c_str(), total_read, f.original_size);
+            } else if (adler != f.adler32) {
+                printf("Verifying %s ... Failed (checksum mismatch: calculated 0x%08X, expected 0x%08X)\n", f.filename.c_str(), adler, f.adler32);
+            } else {
+                printf("Verifying %s ... OK\n", f.filename.c_str());
+            }
+        };
+        auto run_task = [&](const VerifyTask& task, std::vector<uint8_t>& buffer) {
+            VerifyState& state = *task.state;
+            Xp3File* inf = archive.OpenFile(state.index);
+            uint32_t adler = 1;
+            uint64_t total_read = 0;
+            if (!inf || (task.offset && !inf->seek(task.offset, SEEK_SET))) {
+                state.failed = true;
+            } else {
+                while (total_read < task.length) {
+                    size_t to_read = (size_t)std::min<uint64_t>(buffer.size(), task.length - total_read);
+                    size_t r = inf->read(buffer.data(), to_read);
+                    if (r == 0) break;
+                    adler = adler32(adler, buffer.data(), (uInt)r);
+                    total_read += r;
+                }
+            }
+            delete inf;
+            state.adlers[task.part] = adler;
+            state.readed[task.part] = total_read;
+            total_bytes += total_read;
+            if (--state.remaining == 0) {
+                finish_file(state);
+            }
+        };
+        const size_t chunk_size = 1 << 20;
+        auto start_time = time_util::time_ns64();
+        if (jobs <= 1) {
+            std::vector<uint8_t> buffer(chunk_size);
+            for (const auto& task : tasks) {
+                run_task(task, buffer);
+            }
+        } else {
+            std::atomic<size_t> next(0);
+            ThreadPool pool(jobs);
+            for (size_t i = 0; i < pool.Size(); i++) {
+                pool.Submit([&]() {
+                    std::vector<uint8_t> buffer(chunk_size);
+                    while (true) {
+                        size_t n = next++;
+                        if (n >= tasks.size()) break;
+                        run_task(tasks[n], buffer);
+                    }
+                });
+            }
+            pool.Wait();
+        }
+        auto end_time = time_util::time_ns64();
+        double elapsed_sec = (end_time - start_time) / 1e9;
+        double speed = elapsed_sec > 0 ? total_bytes / elapsed_sec / (1024 * 1024) : 0;
+        if (json) {
+            printf("{\"summary\":true,\"ok\":%" PRIu64 ",\"failed\":%" PRIu64 ",\"skipped\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"seconds\":%.6f,\"mb_per_s\":%.2f}\n", ok_files.load(), failed_files.load(), skipped_files, total_bytes.load(), elapsed_sec, speed);
+        } else {
+            printf("Verification completed: %" PRIu64 " files OK, %" PRIu64 " files failed.\n", ok_files.load(), failed_files.load());
+            printf("Verified %" PRIu64 " bytes in %.6f seconds (%.2f MB/s)\n", total_bytes.load(), elapsed_sec, speed);
+        }
+        if (failed_files > 0) {
+            return 1;
+        }
+    } else if (action == "pack") {
+        if (args.size() < 4) {
+            printf("Usage: %s pack <directory> <xp3 file> [options]\n", args[0].c_str());
+            return 1;
+        }
+        Xp3WriterOptions options;
+        if (!parse_writer_options(args, 4, options)) {
+            return 1;
+        }
+        auto start_time = time_util::time_ns64();
+        Xp3Writer writer(options);
+        std::vector<std::pair<std::string, std::string>> files;
+        std::error_code ec;
+        std::filesystem::path root = std::filesystem::u8path(xp3file);
+        for (std::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec)) continue;
+            auto name = it->path().lexically_relative(root).generic_u8string();
+            files.emplace_back(std::string(name.begin(), name.end()), it->path().u8string());
+        }
+        if (ec) {
+            printf("Failed to list %s: %s\n", xp3file.c_str(), ec.message().c_str());
+            return 1;
+        }
+        // Directory iteration order is not stable across file systems
+        std::sort(files.begin(), files.end());
+        for (auto& file : files) {
+            writer.AddLocalFile(file.first, file.second);
+        }
+        if (!writer.Finish(args[3])) {
+            return 1;
+        }
+        print_writer_stats(writer, (time_util::time_ns64() - start_time) / 1e9);
+    } else if (action == "repack") {
+        if (args.size() < 4) {
+            printf("Usage: %s repack <xp3 file> <new xp3 file> [options]\n", args[0].c_str());
+            return 1;
+        }
+        Xp3WriterOptions options;
+        if (!parse_writer_options(args, 4, options)) {
+            return 1;
+        }
+        auto start_time = time_util::time_ns64();
+        Xp3Archive archive(xp3file.c_str(), false);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        archive.LoadZstdDictionaries();
+        Xp3Writer writer(options);
+        std::vector<std::string> names;
+        for (size_t i = 0; i < archive.GetFileCount(); i++) {
+            names.emplace_back(archive.GetFileName(i));
+            writer.AddFile(names.back(), [&archive, i](std::vector<uint8_t>& data) {
+                return archive.ReadAll(i, data);
+            });
+        }
+        if (auto layout = get_option(args, 4, "--layout-from")) {
+            AccessTrace trace;
+            if (!trace.Load(layout)) {
+                return 1;
+            }
+            writer.SetDataOrder(plan_layout(trace, names));
+        }
+        if (!writer.Finish(args[3])) {
+            return 1;
+        }
+        print_writer_stats(writer, (time_util::time_ns64() - start_time) / 1e9);
+    } else if (action == "dictstat") {
+        for (size_t i = 3; i < args.size(); i++) {
+            uint32_t id = ZstdDictionaries::RegisterFile(args[i]);
+            if (!id) {
+                printf("Failed to load zstd dictionary %s\n", args[i].c_str());
+                return 1;
+            }
+            printf("Loaded dictionary %u from %s\n", id, args[i].c_str());
+        }
+        Xp3Archive archive(xp3file.c_str(), false);
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        printf("Loaded %zu dictionaries from the archive\n", archive.LoadZstdDictionaries());
+        std::vector<uint8_t> data;
+        uint64_t failed = 0;
+        for (size_t i = 0; i < archive.GetFileCount(); i++) {
+            if (!archive.ReadAll(i, data)) {
+                printf("Failed to read %s\n", std::string(archive.GetFileName(i)).c_str());
+                failed++;
+            }
+        }
+        auto stats = ZstdDictionaries::GetStats();
+        if (stats.empty()) {
+            printf("No zstd dictionaries registered\n");
+        }
+        for (const auto& dict : stats) {
+            double seconds = dict.nanoseconds / 1e9;
+            double speed = seconds > 0 ? dict.bytes / seconds / (1024 * 1024) : 0;
+            printf("Dictionary %u (%zu bytes): %" PRIu64 " frames, %" PRIu64 " bytes decoded in %.6f seconds (%.2f MB/s)\n", dict.id, dict.size, dict.frames, dict.bytes, seconds, speed);
+        }
+        if (failed > 0) {
+            return 1;
+        }
+    } else if (action == "overlay") {
+        Xp3Overlay overlay(XP3_PATH_CASE_INSENSITIVE | XP3_PATH_NORMALIZE_SEPARATOR);
+        for (size_t i = 2; i < args.size(); i++) {
+            auto start_time = time_util::time_ns64();
+            if (!overlay.Mount(args[i], false)) {
+                return 1;
+            }
+            auto end_time = time_util::time_ns64();
+            printf("Mounted %s in %.6f seconds, %zu files in total\n", args[i].c_str(), (end_time - start_time) / 1e9, overlay.GetFileCount());
+        }
+        for (size_t i = 0; i < overlay.GetFileCount(); i++) {
+            size_t archive_number, file_index;
+            overlay.GetFile(i, archive_number, file_index);
+            auto archive = overlay.GetArchive(archive_number);
+            printf("%s (from: %s)\n", std::string(archive->GetFileName(file_index)).c_str(), args[2 + archive_number].c_str());
+        }
+    } else if (action == "stats") {
+        unsigned jobs = parse_jobs(args, 3);
+        Xp3Archive archive(xp3file.c_str(), true);
+        if (!archive.EnableStats(has_flag(args, 3, "--atomic") ? XP3_STATS_ATOMIC : XP3_STATS_PER_THREAD)) {
+            printf("Built without stats, reconfigure with -Dstats=true\n");
+            return 1;
+        }
+        if (!archive.ReadIndex()) {
+            printf("Failed to read index from %s\n", xp3file.c_str());
+            return 1;
+        }
+        std::atomic<size_t> next_file(0);
+        std::atomic<size_t> failed(0);
+        // Sequential read, then a backward and a forward seek, then a bulk read of the same file
+        auto worker = [&]() {
+            std::vector<uint8_t> buffer(65536);
+            std::vector<uint8_t> data;
+            for (size_t i = next_file++; i < archive.GetFileCount(); i = next_file++) {
+                Xp3File* inf = archive.OpenFile(i);
+                if (!inf) {
+                    failed++;
+                    continue;
+                }
+                uint64_t size = inf->get_original_size();
+                while (inf->read(buffer.data(), buffer.size()) > 0);
+                inf->seek(size / 4, SEEK_SET);
+                inf->read(buffer.data(), 4096);
+                inf->seek(size * 3 / 4, SEEK_SET);
+                inf->read(buffer.data(), 4096);
+                if (inf->error()) {
+                    failed++;
+                }
+                inf->close();
+                delete inf;
+                if (!archive.ReadAll(i, data)) {
+                    failed++;
+                }
+            }
+        };
+        auto start_time = time_util::time_ns64();
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < jobs; t++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto end_time = time_util::time_ns64();
+        Xp3Stats::Snapshot snapshot;
+        archive.GetStats(snapshot);
+        printf("Workload on %u threads finished in %.6f seconds, %zu failures\n", jobs, (end_time - start_time) / 1e9, failed.load());
+        for (int c = 0; c < Xp3Stats::COUNTER_COUNT; c++) {
+            printf("%-18s %" PRIu64 "\n", Xp3Stats::GetCounterName((Xp3Stats::Counter)c), snapshot.counters[c]);
+        }
+        uint64_t delivered = snapshot.counters[Xp3Stats::BYTES_DELIVERED];
+        uint64_t from_disk = snapshot.counters[Xp3Stats::BYTES_READ] + snapshot.counters[Xp3Stats::BYTES_MAPPED];
+        printf("Archive bytes per delivered byte: %.3f\n", delivered ? (double)from_disk / delivered : 0.0);
+        const char* names[Xp3Stats::HISTOGRAM_COUNT] = { "open", "read" };
+        for (int h = 0; h < Xp3Stats::HISTOGRAM_COUNT; h++) {
+            auto histogram = (Xp3Stats::Histogram)h;
+            printf("%s latency: %" PRIu64 " calls, p50 < %" PRIu64 " ns, p99 < %" PRIu64 " ns, max < %" PRIu64 " ns\n", names[h], snapshot.Count(histogram), snapshot.Percentile(histogram, 50), snapshot.Percentile(histogram, 99), snapshot.Percentile(histogram, 100));
+        }
+        if (failed > 0) {
+            return 1;
         }
-        printf("Verification completed: %" PRIu64 " files OK, %" PRIu64 " files failed.\n", ok_files, failed_files);
     } else {
         printf("Unknown action: %s\n", action.c_str());
         return 1;
@@ -1,33 +1,147 @@
 #include "decompressor.h"
+#include "fileop.h"
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 
 const uint8_t ZSTD_header[4] = { 0x28, 0xB5, 0x2F, 0xFD };
 
-bool decompress(ReadStream* source, std::vector<uint8_t>& result, size_t expected_size) {
-    if (!source) return false;
-    if (!source->seekable()) return false;
-    uint8_t header[4];
-    size_t readed = source->read(header, sizeof(header));
-    if (!readed) {
-        source->close();
-        delete source;
-        return false;
-    }
-    if (!source->seek(-((int64_t)readed), SEEK_CUR)) {
-        source->close();
-        delete source;
-        return false;
+bool is_zstd_data(const uint8_t* data, size_t size) {
+#if HAVE_ZSTD
+    return size >= 4 && !memcmp(data, ZSTD_header, 4);
+#else
+    return false;
+#endif
+}
+
+namespace {
+std::atomic<size_t> pool_max_per_thread{8};
+std::atomic<uint64_t> pool_created{0};
+std::atomic<uint64_t> pool_reused{0};
+std::atomic<uint64_t> pool_released{0};
+std::atomic<uint64_t> pool_discarded{0};
+
+void free_context(ZlibContext* ctx) {
+    inflateEnd(&ctx->stream);
+    delete ctx;
+}
+#if HAVE_ZSTD
+void free_context(ZstdContext* ctx) {
+    ZSTD_freeDStream(ctx->dstream);
+    delete ctx;
+}
+#endif
+
+// 0 before first use, 1 while the free lists exist, 2 after thread exit destroyed them
+thread_local int free_lists_state = 0;
+
+struct FreeLists {
+    std::vector<ZlibContext*> zlib;
+#if HAVE_ZSTD
+    std::vector<ZstdContext*> zstd;
+#endif
+    FreeLists() {
+        free_lists_state = 1;
     }
+    ~FreeLists() {
+        for (auto ctx : zlib) free_context(ctx);
 #if HAVE_ZSTD
-    ReadStream* dstream = nullptr;
-    if (readed >= 4 && !memcmp(ZSTD_header, header, 4)) {
-        dstream = new ZstdDecompressor(source);
+        for (auto ctx : zstd) free_context(ctx);
+#endif
+        free_lists_state = 2;
+    }
+};
+
+// nullptr once the thread is exiting, other thread_local destructors may still release contexts
+FreeLists* get_free_lists() {
+    if (free_lists_state == 2) return nullptr;
+    static thread_local FreeLists lists;
+    return &lists;
+}
+
+template <typename T>
+void release_context(std::vector<T*>* list, T* ctx) {
+    if (list && list->size() < pool_max_per_thread) {
+        list->push_back(ctx);
+        pool_released++;
     } else {
-        dstream = new ZlibDecompressor(source);
+        free_context(ctx);
+        pool_discarded++;
     }
-#else
-    ReadStream* dstream = new ZlibDecompressor(source);
+}
+}
+
+ZlibContext* DecompressorPool::AcquireZlib() {
+    FreeLists* lists = get_free_lists();
+    while (lists && !lists->zlib.empty()) {
+        ZlibContext* ctx = lists->zlib.back();
+        lists->zlib.pop_back();
+        if (inflateReset(&ctx->stream) == Z_OK) {
+            pool_reused++;
+            return ctx;
+        }
+        free_context(ctx);
+    }
+    ZlibContext* ctx = new ZlibContext();
+    if (inflateInit(&ctx->stream) != Z_OK) {
+        delete ctx;
+        return nullptr;
+    }
+    pool_created++;
+    return ctx;
+}
+
+void DecompressorPool::Release(ZlibContext* ctx) {
+    if (!ctx) return;
+    FreeLists* lists = get_free_lists();
+    release_context(lists ? &lists->zlib : nullptr, ctx);
+}
+
+#if HAVE_ZSTD
+ZstdContext* DecompressorPool::AcquireZstd() {
+    FreeLists* lists = get_free_lists();
+    while (lists && !lists->zstd.empty()) {
+        ZstdContext* ctx = lists->zstd.back();
+        lists->zstd.pop_back();
+        if (!ZSTD_isError(ZSTD_DCtx_reset(ctx->dstream, ZSTD_reset_session_only))) {
+            pool_reused++;
+            return ctx;
+        }
+        free_context(ctx);
+    }
+    ZstdContext* ctx = new ZstdContext();
+    ctx->dstream = ZSTD_createDStream();
+    if (!ctx->dstream) {
+        delete ctx;
+        return nullptr;
+    }
+    if (ZSTD_isError(ZSTD_initDStream(ctx->dstream))) {
+        free_context(ctx);
+        return nullptr;
+    }
+    pool_created++;
+    return ctx;
+}
+
+void DecompressorPool::Release(ZstdContext* ctx) {
+    if (!ctx) return;
+    FreeLists* lists = get_free_lists();
+    release_context(lists ? &lists->zstd : nullptr, ctx);
+}
 #endif
+
+void DecompressorPool::SetMaxPerThread(size_t count) {
+    pool_max_per_thread = count;
+}
+
+DecompressorPool::Stats DecompressorPool::GetStats() {
+    return { pool_created, pool_reused, pool_released, pool_discarded };
+}
+
+// Read all output of dstream into result, dstream is deleted
+static bool read_decompressed(ReadStream* dstream, std::vector<uint8_t>& result, size_t expected_size) {
     if (expected_size > 0) {
         result.resize(expected_size);
         size_t total_readed = 0;
@@ -54,6 +168,50 @@ bool decompress(ReadStream* source, std::vector<uint8_t>& result, size_t expecte
     }
 }
 
+bool decompress(ReadStream* source, std::vector<uint8_t>& result, size_t expected_size) {
+    if (!source) return false;
+    if (!source->seekable()) return false;
+    uint8_t header[4];
+    size_t readed = source->read(header, sizeof(header));
+    if (!readed) {
+        source->close();
+        delete source;
+        return false;
+    }
+    if (!source->seek(-((int64_t)readed), SEEK_CUR)) {
+        source->close();
+        delete source;
+        return false;
+    }
+#if HAVE_ZSTD
+    ReadStream* dstream = nullptr;
+    if (readed >= 4 && !memcmp(ZSTD_header, header, 4)) {
+        dstream = new ZstdDecompressor(source);
+    } else {
+        dstream = new ZlibDecompressor(source);
+    }
+#else
+    ReadStream* dstream = new ZlibDecompressor(source);
+#endif
+    return read_decompressed(dstream, result, expected_size);
+}
+
+bool decompress(const uint8_t* data, size_t size, std::vector<uint8_t>& result, size_t expected_size) {
+    if (expected_size > 0) {
+        result.resize(expected_size);
+        BufferDecompressor decoder;
+        return decoder.Decompress(data, size, result.data(), expected_size);
+    }
+    ReadStream* dstream = create_decompressor(data, size);
+    if (!dstream) return false;
+    return read_decompressed(dstream, result, expected_size);
+}
+
+bool decompress(const uint8_t* data, size_t size, uint8_t* out, size_t out_size) {
+    BufferDecompressor decoder;
+    return decoder.Decompress(data, size, out, out_size);
+}
+
 ReadStream* create_decompressor(ReadStream* source) {
     if (!source) return nullptr;
     if (!source->seekable()) return nullptr;
@@ -76,3 +234,204 @@ ReadStream* create_decompressor(ReadStream* source) {
 #endif
     return new ZlibDecompressor(source);
 }
+
+ReadStream* create_decompressor(const uint8_t* data, size_t size) {
+    if (!data) return nullptr;
+#if HAVE_ZSTD
+    if (size >= 4 && !memcmp(data, ZSTD_header, 4)) {
+        return new ZstdDecompressor(data, size);
+    }
+#endif
+    return new ZlibDecompressor(data, size);
+}
+
+#if HAVE_ZSTD
+struct ZstdDictionary {
+    uint32_t id;
+    size_t size;
+    ZSTD_DDict* ddict;
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> nanoseconds{0};
+    ~ZstdDictionary() {
+        ZSTD_freeDDict(ddict);
+    }
+};
+
+namespace {
+std::mutex dictionaries_mutex;
+std::unordered_map<uint32_t, std::unique_ptr<ZstdDictionary>> dictionaries;
+// Lets frames without a dictionary skip the lock
+std::atomic<size_t> dictionary_count{0};
+
+ZstdDictionary* find_dictionary(const void* frame, size_t size) {
+    if (dictionary_count == 0) return nullptr;
+    uint32_t id = (uint32_t)ZSTD_getDictID_fromFrame(frame, size);
+    if (id == 0) return nullptr;
+    std::lock_guard<std::mutex> guard(dictionaries_mutex);
+    auto it = dictionaries.find(id);
+    return it == dictionaries.end() ? nullptr : it->second.get();
+}
+}
+#endif
+
+uint32_t ZstdDictionaries::Register(const uint8_t* data, size_t size) {
+#if HAVE_ZSTD
+    uint32_t id = (uint32_t)ZSTD_getDictID_fromDict(data, size);
+    if (id == 0) return 0;
+    std::lock_guard<std::mutex> guard(dictionaries_mutex);
+    if (dictionaries.find(id) != dictionaries.end()) return id;
+    ZSTD_DDict* ddict = ZSTD_createDDict(data, size);
+    if (!ddict) return 0;
+    std::unique_ptr<ZstdDictionary> dictionary(new ZstdDictionary());
+    dictionary->id = id;
+    dictionary->size = size;
+    dictionary->ddict = ddict;
+    dictionaries[id] = std::move(dictionary);
+    dictionary_count++;
+    return id;
+#else
+    return 0;
+#endif
+}
+
+uint32_t ZstdDictionaries::RegisterFile(const std::string& path) {
+    FILE* fp = fileop::fopen(path, "rb");
+    if (!fp) return 0;
+    std::vector<uint8_t> data;
+    uint8_t buffer[8192];
+    size_t r;
+    while ((r = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + r);
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed) return 0;
+    return Register(data.data(), data.size());
+}
+
+std::vector<ZstdDictionaries::Stats> ZstdDictionaries::GetStats() {
+    std::vector<Stats> result;
+#if HAVE_ZSTD
+    std::lock_guard<std::mutex> guard(dictionaries_mutex);
+    for (const auto& it : dictionaries) {
+        const ZstdDictionary* dictionary = it.second.get();
+        result.push_back({ dictionary->id, dictionary->size, dictionary->frames, dictionary->bytes, dictionary->nanoseconds });
+    }
+    std::sort(result.begin(), result.end(), [](const Stats& a, const Stats& b) { return a.id < b.id; });
+#endif
+    return result;
+}
+
+#if HAVE_ZSTD
+ZstdDictionary* ZstdDictionaries::Select(ZSTD_DCtx* dctx, const void* frame, size_t size) {
+    ZstdDictionary* dictionary = find_dictionary(frame, size);
+    // Also drops a dictionary left referenced by the previous user of a pooled context
+    ZSTD_DCtx_refDDict(dctx, dictionary ? dictionary->ddict : nullptr);
+    return dictionary;
+}
+
+void ZstdDictionaries::Record(ZstdDictionary* dictionary, uint64_t frames, uint64_t bytes, uint64_t nanoseconds) {
+    dictionary->frames += frames;
+    dictionary->bytes += bytes;
+    dictionary->nanoseconds += nanoseconds;
+}
+#endif
+
+const char* get_inflate_backend() {
+#if HAVE_LIBDEFLATE
+    return "libdeflate";
+#else
+    return "zlib";
+#endif
+}
+
+BufferDecompressor::~BufferDecompressor() {
+    DecompressorPool::Release(zlib);
+#if HAVE_LIBDEFLATE
+    if (deflate) {
+        libdeflate_free_decompressor(deflate);
+    }
+#endif
+#if HAVE_ZSTD
+    DecompressorPool::Release(zstd);
+#endif
+}
+
+bool BufferDecompressor::Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t out_size) {
+    if (!data) return false;
+#if HAVE_ZSTD
+    if (size >= 4 && !memcmp(data, ZSTD_header, 4)) {
+        if (!zstd) {
+            zstd = DecompressorPool::AcquireZstd();
+            if (!zstd) return false;
+        }
+        ZstdDictionary* dictionary = find_dictionary(data, size);
+        if (!dictionary) {
+            size_t ret = ZSTD_decompress_usingDDict(zstd->dstream, out, out_size, data, size, nullptr);
+            return !ZSTD_isError(ret) && ret == out_size;
+        }
+        auto start = std::chrono::steady_clock::now();
+        size_t ret = ZSTD_decompress_usingDDict(zstd->dstream, out, out_size, data, size, dictionary->ddict);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        bool ok = !ZSTD_isError(ret) && ret == out_size;
+        ZstdDictionaries::Record(dictionary, 1, ok ? out_size : 0, ns);
+        return ok;
+    }
+#endif
+#if HAVE_LIBDEFLATE
+    if (!deflate) {
+        deflate = libdeflate_alloc_decompressor();
+    }
+    if (deflate) {
+        size_t actual = 0;
+        if (libdeflate_zlib_decompress(deflate, data, size, out, out_size, &actual) == LIBDEFLATE_SUCCESS && actual == out_size) {
+            return true;
+        }
+        // Longer than expected, trailing garbage or a bad checksum, which streaming inflate tolerates
+    }
+#endif
+    return inflate_buffer(data, size, out, out_size);
+}
+
+bool BufferDecompressor::inflate_buffer(const uint8_t* data, size_t size, uint8_t* out, size_t out_size) {
+    if (!zlib) {
+        zlib = DecompressorPool::AcquireZlib();
+        if (!zlib) return false;
+    } else if (inflateReset(&zlib->stream) != Z_OK) {
+        return false;
+    }
+    z_stream& zstream = zlib->stream;
+    size_t in_left = size;
+    size_t out_left = out_size;
+    zstream.avail_in = 0;
+    zstream.avail_out = 0;
+    while (true) {
+        // avail_in and avail_out are 32 bit
+        if (zstream.avail_in == 0 && in_left > 0) {
+            zstream.next_in = (Bytef*)data;
+            zstream.avail_in = in_left > UINT32_MAX ? UINT32_MAX : (uInt)in_left;
+            data += zstream.avail_in;
+            in_left -= zstream.avail_in;
+        }
+        if (zstream.avail_out == 0) {
+            if (out_left == 0) return true;
+            zstream.next_out = out;
+            zstream.avail_out = out_left > UINT32_MAX ? UINT32_MAX : (uInt)out_left;
+            out += zstream.avail_out;
+            out_left -= zstream.avail_out;
+        }
+        int ret = inflate(&zstream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            return out_left == 0 && zstream.avail_out == 0;
+        }
+        if (ret != Z_OK) {
+            // Z_BUF_ERROR with a full output means the data is longer than expected, same as streaming
+            return ret == Z_BUF_ERROR && out_left == 0 && zstream.avail_out == 0;
+        }
+        if (zstream.avail_in == 0 && in_left == 0 && zstream.avail_out > 0) {
+            // Truncated input
+            return false;
+        }
+    }
+}
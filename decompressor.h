@@ -5,9 +5,113 @@
 #if HAVE_ZSTD
 #include "zstd.h"
 #endif
+#if HAVE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+#include <chrono>
+#include <string>
 #include <vector>
 #include <memory>
 
+inline const size_t DECOMPRESSOR_BUFFER_SIZE = 8192;
+
+/**
+ * @brief Inflate state and input buffer of a ZlibDecompressor, recycled by DecompressorPool
+ */
+struct ZlibContext {
+    z_stream stream = {};
+    uint8_t in_buffer[DECOMPRESSOR_BUFFER_SIZE];
+};
+#if HAVE_ZSTD
+/**
+ * @brief Decoder state and input buffer of a ZstdDecompressor, recycled by DecompressorPool
+ */
+struct ZstdContext {
+    ZSTD_DStream* dstream = nullptr;
+    uint8_t in_buffer[DECOMPRESSOR_BUFFER_SIZE];
+};
+#endif
+
+/**
+ * @brief Per-thread free lists of decompression contexts
+ *
+ * Released contexts stay with the releasing thread and are reset with inflateReset / ZSTD_DCtx_reset
+ * when acquired again, so opening many small compressed files does not initialize new decoders.
+ */
+class DecompressorPool {
+public:
+    struct Stats {
+        uint64_t created;
+        uint64_t reused;
+        uint64_t released; // returned to a free list
+        uint64_t discarded; // freed because the free list was full
+    };
+    /**
+     * @brief Get a reset inflate context
+     * @return nullptr if a new context could not be initialized
+     */
+    static ZlibContext* AcquireZlib();
+    static void Release(ZlibContext* ctx);
+#if HAVE_ZSTD
+    /**
+     * @brief Get a reset zstd context
+     * @return nullptr if a new context could not be initialized
+     */
+    static ZstdContext* AcquireZstd();
+    static void Release(ZstdContext* ctx);
+#endif
+    /**
+     * @brief Set how many contexts of each kind a thread keeps. 0 disables pooling.
+     */
+    static void SetMaxPerThread(size_t count);
+    static Stats GetStats();
+};
+
+/**
+ * @brief File name extension of zstd dictionaries stored in an archive
+ */
+inline const char ZSTD_DICTIONARY_EXTENSION[] = ".zdict";
+
+struct ZstdDictionary;
+
+/**
+ * @brief Process-wide zstd dictionaries keyed by dictionary ID
+ *
+ * Frames which name a dictionary ID are decoded with the matching pre-digested ZSTD_DDict.
+ * Registered dictionaries live until exit, so decoders keep plain pointers to them.
+ * Without zstd support nothing can be registered.
+ */
+class ZstdDictionaries {
+public:
+    struct Stats {
+        uint32_t id;
+        size_t size; // dictionary size
+        uint64_t frames; // frames decoded with the dictionary
+        uint64_t bytes; // decompressed bytes
+        uint64_t nanoseconds; // time spent decoding
+    };
+    /**
+     * @brief Register a dictionary made by zstd --train
+     * @return Dictionary ID, 0 if data is not a zstd dictionary. A known ID keeps its first dictionary.
+     */
+    static uint32_t Register(const uint8_t* data, size_t size);
+    /**
+     * @brief Register a dictionary from a side file
+     * @return Dictionary ID, 0 on failure
+     */
+    static uint32_t RegisterFile(const std::string& path);
+    static std::vector<Stats> GetStats();
+#if HAVE_ZSTD
+    /**
+     * @brief Reference the dictionary named by a frame header in a reset context
+     * @param frame Start of the frame
+     * @return The dictionary, nullptr if the frame names none or an unregistered one (decoding then fails)
+     */
+    static ZstdDictionary* Select(ZSTD_DCtx* dctx, const void* frame, size_t size);
+    static void Record(ZstdDictionary* dictionary, uint64_t frames, uint64_t bytes, uint64_t nanoseconds);
+#endif
+};
+
 class ZlibDecompressor : public ReadStream {
 public:
     /**
@@ -15,19 +119,26 @@ public:
      * @param source The underlying ReadStream (will be closed and deleted when this object is destroyed)
      */
     ZlibDecompressor(ReadStream* source) : source(source) {
-        stream.zalloc = Z_NULL;
-        stream.zfree = Z_NULL;
-        stream.opaque = Z_NULL;
-        stream.avail_in = 0;
-        stream.next_in = Z_NULL;
-        
-        if (inflateInit(&stream) != Z_OK) {
+        ctx = DecompressorPool::AcquireZlib();
+        if (!ctx) {
             errored = true;
+            return;
         }
+        ctx->stream.avail_in = 0;
+        ctx->stream.next_in = Z_NULL;
+    }
+    /**
+     * @brief Create a ZlibDecompressor which inflates directly from memory
+     * @param data Compressed data (must stay valid while this object is alive)
+     * @param size Size of compressed data
+     */
+    ZlibDecompressor(const uint8_t* data, size_t size) : ZlibDecompressor((ReadStream*)nullptr) {
+        mem = data;
+        mem_left = size;
     }
     
     virtual ~ZlibDecompressor() {
-        inflateEnd(&stream);
+        DecompressorPool::Release(ctx);
         if (source) {
             source->close();
             delete source;
@@ -37,21 +148,30 @@ public:
     
     virtual size_t read(uint8_t* buf, size_t size) {
         if (errored || finished) return 0;
-        
+        z_stream& stream = ctx->stream;
         stream.avail_out = size;
         stream.next_out = buf;
         
         while (stream.avail_out > 0) {
             if (stream.avail_in == 0) {
-                stream.avail_in = source->read(in_buffer, sizeof(in_buffer));
-                if (stream.avail_in == 0) {
-                    if (source->error()) {
-                        errored = true;
-                        return size - stream.avail_out;
+                if (!source) {
+                    if (mem_left == 0) break;
+                    uInt avail = mem_left > UINT32_MAX ? UINT32_MAX : (uInt)mem_left;
+                    stream.next_in = (Bytef*)mem;
+                    stream.avail_in = avail;
+                    mem += avail;
+                    mem_left -= avail;
+                } else {
+                    stream.avail_in = source->read(ctx->in_buffer, sizeof(ctx->in_buffer));
+                    if (stream.avail_in == 0) {
+                        if (source->error()) {
+                            errored = true;
+                            return size - stream.avail_out;
+                        }
+                        break;
                     }
-                    break;
+                    stream.next_in = ctx->in_buffer;
                 }
-                stream.next_in = in_buffer;
             }
             
             int ret = inflate(&stream, Z_NO_FLUSH);
@@ -73,21 +193,23 @@ public:
     }
     
     virtual bool eof() {
+        if (!source) return finished || (mem_left == 0 && (!ctx || ctx->stream.avail_in == 0));
         return finished || source->eof();
     }
     
     virtual bool error() {
-        return errored || source->error();
+        return errored || (source && source->error());
     }
     
     virtual bool close() {
-        return source->close();
+        return source ? source->close() : true;
     }
     
 private:
     ReadStream* source;
-    z_stream stream = {};
-    uint8_t in_buffer[8192];
+    const uint8_t* mem = nullptr;
+    size_t mem_left = 0;
+    ZlibContext* ctx = nullptr;
     bool errored = false;
     bool finished = false;
 };
@@ -100,23 +222,25 @@ public:
      * @param source The underlying ReadStream (will be closed and deleted when this object is destroyed)
      */
     ZstdDecompressor(ReadStream* source) : source(source) {
-        dstream = ZSTD_createDStream();
-        if (!dstream) {
+        ctx = DecompressorPool::AcquireZstd();
+        if (!ctx) {
             errored = true;
             return;
         }
-        
-        size_t ret = ZSTD_initDStream(dstream);
-        if (ZSTD_isError(ret)) {
-            errored = true;
-        }
+        dstream = ctx->dstream;
+        input = { ctx->in_buffer, 0, 0 };
+    }
+    /**
+     * @brief Create a ZstdDecompressor which decodes directly from memory
+     * @param data Compressed data (must stay valid while this object is alive)
+     * @param size Size of compressed data
+     */
+    ZstdDecompressor(const uint8_t* data, size_t size) : ZstdDecompressor((ReadStream*)nullptr) {
+        input = { data, size, 0 };
     }
     
     virtual ~ZstdDecompressor() {
-        if (dstream) {
-            ZSTD_freeDStream(dstream);
-            dstream = nullptr;
-        }
+        DecompressorPool::Release(ctx);
         if (source) {
             source->close();
             delete source;
@@ -125,10 +249,40 @@ public:
     }
     virtual size_t read(uint8_t* buf, size_t size) {
         if (errored || finished) return 0;
+        if (!dictionary_checked) {
+            if (source && input.pos >= input.size) {
+                input.size = source->read(ctx->in_buffer, sizeof(ctx->in_buffer));
+                input.pos = 0;
+            }
+            dictionary = ZstdDictionaries::Select(dstream, (const uint8_t*)input.src + input.pos, input.size - input.pos);
+            dictionary_checked = true;
+        }
+        if (!dictionary) return decode(buf, size);
+        auto start = std::chrono::steady_clock::now();
+        size_t decoded = decode(buf, size);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        ZstdDictionaries::Record(dictionary, finished ? 1 : 0, decoded, ns);
+        return decoded;
+    }
+    virtual bool seekable() {
+        return false;
+    }
+    virtual bool eof() {
+        if (!source) return finished || input.pos >= input.size;
+        return finished || source->eof();
+    }
+    virtual bool error() {
+        return errored || (source && source->error());
+    }
+    virtual bool close() {
+        return source ? source->close() : true;
+    }
+private:
+    size_t decode(uint8_t* buf, size_t size) {
         ZSTD_outBuffer output = { buf, size, 0 };
         while (output.pos < output.size) {
-            if (input.pos >= input.size) {
-                input.size = source->read(in_buffer, sizeof(in_buffer));
+            if (source && input.pos >= input.size) {
+                input.size = source->read(ctx->in_buffer, sizeof(ctx->in_buffer));
                 input.pos = 0;
                 if (input.size == 0) {
                     if (source->error()) {
@@ -139,6 +293,7 @@ public:
                 }
             }
             
+            size_t before = output.pos;
             size_t ret = ZSTD_decompressStream(dstream, &output, &input);
             if (ZSTD_isError(ret)) {
                 errored = true;
@@ -148,31 +303,84 @@ public:
                 finished = true;
                 break;
             }
+            // Memory input is exhausted and the decoder has nothing buffered
+            if (!source && input.pos >= input.size && output.pos == before) break;
         }
         
         return output.pos;
     }
-    virtual bool seekable() {
-        return false;
-    }
-    virtual bool eof() {
-        return finished || source->eof();
-    }
-    virtual bool error() {
-        return errored || source->error();
-    }
-    virtual bool close() {
-        return source->close();
-    }
-private:
     ReadStream* source;
+    ZstdContext* ctx = nullptr;
     ZSTD_DStream* dstream = nullptr;
-    uint8_t in_buffer[8192];
-    ZSTD_inBuffer input = { in_buffer, 0, 0 };
+    ZSTD_inBuffer input = { nullptr, 0, 0 };
+    ZstdDictionary* dictionary = nullptr;
+    bool dictionary_checked = false;
     bool errored = false;
     bool finished = false;
 };
 #endif
 
+/**
+ * @brief Whether data starts with a zstd frame magic
+ */
+bool is_zstd_data(const uint8_t* data, size_t size);
 bool decompress(ReadStream* source, std::vector<uint8_t>& result, size_t expected_size = 0);
+/**
+ * @brief Decompress data in memory
+ * @param data Compressed data
+ * @param size Size of compressed data
+ * @param result Decompressed data
+ * @param expected_size Expected size of decompressed data. 0 if unknown.
+ */
+bool decompress(const uint8_t* data, size_t size, std::vector<uint8_t>& result, size_t expected_size = 0);
+/**
+ * @brief Decompress data in memory into a buffer of known size
+ * @param data Compressed data
+ * @param size Size of compressed data
+ * @param out Output buffer
+ * @param out_size Exact size of decompressed data
+ */
+bool decompress(const uint8_t* data, size_t size, uint8_t* out, size_t out_size);
+/**
+ * @brief Reusable decoder for compressed buffers whose decompressed size is known
+ *
+ * The zlib and zstd contexts are taken from DecompressorPool on first use and kept between calls,
+ * decoding many small segments does not allocate.
+ * Zlib data is decoded in one shot with libdeflate when built with it (meson option inflate),
+ * falling back to streaming inflate for data libdeflate rejects.
+ */
+class BufferDecompressor {
+public:
+    BufferDecompressor() {}
+    BufferDecompressor(const BufferDecompressor&) = delete;
+    BufferDecompressor& operator=(const BufferDecompressor&) = delete;
+    ~BufferDecompressor();
+    /**
+     * @brief Decompress a zlib or zstd buffer
+     * @param data Compressed data
+     * @param size Size of compressed data
+     * @param out Output buffer
+     * @param out_size Exact size of decompressed data
+     */
+    bool Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t out_size);
+private:
+    bool inflate_buffer(const uint8_t* data, size_t size, uint8_t* out, size_t out_size);
+    ZlibContext* zlib = nullptr;
+#if HAVE_ZSTD
+    ZstdContext* zstd = nullptr;
+#endif
+#if HAVE_LIBDEFLATE
+    libdeflate_decompressor* deflate = nullptr;
+#endif
+};
+/**
+ * @brief Name of the one-shot inflate backend, "zlib" or "libdeflate"
+ */
+const char* get_inflate_backend();
 ReadStream* create_decompressor(ReadStream* stream);
+/**
+ * @brief Create a decompressor which reads compressed data directly from memory
+ * @param data Compressed data (must stay valid while the decompressor is alive)
+ * @param size Size of compressed data
+ */
+ReadStream* create_decompressor(const uint8_t* data, size_t size);
@@ -0,0 +1,223 @@
+#include "index_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <vector>
+#include "fileop.h"
+#if _WIN32
+#include <Windows.h>
+#include "wchar_util.h"
+#else
+#include <unistd.h>
+#endif
+
+struct IndexCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t path_flags;
+    uint32_t entry_record_size;
+    uint32_t segment_record_size;
+    uint64_t archive_size;
+    int64_t archive_mtime;
+    uint64_t index_offset;
+    uint32_t index_checksum;
+    uint32_t minor_version;
+    uint64_t entry_count;
+    uint64_t segment_count;
+    uint64_t names_size;
+    uint64_t slot_count;
+};
+
+static inline uint64_t align8(uint64_t size) {
+    return (size + 7) & ~(uint64_t)7;
+}
+
+bool get_file_stat(const std::string& filename, uint64_t& size, int64_t& mtime) {
+#if _WIN32
+    std::wstring wfilename;
+    if (!wchar_util::str_to_wstr(wfilename, filename, CP_UTF8)) {
+        return false;
+    }
+    struct _stat64 st;
+    if (_wstat64(wfilename.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+bool load_index_cache(const std::string& path, const IndexCacheKey& key, CompactIndex& index, PathIndex& path_index, uint32_t path_flags, bool& path_index_loaded) {
+    path_index_loaded = false;
+    MmapPositionalReader reader(path.c_str());
+    if (!reader.is_open() || reader.size() < sizeof(IndexCacheHeader)) {
+        return false;
+    }
+    const uint8_t* data = reader.map(0, reader.size());
+    IndexCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, XP3_INDEX_CACHE_MAGIC, 8) || header.version != XP3_INDEX_CACHE_VERSION) {
+        return false;
+    }
+    if (header.entry_record_size != sizeof(CompactEntry) || header.segment_record_size != sizeof(Segment)) {
+        return false;
+    }
+    if (header.archive_size != key.archive_size || header.archive_mtime != key.archive_mtime || header.index_offset != key.index_offset || header.index_checksum != key.index_checksum || header.minor_version != key.minor_version) {
+        return false;
+    }
+    if (header.entry_count > UINT32_MAX || header.segment_count > UINT32_MAX || header.names_size > UINT32_MAX || header.slot_count > UINT32_MAX) {
+        return false;
+    }
+    uint64_t entries_offset = sizeof(IndexCacheHeader);
+    uint64_t segments_offset = entries_offset + align8(header.entry_count * sizeof(CompactEntry));
+    uint64_t names_offset = segments_offset + align8(header.segment_count * sizeof(Segment));
+    uint64_t slots_offset = names_offset + align8(header.names_size);
+    uint64_t hashes_offset = slots_offset + align8(header.slot_count * sizeof(uint32_t));
+    uint64_t end_offset = hashes_offset + header.slot_count * sizeof(uint64_t);
+    if (end_offset != reader.size()) {
+        return false;
+    }
+    const CompactEntry* entries = (const CompactEntry*)(data + entries_offset);
+    for (uint64_t i = 0; i < header.entry_count; i++) {
+        const CompactEntry& entry = entries[i];
+        if ((uint64_t)entry.name_offset + entry.name_length > header.names_size || (uint64_t)entry.segment_offset + entry.segment_count > header.segment_count) {
+            return false;
+        }
+    }
+    index.entries.assign(entries, entries + header.entry_count);
+    const Segment* segments = (const Segment*)(data + segments_offset);
+    index.segments.assign(segments, segments + header.segment_count);
+    index.names.assign((const char*)(data + names_offset), header.names_size);
+    if (header.path_flags == path_flags) {
+        const uint32_t* slots = (const uint32_t*)(data + slots_offset);
+        bool valid = true;
+        for (uint64_t i = 0; i < header.slot_count; i++) {
+            if (slots[i] > header.entry_count) {
+                valid = false;
+                break;
+            }
+        }
+        if (valid) {
+            path_index_loaded = path_index.Load(slots, (const uint64_t*)(data + hashes_offset), header.slot_count, path_flags);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Replace to with from. Readers which mapped the old file keep its contents.
+ */
+static bool replace_file(const std::string& from, const std::string& to) {
+#if _WIN32
+    std::wstring wfrom, wto;
+    if (!wchar_util::str_to_wstr(wfrom, from, CP_UTF8) || !wchar_util::str_to_wstr(wto, to, CP_UTF8)) {
+        return false;
+    }
+    return MoveFileExW(wfrom.c_str(), wto.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+/**
+ * @brief Name of a temporary file next to path, unique for this process and call
+ */
+static std::string temp_path(const std::string& path) {
+    static std::atomic<uint32_t> counter{0};
+#if _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    return path + ".tmp" + std::to_string(pid) + "." + std::to_string(counter++);
+}
+
+static bool write_section(FILE* fp, const void* data, uint64_t size) {
+    static const uint8_t padding[8] = { 0 };
+    if (size && fwrite(data, 1, size, fp) != size) {
+        return false;
+    }
+    uint64_t pad = align8(size) - size;
+    return !pad || fwrite(padding, 1, pad, fp) == pad;
+}
+
+// Records are copied field by field into zeroed storage, so no uninitialized padding reaches the file
+static bool write_entries(FILE* fp, const std::vector<CompactEntry>& entries) {
+    std::vector<CompactEntry> records(entries.size());
+    if (!records.empty()) {
+        memset(records.data(), 0, records.size() * sizeof(CompactEntry));
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        records[i].name_offset = entries[i].name_offset;
+        records[i].name_length = entries[i].name_length;
+        records[i].flags = entries[i].flags;
+        records[i].adler32 = entries[i].adler32;
+        records[i].original_size = entries[i].original_size;
+        records[i].packed_size = entries[i].packed_size;
+        records[i].segment_offset = entries[i].segment_offset;
+        records[i].segment_count = entries[i].segment_count;
+    }
+    return write_section(fp, records.data(), records.size() * sizeof(CompactEntry));
+}
+
+static bool write_segments(FILE* fp, const std::vector<Segment>& segments) {
+    std::vector<Segment> records(segments.size());
+    if (!records.empty()) {
+        memset(records.data(), 0, records.size() * sizeof(Segment));
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        records[i].flag = segments[i].flag;
+        records[i].start = segments[i].start;
+        records[i].original_size = segments[i].original_size;
+        records[i].packed_size = segments[i].packed_size;
+    }
+    return write_section(fp, records.data(), records.size() * sizeof(Segment));
+}
+
+bool save_index_cache(const std::string& path, const IndexCacheKey& key, const CompactIndex& index, const PathIndex& path_index) {
+    IndexCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.version = XP3_INDEX_CACHE_VERSION;
+    header.path_flags = path_index.GetFlags();
+    header.entry_record_size = sizeof(CompactEntry);
+    header.segment_record_size = sizeof(Segment);
+    header.archive_size = key.archive_size;
+    header.archive_mtime = key.archive_mtime;
+    header.index_offset = key.index_offset;
+    header.index_checksum = key.index_checksum;
+    header.minor_version = key.minor_version;
+    header.entry_count = index.entries.size();
+    header.segment_count = index.segments.size();
+    header.names_size = index.names.size();
+    header.slot_count = path_index.GetSlots().size();
+    // Written aside and renamed over the cache, processes which mapped the old cache are never
+    // given a truncated file. The magic is written last so an interrupted write is never accepted.
+    std::string tmp = temp_path(path);
+    FILE* fp = fileop::fopen(tmp, "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = write_section(fp, &header, sizeof(header))
+        && write_entries(fp, index.entries)
+        && write_segments(fp, index.segments)
+        && write_section(fp, index.names.data(), header.names_size)
+        && write_section(fp, path_index.GetSlots().data(), header.slot_count * sizeof(uint32_t))
+        && write_section(fp, path_index.GetHashes().data(), header.slot_count * sizeof(uint64_t));
+    if (ok) {
+        memcpy(header.magic, XP3_INDEX_CACHE_MAGIC, 8);
+        ok = fflush(fp) == 0 && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, 1, sizeof(header), fp) == sizeof(header);
+    }
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && replace_file(tmp, path);
+    if (!ok) {
+        fileop::remove(tmp);
+    }
+    return ok;
+}
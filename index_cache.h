@@ -0,0 +1,41 @@
+#pragma once
+#include "xp3.h"
+#include <string>
+
+inline const char* XP3_INDEX_CACHE_MAGIC = "XP3VFSIC";
+inline const uint32_t XP3_INDEX_CACHE_VERSION = 1;
+
+/**
+ * @brief Identifies the archive state a cache was built from
+ */
+struct IndexCacheKey {
+    uint64_t archive_size;
+    int64_t archive_mtime;
+    uint64_t index_offset;
+    uint32_t index_checksum; // adler32 of the index as stored in the archive
+    uint32_t minor_version;
+};
+
+/**
+ * @brief Get size and modification time of a file
+ */
+bool get_file_stat(const std::string& filename, uint64_t& size, int64_t& mtime);
+
+/**
+ * @brief Load a index cache file.
+ *
+ * The file is a fixed header followed by the raw CompactIndex arrays and the PathIndex table,
+ * each aligned to 8 bytes, so it is read through a memory mapping and copied in bulk.
+ * @param path Path of the cache file
+ * @param key Expected key. The cache is rejected if any field differs.
+ * @param index Loaded file table
+ * @param path_index Loaded lookup table, only if it was built with path_flags
+ * @param path_flags Expected XP3_PATH_* flags of the lookup table
+ * @param path_index_loaded Set to true if path_index was loaded
+ * @return false if the cache does not exist, is stale or is corrupted
+ */
+bool load_index_cache(const std::string& path, const IndexCacheKey& key, CompactIndex& index, PathIndex& path_index, uint32_t path_flags, bool& path_index_loaded);
+/**
+ * @brief Write a index cache file
+ */
+bool save_index_cache(const std::string& path, const IndexCacheKey& key, const CompactIndex& index, const PathIndex& path_index);
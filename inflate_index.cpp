@@ -0,0 +1,217 @@
+#include "inflate_index.h"
+#include <string.h>
+
+std::shared_ptr<InflateIndex> InflateIndexCache::Get(uint64_t segment_start) {
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = items.find(segment_start);
+    if (it != items.end()) {
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return it->second.index;
+    }
+    lru.push_front(segment_start);
+    Item item;
+    item.index = std::make_shared<InflateIndex>();
+    item.lru_it = lru.begin();
+    items[segment_start] = item;
+    return item.index;
+}
+
+std::shared_ptr<const InflateCheckpoint> InflateIndexCache::FindPoint(InflateIndex& index, uint64_t offset) {
+    std::lock_guard<std::mutex> guard(mutex);
+    size_t left = 0;
+    size_t right = index.points.size();
+    while (left < right) {
+        size_t mid = (left + right) / 2;
+        if (index.points[mid]->out <= offset) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return left > 0 ? index.points[left - 1] : nullptr;
+}
+
+bool InflateIndexCache::NeedPoint(InflateIndex& index, uint64_t out) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (index.complete) return false;
+    uint64_t last = index.points.empty() ? 0 : index.points.back()->out;
+    return out >= last + interval;
+}
+
+void InflateIndexCache::AddPoint(InflateIndex& index, std::shared_ptr<const InflateCheckpoint> point) {
+    std::lock_guard<std::mutex> guard(mutex);
+    // Another decoder of the same segment may have got here first
+    if (!index.points.empty() && point->out <= index.points.back()->out) return;
+    size_t size = sizeof(InflateCheckpoint) + point->window.capacity();
+    index.points.push_back(point);
+    index.memory += size;
+    if (index.cached) {
+        memory += size;
+        evict();
+    }
+}
+
+void InflateIndexCache::MarkComplete(InflateIndex& index) {
+    std::lock_guard<std::mutex> guard(mutex);
+    index.complete = true;
+}
+
+bool InflateIndexCache::IsComplete(InflateIndex& index) {
+    std::lock_guard<std::mutex> guard(mutex);
+    return index.complete;
+}
+
+size_t InflateIndexCache::GetMemoryUsage() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return memory;
+}
+
+void InflateIndexCache::evict() {
+    while (memory > memory_limit && !lru.empty()) {
+        auto it = items.find(lru.back());
+        it->second.index->cached = false;
+        memory -= it->second.index->memory;
+        items.erase(it);
+        lru.pop_back();
+    }
+}
+
+CheckpointZlibDecompressor::CheckpointZlibDecompressor(ReadStream* source, const uint8_t* data, size_t size, std::shared_ptr<InflateIndexCache> cache, std::shared_ptr<InflateIndex> index, std::shared_ptr<const InflateCheckpoint> start): source(source), mem(data), mem_size(size), cache(cache), index(index) {
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+    // Checkpoints are inside the deflate data, after the zlib header
+    if ((start ? inflateInit2(&stream, -15) : inflateInit(&stream)) != Z_OK) {
+        errored = true;
+        return;
+    }
+    // Only keep a window when there are still checkpoints to record
+    building = !cache->IsComplete(*index);
+    if (building) {
+        ring.resize(INFLATE_WINDOW_SIZE);
+    }
+    if (!start) return;
+    in_pos = start->in - (start->bits ? 1 : 0);
+    if (source && !source->seek(in_pos, SEEK_SET)) {
+        errored = true;
+        return;
+    }
+    if (start->bits) {
+        if (!fill_input()) {
+            errored = true;
+            return;
+        }
+        int ch = *stream.next_in;
+        stream.next_in++;
+        stream.avail_in--;
+        inflatePrime(&stream, start->bits, ch >> (8 - start->bits));
+    }
+    if (inflateSetDictionary(&stream, start->window.data(), (uInt)start->window.size()) != Z_OK) {
+        errored = true;
+        return;
+    }
+    out_pos = start->out;
+    if (building) {
+        add_window(start->window.data(), start->window.size());
+    }
+}
+
+CheckpointZlibDecompressor::~CheckpointZlibDecompressor() {
+    inflateEnd(&stream);
+    if (source) {
+        source->close();
+        delete source;
+        source = nullptr;
+    }
+}
+
+bool CheckpointZlibDecompressor::fill_input() {
+    if (source) {
+        size_t readed = source->read(in_buffer, sizeof(in_buffer));
+        if (readed == 0) return false;
+        stream.next_in = in_buffer;
+        stream.avail_in = (uInt)readed;
+        in_pos += readed;
+        return true;
+    }
+    if (in_pos >= mem_size) return false;
+    size_t avail = mem_size - in_pos;
+    if (avail > 0x40000000) avail = 0x40000000;
+    stream.next_in = (Bytef*)(mem + in_pos);
+    stream.avail_in = (uInt)avail;
+    in_pos += avail;
+    return true;
+}
+
+void CheckpointZlibDecompressor::add_window(const uint8_t* data, size_t size) {
+    if (size >= INFLATE_WINDOW_SIZE) {
+        memcpy(ring.data(), data + size - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+        ring_pos = 0;
+        return;
+    }
+    size_t first = INFLATE_WINDOW_SIZE - ring_pos;
+    if (first > size) first = size;
+    memcpy(ring.data() + ring_pos, data, first);
+    memcpy(ring.data(), data + first, size - first);
+    ring_pos = (ring_pos + size) % INFLATE_WINDOW_SIZE;
+}
+
+void CheckpointZlibDecompressor::add_point() {
+    auto point = std::make_shared<InflateCheckpoint>();
+    point->out = out_pos;
+    point->in = in_pos - stream.avail_in;
+    point->bits = stream.data_type & 7;
+    if (out_pos < INFLATE_WINDOW_SIZE) {
+        point->window.assign(ring.begin(), ring.begin() + out_pos);
+    } else {
+        point->window.resize(INFLATE_WINDOW_SIZE);
+        memcpy(point->window.data(), ring.data() + ring_pos, INFLATE_WINDOW_SIZE - ring_pos);
+        memcpy(point->window.data() + INFLATE_WINDOW_SIZE - ring_pos, ring.data(), ring_pos);
+    }
+    cache->AddPoint(*index, point);
+}
+
+size_t CheckpointZlibDecompressor::read(uint8_t* buf, size_t size) {
+    if (errored || finished) return 0;
+    stream.next_out = buf;
+    stream.avail_out = (uInt)(size > 0x40000000 ? 0x40000000 : size);
+    size_t requested = stream.avail_out;
+    while (stream.avail_out > 0) {
+        if (stream.avail_in == 0 && !fill_input()) {
+            if (source && source->error()) {
+                errored = true;
+            }
+            break;
+        }
+        uint8_t* before = stream.next_out;
+        // Z_BLOCK stops at deflate block boundaries, the only places where decoding can restart
+        int ret = inflate(&stream, building ? Z_BLOCK : Z_NO_FLUSH);
+        size_t produced = stream.next_out - before;
+        if (building && produced) {
+            add_window(before, produced);
+        }
+        out_pos += produced;
+        if (ret == Z_STREAM_END) {
+            finished = true;
+            if (building) {
+                cache->MarkComplete(*index);
+            }
+            break;
+        }
+        if (ret != Z_OK) {
+            errored = true;
+            break;
+        }
+        if (building && (stream.data_type & 128) && !(stream.data_type & 64) && cache->NeedPoint(*index, out_pos)) {
+            add_point();
+        }
+    }
+    return requested - stream.avail_out;
+}
+
+bool CheckpointZlibDecompressor::HasCheckpointBefore(uint64_t offset) {
+    auto point = cache->FindPoint(*index, offset);
+    return point && point->out > out_pos + INFLATE_RESUME_COST;
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "stream.h"
+#include "zlib.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+inline const size_t INFLATE_WINDOW_SIZE = 32768;
+/// Decoded bytes which cost about as much as resuming from a checkpoint (restoring the window and a new read)
+inline const uint64_t INFLATE_RESUME_COST = 64 << 10;
+
+/**
+ * @brief Position inside a deflate stream where decoding can restart
+ */
+struct InflateCheckpoint {
+    uint64_t out; // offset in decompressed data
+    uint64_t in;  // offset of the first compressed byte not fully consumed
+    int bits;     // number of unused bits in the byte before in
+    std::vector<uint8_t> window; // last 32 KiB (or less at start) of decompressed data
+};
+
+/**
+ * @brief Checkpoints of one compressed segment, sorted by out
+ */
+struct InflateIndex {
+    std::vector<std::shared_ptr<const InflateCheckpoint>> points;
+    bool complete = false;
+    // Whether the cache still owns this index and accounts its memory
+    bool cached = true;
+    size_t memory = 0;
+};
+
+/**
+ * @brief Archive-level store of inflate checkpoints keyed by segment start offset.
+ *
+ * Indexes are evicted in least recently used order when memory_limit is exceeded.
+ */
+class InflateIndexCache {
+public:
+    /**
+     * @param interval Minimum distance in decompressed bytes between checkpoints
+     * @param memory_limit Maximum memory used by all checkpoints
+     */
+    InflateIndexCache(uint64_t interval, size_t memory_limit): interval(interval), memory_limit(memory_limit) {}
+    /**
+     * @brief Get or create the index of a segment
+     */
+    std::shared_ptr<InflateIndex> Get(uint64_t segment_start);
+    /**
+     * @brief Find the last checkpoint at or before offset
+     * @return nullptr if decoding must start from the beginning of the segment
+     */
+    std::shared_ptr<const InflateCheckpoint> FindPoint(InflateIndex& index, uint64_t offset);
+    /**
+     * @brief Whether a checkpoint should be recorded at out
+     */
+    bool NeedPoint(InflateIndex& index, uint64_t out);
+    void AddPoint(InflateIndex& index, std::shared_ptr<const InflateCheckpoint> point);
+    void MarkComplete(InflateIndex& index);
+    bool IsComplete(InflateIndex& index);
+    uint64_t GetInterval() const {
+        return interval;
+    }
+    size_t GetMemoryUsage();
+private:
+    void evict();
+    std::mutex mutex;
+    uint64_t interval;
+    size_t memory_limit;
+    size_t memory = 0;
+    // Front is the most recently used
+    std::list<uint64_t> lru;
+    struct Item {
+        std::shared_ptr<InflateIndex> index;
+        std::list<uint64_t>::iterator lru_it;
+    };
+    std::unordered_map<uint64_t, Item> items;
+};
+
+/**
+ * @brief Zlib decompressor which records and resumes from inflate checkpoints (zran style)
+ */
+class CheckpointZlibDecompressor : public ReadStream {
+public:
+    /**
+     * @brief Create a CheckpointZlibDecompressor
+     * @param source Seekable stream of the compressed segment (will be closed and deleted when this object is destroyed). nullptr if data is used.
+     * @param data Compressed segment in memory, used if source is nullptr
+     * @param size Size of compressed segment in memory
+     * @param cache Checkpoint store
+     * @param index Index of this segment
+     * @param start Checkpoint to resume from. nullptr to start from the beginning.
+     */
+    CheckpointZlibDecompressor(ReadStream* source, const uint8_t* data, size_t size, std::shared_ptr<InflateIndexCache> cache, std::shared_ptr<InflateIndex> index, std::shared_ptr<const InflateCheckpoint> start);
+    virtual ~CheckpointZlibDecompressor();
+    virtual size_t read(uint8_t* buf, size_t size);
+    virtual bool seekable() {
+        return false;
+    }
+    virtual bool eof() {
+        return finished || errored;
+    }
+    virtual bool error() {
+        return errored || (source && source->error());
+    }
+    virtual bool close() {
+        return source ? source->close() : true;
+    }
+    /**
+     * @brief Offset in decompressed data of the next byte returned by read
+     */
+    uint64_t position() const {
+        return out_pos;
+    }
+    /**
+     * @brief Whether resuming from a checkpoint is cheaper than decoding forward to offset
+     */
+    bool HasCheckpointBefore(uint64_t offset);
+private:
+    bool fill_input();
+    void add_window(const uint8_t* data, size_t size);
+    void add_point();
+    ReadStream* source;
+    const uint8_t* mem;
+    size_t mem_size;
+    // Offset in compressed data of the next byte to be fed to inflate
+    uint64_t in_pos = 0;
+    uint64_t out_pos = 0;
+    std::shared_ptr<InflateIndexCache> cache;
+    std::shared_ptr<InflateIndex> index;
+    z_stream stream = {};
+    uint8_t in_buffer[8192];
+    std::vector<uint8_t> ring;
+    size_t ring_pos = 0;
+    bool building = false;
+    bool errored = false;
+    bool finished = false;
+};
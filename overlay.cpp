@@ -0,0 +1,84 @@
+#include "overlay.h"
+#include <stdio.h>
+#include <mutex>
+
+Xp3Overlay::Xp3Overlay(uint32_t path_flags) {
+    path_index.SetFlags(path_flags);
+}
+
+void Xp3Overlay::Mount(std::shared_ptr<Xp3Archive> archive) {
+    std::unique_lock<std::shared_mutex> guard(mutex);
+    uint32_t archive_number = (uint32_t)archives.size();
+    archives.push_back(std::move(archive));
+    const Xp3Archive& added = *archives.back();
+    auto name_of = [this](size_t i) { return get_name(i); };
+    for (size_t i = 0; i < added.GetFileCount(); i++) {
+        Entry entry = { archive_number, (uint32_t)i };
+        size_t found = path_index.Find(added.GetFileName(i), name_of);
+        if (found != PathIndex::npos) {
+            // Overridden in place, the slot already points here
+            entries[found] = entry;
+        } else {
+            entries.push_back(entry);
+            path_index.Insert(entries.size() - 1, name_of);
+        }
+    }
+}
+
+bool Xp3Overlay::Mount(const std::string& path, bool thread_safety, bool use_mmap) {
+    auto archive = std::make_shared<Xp3Archive>(path.c_str(), thread_safety, use_mmap);
+    if (!archive->ReadIndex()) {
+        printf("Failed to read index of %s\n", path.c_str());
+        return false;
+    }
+    Mount(std::move(archive));
+    return true;
+}
+
+size_t Xp3Overlay::GetArchiveCount() {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return archives.size();
+}
+
+std::shared_ptr<Xp3Archive> Xp3Overlay::GetArchive(size_t archive_number) {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return archives[archive_number];
+}
+
+size_t Xp3Overlay::GetFileCount() {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    return entries.size();
+}
+
+void Xp3Overlay::GetFile(size_t index, size_t& archive_number, size_t& file_index) {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    archive_number = entries[index].archive;
+    file_index = entries[index].index;
+}
+
+bool Xp3Overlay::Find(std::string_view path, size_t& archive_number, size_t& file_index) {
+    std::shared_lock<std::shared_mutex> guard(mutex);
+    size_t found = path_index.Find(path, [this](size_t i) { return get_name(i); });
+    if (found == PathIndex::npos) {
+        return false;
+    }
+    archive_number = entries[found].archive;
+    file_index = entries[found].index;
+    return true;
+}
+
+Xp3File* Xp3Overlay::OpenFile(std::string_view path) {
+    size_t archive_number, file_index;
+    if (!Find(path, archive_number, file_index)) {
+        return nullptr;
+    }
+    return GetArchive(archive_number)->OpenFile(file_index);
+}
+
+bool Xp3Overlay::ReadAll(std::string_view path, std::vector<uint8_t>& data) {
+    size_t archive_number, file_index;
+    if (!Find(path, archive_number, file_index)) {
+        return false;
+    }
+    return GetArchive(archive_number)->ReadAll(file_index, data);
+}
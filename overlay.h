@@ -0,0 +1,77 @@
+#pragma once
+#include "path_index.h"
+#include "xp3.h"
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Several archives seen as one namespace, later mounted archives override earlier ones
+ *
+ * Mounting inserts only the files of the new archive into one merged hash table,
+ * so lookups cost one probe however many archives are mounted and a patch archive
+ * can be added at runtime without rebuilding the table. Safe to use from multiple threads.
+ */
+class Xp3Overlay {
+public:
+    /**
+     * @param path_flags XP3_PATH_* flags used to match paths across archives
+     */
+    explicit Xp3Overlay(uint32_t path_flags = 0);
+    Xp3Overlay(const Xp3Overlay&) = delete;
+    Xp3Overlay& operator=(const Xp3Overlay&) = delete;
+    /**
+     * @brief Mount an archive above all mounted archives
+     * @param archive Archive whose index has been read
+     */
+    void Mount(std::shared_ptr<Xp3Archive> archive);
+    /**
+     * @brief Open an archive file, read its index and mount it above all mounted archives
+     * @return false if the archive cannot be read
+     */
+    bool Mount(const std::string& path, bool thread_safety = true, bool use_mmap = false);
+    size_t GetArchiveCount();
+    std::shared_ptr<Xp3Archive> GetArchive(size_t archive_number);
+    /**
+     * @brief Number of distinct paths in the merged namespace
+     */
+    size_t GetFileCount();
+    /**
+     * @brief Get where a path of the merged namespace is read from
+     * @param index Index in the merged namespace, below GetFileCount
+     * @param archive_number Set to the mount position of the winning archive
+     * @param file_index Set to the index of the file in that archive
+     */
+    void GetFile(size_t index, size_t& archive_number, size_t& file_index);
+    /**
+     * @brief Find the file which wins for a path
+     * @param archive_number Set to the mount position of the archive holding the file
+     * @param file_index Set to the index of the file in that archive
+     */
+    bool Find(std::string_view path, size_t& archive_number, size_t& file_index);
+    /**
+     * @brief Open a file from the archive which wins for its path
+     * @return nullptr if not found
+     */
+    Xp3File* OpenFile(std::string_view path);
+    /**
+     * @brief Read a whole file from the archive which wins for its path
+     */
+    bool ReadAll(std::string_view path, std::vector<uint8_t>& data);
+private:
+    struct Entry {
+        uint32_t archive;
+        uint32_t index;
+    };
+    std::string_view get_name(size_t i) const {
+        const Entry& entry = entries[i];
+        return archives[entry.archive]->GetFileName(entry.index);
+    }
+    std::shared_mutex mutex;
+    std::vector<std::shared_ptr<Xp3Archive>> archives;
+    // Winning file of each path, in order of first appearance
+    std::vector<Entry> entries;
+    PathIndex path_index;
+};
@@ -0,0 +1,75 @@
+#include "path_index.h"
+
+namespace {
+    /// Yields the characters of a path as normalize_path would output them
+    class PathCursor {
+    public:
+        PathCursor(std::string_view path, uint32_t flags): path(path), flags(flags) {}
+        /// @return -1 at end of path
+        int next() {
+            while (pos < path.size()) {
+                char c = path[pos++];
+                if (flags & XP3_PATH_NORMALIZE_SEPARATOR) {
+                    if (c == '\\') c = '/';
+                    if (c == '/') {
+                        if (last_sep) continue;
+                        last_sep = true;
+                        return '/';
+                    }
+                    last_sep = false;
+                }
+                if ((flags & XP3_PATH_CASE_INSENSITIVE) && c >= 'A' && c <= 'Z') {
+                    c = c - 'A' + 'a';
+                }
+                return (uint8_t)c;
+            }
+            return -1;
+        }
+    private:
+        std::string_view path;
+        uint32_t flags;
+        size_t pos = 0;
+        // Starts as true so leading separators are dropped
+        bool last_sep = true;
+    };
+}
+
+void normalize_path(std::string_view path, uint32_t flags, std::string& out) {
+    out.clear();
+    out.reserve(path.size());
+    PathCursor cursor(path, flags);
+    int c;
+    while ((c = cursor.next()) >= 0) {
+        out.push_back((char)c);
+    }
+}
+
+uint64_t hash_path(std::string_view path, uint32_t flags) {
+    uint64_t hash = 14695981039346656037ULL;
+    if (!flags) {
+        for (char c : path) {
+            hash ^= (uint8_t)c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+    PathCursor cursor(path, flags);
+    int c;
+    while ((c = cursor.next()) >= 0) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool path_equals(std::string_view a, std::string_view b, uint32_t flags) {
+    if (!flags) return a == b;
+    PathCursor ca(a, flags);
+    PathCursor cb(b, flags);
+    while (true) {
+        int x = ca.next();
+        int y = cb.next();
+        if (x != y) return false;
+        if (x < 0) return true;
+    }
+}
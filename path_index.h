@@ -0,0 +1,240 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// Match ASCII letters case-insensitively
+inline const uint32_t XP3_PATH_CASE_INSENSITIVE = 0x01;
+/// Treat '\' as '/', ignore leading and repeated separators
+inline const uint32_t XP3_PATH_NORMALIZE_SEPARATOR = 0x02;
+
+/**
+ * @brief Normalize a path according to flags
+ * @param path Input path (UTF-8)
+ * @param flags XP3_PATH_* flags
+ * @param out Normalized path
+ */
+void normalize_path(std::string_view path, uint32_t flags, std::string& out);
+/**
+ * @brief Hash a path as if it was normalized with normalize_path first (64-bit FNV-1a)
+ */
+uint64_t hash_path(std::string_view path, uint32_t flags);
+/**
+ * @brief Compare two paths after normalization
+ */
+bool path_equals(std::string_view a, std::string_view b, uint32_t flags);
+
+/**
+ * @brief Open addressing hash table from path to entry index
+ *
+ * Only hashes and indexes are stored, names are provided by the owner when building and looking up.
+ */
+class PathIndex {
+public:
+    static const size_t npos = (size_t)-1;
+    /**
+     * @brief Build the table
+     * @param count Number of entries
+     * @param get_name Callable returning the name of entry i as std::string_view
+     * @param flags XP3_PATH_* flags
+     */
+    template <typename F>
+    void Build(size_t count, F get_name, uint32_t flags) {
+        BuildHashed(count, [&get_name, flags](size_t i) { return hash_path(get_name(i), flags); }, get_name, flags);
+    }
+    /**
+     * @brief Build the table from hashes computed by the owner
+     *
+     * get_name is only called when two hashes are equal, so names do not have to be kept in memory.
+     * @param get_hash Callable returning hash_path of the name of entry i with flags
+     * @param get_name Callable returning the name of entry i as std::string_view
+     */
+    template <typename H, typename F>
+    void BuildHashed(size_t count, H get_hash, F get_name, uint32_t flags) {
+        this->flags = flags;
+        size_t capacity = 16;
+        while (capacity < count * 2) capacity <<= 1;
+        slots.assign(capacity, 0);
+        hashes.assign(capacity, 0);
+        used = 0;
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t hash = get_hash(i);
+            size_t slot = (size_t)hash & mask;
+            while (slots[slot]) {
+                if (hashes[slot] == hash && path_equals(get_name(slots[slot] - 1), get_name(i), flags)) {
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            if (!slots[slot]) used++;
+            // Later entries override earlier ones with the same path
+            slots[slot] = (uint32_t)(i + 1);
+            hashes[slot] = hash;
+        }
+    }
+    /**
+     * @brief Add one entry, growing the table when it gets half full
+     * @param index Entry index. Overrides an entry with the same path.
+     * @param get_name Callable returning the name of any entry already in the table
+     */
+    template <typename F>
+    void Insert(size_t index, F get_name) {
+        if (slots.empty()) {
+            slots.assign(16, 0);
+            hashes.assign(16, 0);
+        } else if ((used + 1) * 2 > slots.size()) {
+            grow();
+        }
+        std::string_view name = get_name(index);
+        uint64_t hash = hash_path(name, flags);
+        size_t slot = probe(hash, name, get_name);
+        if (!slots[slot]) used++;
+        slots[slot] = (uint32_t)(index + 1);
+        hashes[slot] = hash;
+    }
+    /**
+     * @brief Set the XP3_PATH_* flags of an empty table filled with Insert
+     */
+    void SetFlags(uint32_t flags) {
+        this->flags = flags;
+    }
+    /**
+     * @brief Find the index of path
+     * @return npos if not found
+     */
+    template <typename F>
+    size_t Find(std::string_view path, F get_name) const {
+        if (slots.empty()) return npos;
+        size_t slot = probe(hash_path(path, flags), path, get_name);
+        return slots[slot] ? slots[slot] - 1 : npos;
+    }
+    /**
+     * @brief Load a table previously built with the same entries
+     * @param slots Entry index + 1 for each slot, 0 for empty slots
+     * @param hashes hash_path of the entry in each slot
+     * @param capacity Number of slots, must be a power of two
+     * @param flags XP3_PATH_* flags used when the table was built
+     */
+    bool Load(const uint32_t* slots, const uint64_t* hashes, size_t capacity, uint32_t flags) {
+        if (capacity == 0 || (capacity & (capacity - 1))) return false;
+        this->slots.assign(slots, slots + capacity);
+        this->hashes.assign(hashes, hashes + capacity);
+        this->flags = flags;
+        used = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (slots[i]) used++;
+        }
+        return true;
+    }
+    const std::vector<uint32_t>& GetSlots() const {
+        return slots;
+    }
+    const std::vector<uint64_t>& GetHashes() const {
+        return hashes;
+    }
+    uint32_t GetFlags() const {
+        return flags;
+    }
+    size_t MemoryUsage() const {
+        return slots.capacity() * sizeof(uint32_t) + hashes.capacity() * sizeof(uint64_t);
+    }
+    void Clear() {
+        slots.clear();
+        hashes.clear();
+        used = 0;
+    }
+private:
+    /// Double the capacity, paths are distinct so only hashes are needed to reinsert
+    void grow() {
+        std::vector<uint32_t> old_slots(slots.size() * 2, 0);
+        std::vector<uint64_t> old_hashes(hashes.size() * 2, 0);
+        old_slots.swap(slots);
+        old_hashes.swap(hashes);
+        size_t mask = slots.size() - 1;
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            if (!old_slots[i]) continue;
+            size_t slot = (size_t)old_hashes[i] & mask;
+            while (slots[slot]) slot = (slot + 1) & mask;
+            slots[slot] = old_slots[i];
+            hashes[slot] = old_hashes[i];
+        }
+    }
+    /// Returns the slot containing path or the empty slot where it should be inserted
+    template <typename F>
+    size_t probe(uint64_t hash, std::string_view path, F& get_name) const {
+        size_t mask = slots.size() - 1;
+        size_t slot = (size_t)hash & mask;
+        while (slots[slot]) {
+            if (hashes[slot] == hash && path_equals(get_name(slots[slot] - 1), path, flags)) {
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+    std::vector<uint32_t> slots;
+    std::vector<uint64_t> hashes;
+    // Occupied slots
+    size_t used = 0;
+    uint32_t flags = 0;
+};
+
+/**
+ * @brief Directory listing built from entry names
+ */
+class DirectoryTree {
+public:
+    struct Node {
+        std::vector<std::string> subdirs;
+        std::vector<size_t> files;
+    };
+    template <typename F>
+    void Build(size_t count, F get_name, uint32_t flags) {
+        this->flags = flags;
+        nodes.clear();
+        nodes[""];
+        std::string normalized;
+        for (size_t i = 0; i < count; i++) {
+            normalize_path(get_name(i), flags, normalized);
+            size_t sep = normalized.find_last_of('/');
+            std::string dir = sep == std::string::npos ? std::string() : normalized.substr(0, sep);
+            auto it = nodes.find(dir);
+            if (it == nodes.end()) {
+                nodes[dir].files.push_back(i);
+                add_dir(dir);
+            } else {
+                it->second.files.push_back(i);
+            }
+        }
+    }
+    /**
+     * @brief Get the node of a directory
+     * @param dir Directory path, "" for root
+     * @return nullptr if the directory does not exist
+     */
+    const Node* Get(std::string_view dir) const {
+        std::string normalized;
+        normalize_path(dir, flags, normalized);
+        while (!normalized.empty() && normalized.back() == '/') normalized.pop_back();
+        auto it = nodes.find(normalized);
+        return it == nodes.end() ? nullptr : &it->second;
+    }
+    bool Empty() const {
+        return nodes.empty();
+    }
+private:
+    /// Register a newly created directory in its parent
+    void add_dir(const std::string& dir) {
+        if (dir.empty()) return;
+        size_t sep = dir.find_last_of('/');
+        std::string parent = sep == std::string::npos ? std::string() : dir.substr(0, sep);
+        bool parent_exists = nodes.find(parent) != nodes.end();
+        nodes[parent].subdirs.push_back(sep == std::string::npos ? dir : dir.substr(sep + 1));
+        if (!parent_exists) add_dir(parent);
+    }
+    std::unordered_map<std::string, Node> nodes;
+    uint32_t flags = 0;
+};
@@ -0,0 +1,285 @@
+#include "positional.h"
+#if _WIN32
+#include <Windows.h>
+#include "wchar_util.h"
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if _WIN32
+FilePositionalReader::FilePositionalReader(const char* filename): handle(INVALID_HANDLE_VALUE) {
+    std::wstring wfilename;
+    if (!wchar_util::str_to_wstr(wfilename, filename, CP_UTF8)) {
+        errored = true;
+        return;
+    }
+    handle = CreateFileW(wfilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        errored = true;
+    }
+}
+
+FilePositionalReader::~FilePositionalReader() {
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool FilePositionalReader::is_open() const {
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+size_t FilePositionalReader::pread(uint8_t* buf, size_t size, uint64_t offset) {
+    if (handle == INVALID_HANDLE_VALUE) return 0;
+    size_t total = 0;
+    while (total < size) {
+        OVERLAPPED ov = {};
+        uint64_t off = offset + total;
+        ov.Offset = (DWORD)(off & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD)(off >> 32);
+        DWORD to_read = (size - total) > 0x40000000 ? 0x40000000 : (DWORD)(size - total);
+        DWORD readed = 0;
+        if (!ReadFile(handle, buf + total, to_read, &readed, &ov)) {
+            if (GetLastError() != ERROR_HANDLE_EOF) {
+                errored = true;
+            }
+            break;
+        }
+        if (readed == 0) break;
+        total += readed;
+    }
+    return total;
+}
+#else
+FilePositionalReader::FilePositionalReader(const char* filename) {
+    fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        errored = true;
+    }
+}
+
+FilePositionalReader::~FilePositionalReader() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool FilePositionalReader::is_open() const {
+    return fd >= 0;
+}
+
+size_t FilePositionalReader::pread(uint8_t* buf, size_t size, uint64_t offset) {
+    if (fd < 0) return 0;
+    size_t total = 0;
+    while (total < size) {
+        ssize_t readed = ::pread(fd, buf + total, size - total, (off_t)(offset + total));
+        if (readed < 0) {
+            if (errno == EINTR) continue;
+            errored = true;
+            break;
+        }
+        if (readed == 0) break;
+        total += readed;
+    }
+    return total;
+}
+
+size_t FilePositionalReader::preadv(const PositionalBuffer* buffers, size_t count, uint64_t offset) {
+    if (fd < 0) return 0;
+    const size_t max_vecs = 64;
+    struct iovec vecs[max_vecs];
+    size_t total = 0;
+    size_t index = 0;
+    // Bytes of buffers[index] already filled
+    size_t filled = 0;
+    while (index < count) {
+        size_t n = 0;
+        for (size_t i = index; i < count && n < max_vecs; i++, n++) {
+            size_t skip = i == index ? filled : 0;
+            vecs[n].iov_base = buffers[i].buf + skip;
+            vecs[n].iov_len = buffers[i].size - skip;
+        }
+        ssize_t readed = ::preadv(fd, vecs, (int)n, (off_t)(offset + total));
+        if (readed < 0) {
+            if (errno == EINTR) continue;
+            errored = true;
+            break;
+        }
+        if (readed == 0) break;
+        total += readed;
+        size_t left = (size_t)readed;
+        while (index < count && left >= buffers[index].size - filled) {
+            left -= buffers[index].size - filled;
+            filled = 0;
+            index++;
+        }
+        filled += left;
+    }
+    return total;
+}
+
+void FilePositionalReader::advise(uint64_t offset, uint64_t size) {
+#ifdef POSIX_FADV_WILLNEED
+    if (fd >= 0) {
+        posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+#endif
+
+#if _WIN32
+MmapPositionalReader::MmapPositionalReader(const char* filename) {
+    std::wstring wfilename;
+    if (!wchar_util::str_to_wstr(wfilename, filename, CP_UTF8)) {
+        errored = true;
+        return;
+    }
+    HANDLE file = CreateFileW(wfilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        errored = true;
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        errored = true;
+        return;
+    }
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        errored = true;
+        return;
+    }
+    data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        mapping = nullptr;
+        errored = true;
+        return;
+    }
+    length = (uint64_t)size.QuadPart;
+}
+
+MmapPositionalReader::~MmapPositionalReader() {
+    if (data) {
+        UnmapViewOfFile(data);
+        data = nullptr;
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+        mapping = nullptr;
+    }
+}
+#else
+MmapPositionalReader::MmapPositionalReader(const char* filename) {
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        errored = true;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        errored = true;
+        return;
+    }
+    void* addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        errored = true;
+        return;
+    }
+    data = (const uint8_t*)addr;
+    length = (uint64_t)st.st_size;
+}
+
+MmapPositionalReader::~MmapPositionalReader() {
+    if (data) {
+        munmap((void*)data, (size_t)length);
+        data = nullptr;
+    }
+}
+
+void MmapPositionalReader::advise(uint64_t offset, uint64_t size) {
+    if (!data || offset >= length) return;
+    if (size > length - offset) size = length - offset;
+    // madvise needs a page aligned address
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t aligned = offset / page * page;
+    madvise((void*)(data + aligned), (size_t)(size + offset - aligned), MADV_WILLNEED);
+}
+#endif
+
+size_t StreamPositionalReader::pread(uint8_t* buf, size_t size, uint64_t offset) {
+    if (mutex) {
+        std::lock_guard<std::mutex> guard(*mutex);
+        return pread_internal(buf, size, offset);
+    } else {
+        return pread_internal(buf, size, offset);
+    }
+}
+
+size_t StreamPositionalReader::pread_internal(uint8_t* buf, size_t size, uint64_t offset) {
+    if (!stream->seek(offset, SEEK_SET)) {
+        return 0;
+    }
+    size_t total = 0;
+    while (total < size) {
+        size_t readed = stream->read(buf + total, size - total);
+        if (readed == 0) break;
+        total += readed;
+    }
+    return total;
+}
+
+size_t ReadAhead::Read(PositionalReader& reader, uint8_t* buf, size_t size, uint64_t offset, uint64_t limit) {
+    if (offset >= limit) return 0;
+    if (size > limit - offset) size = (size_t)(limit - offset);
+    bool sequential = offset == next_offset;
+    size_t total = 0;
+    if (offset >= buffer_start && offset < buffer_start + buffer_size) {
+        size_t n = (size_t)(buffer_start + buffer_size - offset);
+        if (n > size) n = size;
+        memcpy(buf, buffer.data() + (offset - buffer_start), n);
+        total = n;
+    }
+    if (total < size) {
+        if (!sequential) {
+            window = 0;
+            total += reader.pread(buf + total, size - total, offset + total);
+        } else {
+            window = window ? (window * 2 > max_window ? max_window : window * 2) : READ_AHEAD_MIN_WINDOW;
+            uint64_t from = offset + total;
+            if (size - total >= window) {
+                total += reader.pread(buf + total, size - total, from);
+            } else {
+                size_t fill = limit - from < window ? (size_t)(limit - from) : window;
+                if (buffer.size() < fill) buffer.resize(fill);
+                buffer_start = from;
+                buffer_size = reader.pread(buffer.data(), fill, from);
+                size_t n = buffer_size < size - total ? buffer_size : size - total;
+                memcpy(buf + total, buffer.data(), n);
+                total += n;
+            }
+            // Ask for the window after what is already read or advised
+            uint64_t ahead = offset + total;
+            if (buffer_start + buffer_size > ahead) ahead = buffer_start + buffer_size;
+            if (advised_end > ahead) ahead = advised_end;
+            if (ahead < limit) {
+                uint64_t ahead_end = limit - ahead < window ? limit : ahead + window;
+                reader.advise(ahead, ahead_end - ahead);
+                advised_end = ahead_end;
+            }
+        }
+    }
+    next_offset = offset + total;
+    return total;
+}
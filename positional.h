@@ -0,0 +1,240 @@
+#pragma once
+#include <stdint.h>
+#include "stream.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <vector>
+
+/**
+ * @brief Destination buffer of PositionalReader::preadv
+ */
+struct PositionalBuffer {
+    uint8_t* buf;
+    size_t size;
+};
+
+/**
+ * @brief Random access reader without a shared seek cursor.
+ *
+ * Implementations must allow concurrent pread calls from multiple threads.
+ */
+class PositionalReader {
+public:
+    virtual ~PositionalReader() {}
+    /**
+     * @brief Read up to size bytes starting at offset
+     * @param buf Output buffer
+     * @param size Number of bytes to read
+     * @param offset Absolute offset in the underlying file
+     * @return Number of bytes read. Less than size only at end of file or on error.
+     */
+    virtual size_t pread(uint8_t* buf, size_t size, uint64_t offset) = 0;
+    /**
+     * @brief Read consecutive bytes starting at offset, scattered into several buffers
+     * @return Total number of bytes read. Less than the total size only at end of file or on error.
+     */
+    virtual size_t preadv(const PositionalBuffer* buffers, size_t count, uint64_t offset) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t readed = pread(buffers[i].buf, buffers[i].size, offset + total);
+            total += readed;
+            if (readed < buffers[i].size) break;
+        }
+        return total;
+    }
+    virtual bool error() = 0;
+    /**
+     * @brief Hint that [offset, offset + size) will be read soon. Never blocks.
+     */
+    virtual void advise(uint64_t offset, uint64_t size) {}
+    /**
+     * @brief Get a pointer to [offset, offset + size) without copying
+     * @return nullptr if the reader is not memory mapped or the range is out of bounds
+     */
+    virtual const uint8_t* map(uint64_t offset, uint64_t size) {
+        return nullptr;
+    }
+};
+
+/**
+ * @brief PositionalReader backed by an OS file handle (pread / overlapped ReadFile)
+ */
+class FilePositionalReader : public PositionalReader {
+public:
+    FilePositionalReader(const char* filename);
+    virtual ~FilePositionalReader();
+    virtual size_t pread(uint8_t* buf, size_t size, uint64_t offset);
+#if !_WIN32
+    virtual size_t preadv(const PositionalBuffer* buffers, size_t count, uint64_t offset);
+    virtual void advise(uint64_t offset, uint64_t size);
+#endif
+    virtual bool error() {
+        return errored;
+    }
+    bool is_open() const;
+private:
+#if _WIN32
+    void* handle;
+#else
+    int fd;
+#endif
+    std::atomic<bool> errored{false};
+};
+
+/**
+ * @brief PositionalReader backed by a read-only memory mapping of the whole file
+ */
+class MmapPositionalReader : public PositionalReader {
+public:
+    MmapPositionalReader(const char* filename);
+    virtual ~MmapPositionalReader();
+    virtual size_t pread(uint8_t* buf, size_t size, uint64_t offset) {
+        if (offset >= length) return 0;
+        if (size > length - offset) size = length - offset;
+        memcpy(buf, data + offset, size);
+        return size;
+    }
+    virtual bool error() {
+        return errored;
+    }
+    virtual const uint8_t* map(uint64_t offset, uint64_t size) {
+        if (!data || offset > length || size > length - offset) return nullptr;
+        return data + offset;
+    }
+#if !_WIN32
+    virtual void advise(uint64_t offset, uint64_t size);
+#endif
+    bool is_open() const {
+        return data != nullptr;
+    }
+    uint64_t size() const {
+        return length;
+    }
+private:
+#if _WIN32
+    void* mapping = nullptr;
+#endif
+    const uint8_t* data = nullptr;
+    uint64_t length = 0;
+    bool errored = false;
+};
+
+/**
+ * @brief PositionalReader on top of a seekable ReadStream.
+ *
+ * Each pread is a seek followed by a read, so calls are serialized with lock if it is provided.
+ */
+class StreamPositionalReader : public PositionalReader {
+public:
+    /**
+     * @param stream The underlying ReadStream (not owned)
+     * @param lock Lock held during seek and read. Can be nullptr if the reader is only used by one thread.
+     */
+    StreamPositionalReader(ReadStream* stream, std::shared_ptr<std::mutex> lock): stream(stream), mutex(lock) {}
+    virtual size_t pread(uint8_t* buf, size_t size, uint64_t offset);
+    virtual bool error() {
+        if (mutex) {
+            std::lock_guard<std::mutex> guard(*mutex);
+            return stream->error();
+        } else {
+            return stream->error();
+        }
+    }
+private:
+    size_t pread_internal(uint8_t* buf, size_t size, uint64_t offset);
+    ReadStream* stream;
+    std::shared_ptr<std::mutex> mutex;
+};
+
+inline const size_t READ_AHEAD_MIN_WINDOW = 64 << 10;
+
+/**
+ * @brief Read-ahead window of one reader of a PositionalReader
+ *
+ * While reads are sequential the window doubles up to max_window and small reads are served from
+ * one larger read. The OS is asked to prefetch the window after the buffered one. A non-sequential
+ * read drops the window.
+ */
+class ReadAhead {
+public:
+    ReadAhead(size_t max_window): max_window(max_window < READ_AHEAD_MIN_WINDOW ? READ_AHEAD_MIN_WINDOW : max_window) {}
+    /**
+     * @brief Read [offset, offset + size), never past limit
+     * @return Number of bytes read
+     */
+    size_t Read(PositionalReader& reader, uint8_t* buf, size_t size, uint64_t offset, uint64_t limit);
+private:
+    size_t max_window;
+    // 0 until a sequential read is seen
+    size_t window = 0;
+    std::vector<uint8_t> buffer;
+    uint64_t buffer_start = 0;
+    size_t buffer_size = 0;
+    // End of the previous read
+    uint64_t next_offset = UINT64_MAX;
+    // End of the range already passed to advise
+    uint64_t advised_end = 0;
+};
+
+/**
+ * @brief ReadStream over [start, end) of a PositionalReader with its own cursor
+ */
+class PositionalRegion : public ReadStream {
+public:
+    /**
+     * @param read_ahead Maximum read-ahead window. 0 to read exactly what is asked.
+     */
+    PositionalRegion(std::shared_ptr<PositionalReader> reader, uint64_t start, uint64_t end, size_t read_ahead = 0): reader(reader), start(start), end(end), pos(start) {
+        if (read_ahead) {
+            this->read_ahead.reset(new ReadAhead(read_ahead));
+        }
+    }
+    virtual size_t read(uint8_t* buf, size_t size) {
+        if (pos >= end) return 0;
+        if (size > end - pos) size = end - pos;
+        size_t readed = read_ahead ? read_ahead->Read(*reader, buf, size, pos, end) : reader->pread(buf, size, pos);
+        pos += readed;
+        return readed;
+    }
+    virtual bool seek(int64_t offset, int whence) {
+        int64_t new_pos;
+        if (whence == SEEK_SET) {
+            new_pos = (int64_t)start + offset;
+        } else if (whence == SEEK_CUR) {
+            new_pos = (int64_t)pos + offset;
+        } else if (whence == SEEK_END) {
+            new_pos = (int64_t)end + offset;
+        } else {
+            return false;
+        }
+        if (new_pos < (int64_t)start || new_pos > (int64_t)end) {
+            return false;
+        }
+        pos = new_pos;
+        return true;
+    }
+    virtual int64_t tell() {
+        return pos - start;
+    }
+    virtual bool seekable() {
+        return true;
+    }
+    virtual bool eof() {
+        return pos >= end;
+    }
+    virtual bool error() {
+        return reader->error();
+    }
+    virtual bool close() {
+        return true;
+    }
+private:
+    std::shared_ptr<PositionalReader> reader;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;
+    std::unique_ptr<ReadAhead> read_ahead;
+};
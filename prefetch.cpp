@@ -0,0 +1,85 @@
+#include "prefetch.h"
+#include "decompressor.h"
+#include "xp3.h"
+#include <algorithm>
+
+// Work is split into ranges of about this size so it spreads over threads and can be cancelled
+inline const uint64_t PREFETCH_RANGE_SIZE = 1 << 20;
+// Gaps up to this size between segments are read rather than split into another request
+inline const uint64_t PREFETCH_MAX_GAP = 64 << 10;
+
+Prefetcher::Prefetcher(std::shared_ptr<PositionalReader> reader, std::shared_ptr<SegmentCache> segment_cache, size_t threads): reader(reader), segment_cache(segment_cache), pool(threads ? threads : 1) {}
+
+Prefetcher::~Prefetcher() {
+    Cancel();
+    pool.Wait();
+}
+
+void Prefetcher::Prefetch(std::vector<Segment> segments, bool decompress) {
+    requests++;
+    std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.start < b.start; });
+    segments.erase(std::unique(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.start == b.start; }), segments.end());
+    std::vector<Range> result;
+    for (auto& seg : segments) {
+        if (seg.packed_size == 0) continue;
+        uint64_t end = seg.start + seg.packed_size;
+        bool decode = decompress && segment_cache && seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB && segment_cache->Cacheable(seg.original_size);
+        if (!result.empty() && seg.start <= result.back().end + PREFETCH_MAX_GAP && std::max(result.back().end, end) - result.back().start <= PREFETCH_RANGE_SIZE) {
+            result.back().end = std::max(result.back().end, end);
+        } else if (!decode && seg.packed_size > PREFETCH_RANGE_SIZE) {
+            for (uint64_t pos = seg.start; pos < end; pos += PREFETCH_RANGE_SIZE) {
+                result.push_back({ pos, std::min(end, pos + PREFETCH_RANGE_SIZE), {} });
+            }
+        } else {
+            result.push_back({ seg.start, end, {} });
+        }
+        if (decode) {
+            result.back().decode.push_back(seg);
+        }
+    }
+    uint64_t current = generation;
+    for (auto& range : result) {
+        pool.Submit([this, range = std::move(range), current] { run(range, current); });
+    }
+}
+
+void Prefetcher::run(const Range& range, uint64_t current) {
+    if (generation != current) {
+        cancelled++;
+        return;
+    }
+    std::vector<uint8_t> data((size_t)(range.end - range.start));
+    size_t readed = reader->pread(data.data(), data.size(), range.start);
+    ranges++;
+    bytes += readed;
+    if (range.decode.empty()) return;
+    BufferDecompressor decoder;
+    for (auto& seg : range.decode) {
+        if (seg.start + seg.packed_size > range.start + readed) break;
+        if (segment_cache->Contains(seg.start)) continue;
+        auto out = std::make_shared<std::vector<uint8_t>>(seg.original_size);
+        if (!decoder.Decompress(data.data() + (seg.start - range.start), (size_t)seg.packed_size, out->data(), out->size())) {
+            continue;
+        }
+        segment_cache->Put(seg.start, out);
+        decoded++;
+    }
+}
+
+void Prefetcher::Cancel() {
+    generation++;
+}
+
+void Prefetcher::Wait() {
+    pool.Wait();
+}
+
+Prefetcher::Stats Prefetcher::GetStats() {
+    Stats stats;
+    stats.requests = requests;
+    stats.ranges = ranges;
+    stats.bytes = bytes;
+    stats.decoded = decoded;
+    stats.cancelled = cancelled;
+    return stats;
+}
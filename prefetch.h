@@ -0,0 +1,69 @@
+#pragma once
+#include "positional.h"
+#include "segment_cache.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct Segment;
+
+/**
+ * @brief Background warming of segments ahead of use
+ *
+ * Requested segments are sorted by archive offset, merged into ranges and read on worker threads,
+ * so the page cache (or the segment cache when decompressing) is warm when the files are opened.
+ */
+class Prefetcher {
+public:
+    struct Stats {
+        uint64_t requests;
+        uint64_t ranges; // ranges read
+        uint64_t bytes; // archive bytes read
+        uint64_t decoded; // segments decompressed into the segment cache
+        uint64_t cancelled; // ranges dropped by Cancel
+    };
+    /**
+     * @param reader Reader of the archive
+     * @param segment_cache Receives decompressed segments. Can be nullptr.
+     * @param threads Number of worker threads
+     */
+    Prefetcher(std::shared_ptr<PositionalReader> reader, std::shared_ptr<SegmentCache> segment_cache, size_t threads);
+    /// Cancels pending work and waits for running ranges
+    ~Prefetcher();
+    /**
+     * @brief Queue segments for prefetch
+     * @param segments Segments to warm. Duplicates are read once.
+     * @param decompress Also decompress compressed segments (TVP_XP3_SEGM_ENCODE_ZLIB, the data may be zlib or zstd)
+     * that fit in the segment cache into it
+     */
+    void Prefetch(std::vector<Segment> segments, bool decompress);
+    /**
+     * @brief Drop all queued ranges which have not started yet
+     */
+    void Cancel();
+    /**
+     * @brief Wait until all queued ranges are done
+     */
+    void Wait();
+    Stats GetStats();
+private:
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+        // Segments to decompress, inside [start, end)
+        std::vector<Segment> decode;
+    };
+    void run(const Range& range, uint64_t generation);
+    std::shared_ptr<PositionalReader> reader;
+    std::shared_ptr<SegmentCache> segment_cache;
+    // Incremented by Cancel, queued ranges of an older generation are skipped
+    std::atomic<uint64_t> generation{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> ranges{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> decoded{0};
+    std::atomic<uint64_t> cancelled{0};
+    // Declared last so workers stop before the members they use are destroyed
+    ThreadPool pool;
+};
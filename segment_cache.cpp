@@ -0,0 +1,50 @@
+#include "segment_cache.h"
+
+SegmentBuffer SegmentCache::Get(uint64_t start) {
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = items.find(start);
+    if (it == items.end()) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second.lru_it);
+    return it->second.data;
+}
+
+void SegmentCache::Put(uint64_t start, SegmentBuffer data) {
+    if (!data || !Cacheable(data->size())) return;
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = items.find(start);
+    if (it != items.end()) {
+        // Decoded concurrently by another reader
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return;
+    }
+    lru.push_front(start);
+    Item item;
+    item.data = data;
+    item.lru_it = lru.begin();
+    items[start] = item;
+    bytes += data->size();
+    insertions++;
+    while (bytes > byte_budget && !lru.empty()) {
+        auto old = items.find(lru.back());
+        bytes -= old->second.data->size();
+        items.erase(old);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+SegmentCache::Stats SegmentCache::GetStats() {
+    std::lock_guard<std::mutex> guard(mutex);
+    Stats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.insertions = insertions;
+    stats.evictions = evictions;
+    stats.bytes = bytes;
+    stats.entries = items.size();
+    return stats;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "stream.h"
+#include <string.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+typedef std::shared_ptr<const std::vector<uint8_t>> SegmentBuffer;
+
+/**
+ * @brief Archive-level LRU cache of decompressed segments keyed by segment start offset
+ *
+ * Buffers are reference counted, an evicted buffer stays valid for holders.
+ */
+class SegmentCache {
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t insertions;
+        uint64_t evictions;
+        size_t bytes; // bytes currently cached
+        size_t entries; // segments currently cached
+    };
+    /**
+     * @param byte_budget Maximum bytes of decompressed data kept
+     * @param max_segment_size Segments larger than this are never cached
+     */
+    SegmentCache(size_t byte_budget, size_t max_segment_size): byte_budget(byte_budget), max_segment_size(max_segment_size) {}
+    /**
+     * @brief Get a cached segment
+     * @return nullptr if not cached
+     */
+    SegmentBuffer Get(uint64_t start);
+    /**
+     * @brief Whether a segment is cached, without counting a hit or miss
+     */
+    bool Contains(uint64_t start) {
+        std::lock_guard<std::mutex> guard(mutex);
+        return items.find(start) != items.end();
+    }
+    void Put(uint64_t start, SegmentBuffer data);
+    bool Cacheable(uint64_t original_size) const {
+        return original_size <= max_segment_size && original_size <= byte_budget;
+    }
+    Stats GetStats();
+private:
+    std::mutex mutex;
+    size_t byte_budget;
+    size_t max_segment_size;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;
+    // Front is the most recently used
+    std::list<uint64_t> lru;
+    struct Item {
+        SegmentBuffer data;
+        std::list<uint64_t>::iterator lru_it;
+    };
+    std::unordered_map<uint64_t, Item> items;
+};
+
+/**
+ * @brief Seekable ReadStream over a shared segment buffer
+ */
+class SegmentBufferReadStream : public ReadStream {
+public:
+    SegmentBufferReadStream(SegmentBuffer data): data(data) {}
+    virtual size_t read(uint8_t* buf, size_t size) {
+        if (pos >= data->size()) return 0;
+        if (size > data->size() - pos) size = data->size() - pos;
+        memcpy(buf, data->data() + pos, size);
+        pos += size;
+        return size;
+    }
+    virtual bool seek(int64_t offset, int whence) {
+        int64_t new_pos;
+        if (whence == SEEK_SET) {
+            new_pos = offset;
+        } else if (whence == SEEK_CUR) {
+            new_pos = (int64_t)pos + offset;
+        } else if (whence == SEEK_END) {
+            new_pos = (int64_t)data->size() + offset;
+        } else {
+            return false;
+        }
+        if (new_pos < 0 || new_pos > (int64_t)data->size()) {
+            return false;
+        }
+        pos = (size_t)new_pos;
+        return true;
+    }
+    virtual int64_t tell() {
+        return (int64_t)pos;
+    }
+    virtual bool seekable() {
+        return true;
+    }
+    virtual bool eof() {
+        return pos >= data->size();
+    }
+    virtual bool error() {
+        return false;
+    }
+    virtual bool close() {
+        return true;
+    }
+private:
+    SegmentBuffer data;
+    size_t pos = 0;
+};
@@ -0,0 +1,125 @@
+#include "stats.h"
+
+namespace {
+    std::atomic<size_t> next_thread_shard{0};
+    thread_local size_t thread_shard = next_thread_shard.fetch_add(1, std::memory_order_relaxed) % XP3_STATS_SHARDS;
+
+    size_t latency_bucket(uint64_t ns) {
+        size_t bucket = 0;
+        while (ns > 1 && bucket + 1 < XP3_STATS_HISTOGRAM_BUCKETS) {
+            ns >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+}
+
+Xp3Stats::Xp3Stats(Xp3StatsMode mode): mode(mode), shards(new Shard[mode == XP3_STATS_PER_THREAD ? XP3_STATS_SHARDS : 1]) {
+    Reset();
+}
+
+Xp3Stats::Shard& Xp3Stats::shard() {
+    return shards[mode == XP3_STATS_PER_THREAD ? thread_shard : 0];
+}
+
+void Xp3Stats::AddLatency(Histogram histogram, uint64_t ns) {
+    shard().histograms[histogram][latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+Xp3Stats::Snapshot Xp3Stats::GetSnapshot() const {
+    Snapshot snapshot = {};
+    size_t count = mode == XP3_STATS_PER_THREAD ? XP3_STATS_SHARDS : 1;
+    for (size_t i = 0; i < count; i++) {
+        const Shard& shard = shards[i];
+        for (size_t c = 0; c < COUNTER_COUNT; c++) {
+            snapshot.counters[c] += shard.counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t h = 0; h < HISTOGRAM_COUNT; h++) {
+            for (size_t b = 0; b < XP3_STATS_HISTOGRAM_BUCKETS; b++) {
+                snapshot.histograms[h][b] += shard.histograms[h][b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return snapshot;
+}
+
+void Xp3Stats::Reset() {
+    size_t count = mode == XP3_STATS_PER_THREAD ? XP3_STATS_SHARDS : 1;
+    for (size_t i = 0; i < count; i++) {
+        Shard& shard = shards[i];
+        for (auto& counter : shard.counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for (auto& histogram : shard.histograms) {
+            for (auto& bucket : histogram) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+const char* Xp3Stats::GetCounterName(Counter counter) {
+    static const char* names[COUNTER_COUNT] = {
+        "bytes_read",
+        "bytes_mapped",
+        "io_calls",
+        "io_ns",
+        "bytes_delivered",
+        "decoder_creations",
+        "skipped_bytes",
+        "cache_discards",
+        "lock_wait_ns",
+    };
+    return counter < COUNTER_COUNT ? names[counter] : "unknown";
+}
+
+uint64_t Xp3Stats::Snapshot::Count(Histogram histogram) const {
+    uint64_t total = 0;
+    for (size_t b = 0; b < XP3_STATS_HISTOGRAM_BUCKETS; b++) {
+        total += histograms[histogram][b];
+    }
+    return total;
+}
+
+uint64_t Xp3Stats::Snapshot::Percentile(Histogram histogram, double p) const {
+    uint64_t total = Count(histogram);
+    if (!total) return 0;
+    uint64_t target = (uint64_t)(total * p / 100);
+    if (target >= total) target = total - 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < XP3_STATS_HISTOGRAM_BUCKETS; b++) {
+        seen += histograms[histogram][b];
+        if (seen > target) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return (uint64_t)2 << (XP3_STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+#if HAVE_STATS
+size_t StatsPositionalReader::pread(uint8_t* buf, size_t size, uint64_t offset) {
+    uint64_t start = Xp3Stats::Now();
+    size_t readed = reader->pread(buf, size, offset);
+    stats->Add(Xp3Stats::IO_NS, Xp3Stats::Now() - start);
+    stats->Add(Xp3Stats::IO_CALLS, 1);
+    stats->Add(Xp3Stats::BYTES_READ, readed);
+    return readed;
+}
+
+size_t StatsPositionalReader::preadv(const PositionalBuffer* buffers, size_t count, uint64_t offset) {
+    uint64_t start = Xp3Stats::Now();
+    size_t readed = reader->preadv(buffers, count, offset);
+    stats->Add(Xp3Stats::IO_NS, Xp3Stats::Now() - start);
+    stats->Add(Xp3Stats::IO_CALLS, 1);
+    stats->Add(Xp3Stats::BYTES_READ, readed);
+    return readed;
+}
+
+const uint8_t* StatsPositionalReader::map(uint64_t offset, uint64_t size) {
+    const uint8_t* data = reader->map(offset, size);
+    if (data) {
+        stats->Add(Xp3Stats::BYTES_MAPPED, size);
+    }
+    return data;
+}
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+#include <stdint.h>
+#include "positional.h"
+#include "xp3vfs_config.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/// Latency histogram bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds, the last bucket is open ended
+inline const size_t XP3_STATS_HISTOGRAM_BUCKETS = 32;
+/// Counter shards used by XP3_STATS_PER_THREAD
+inline const size_t XP3_STATS_SHARDS = 16;
+
+enum Xp3StatsMode {
+    /// One set of atomic counters shared by all threads
+    XP3_STATS_ATOMIC,
+    /// Each thread counts into its own cache line shard, shards are summed by GetSnapshot
+    XP3_STATS_PER_THREAD,
+};
+
+/**
+ * @brief I/O, decode and latency counters of an archive and the files opened from it
+ *
+ * Compiled out with meson option stats=false, Xp3Archive::EnableStats then returns false and
+ * the read path has no instrumentation at all.
+ */
+class Xp3Stats {
+public:
+    enum Counter {
+        BYTES_READ, // read from the archive with pread
+        BYTES_MAPPED, // accessed through the memory mapping
+        IO_CALLS,
+        IO_NS, // time spent in pread
+        BYTES_DELIVERED, // returned by Xp3File::read and bulk reads
+        DECODER_CREATIONS, // streaming decoders opened by Xp3File
+        SKIPPED_BYTES, // decoded and thrown away to move forward in a compressed segment
+        CACHE_DISCARDS, // open decoders dropped by a seek
+        LOCK_WAIT_NS, // waiting for the lock of a thread safe Xp3File
+        COUNTER_COUNT,
+    };
+    enum Histogram {
+        OPEN_LATENCY,
+        READ_LATENCY,
+        HISTOGRAM_COUNT,
+    };
+    struct Snapshot {
+        uint64_t counters[COUNTER_COUNT];
+        uint64_t histograms[HISTOGRAM_COUNT][XP3_STATS_HISTOGRAM_BUCKETS];
+        /// Number of latencies recorded in a histogram
+        uint64_t Count(Histogram histogram) const;
+        /**
+         * @brief Upper bound of the bucket holding percentile p (0-100)
+         * @return 0 if the histogram is empty
+         */
+        uint64_t Percentile(Histogram histogram, double p) const;
+    };
+    explicit Xp3Stats(Xp3StatsMode mode = XP3_STATS_PER_THREAD);
+    Xp3Stats(const Xp3Stats&) = delete;
+    Xp3Stats& operator=(const Xp3Stats&) = delete;
+    void Add(Counter counter, uint64_t value) {
+        shard().counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+    void AddLatency(Histogram histogram, uint64_t ns);
+    Snapshot GetSnapshot() const;
+    void Reset();
+    Xp3StatsMode GetMode() const {
+        return mode;
+    }
+    static const char* GetCounterName(Counter counter);
+    static uint64_t Now() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        std::atomic<uint64_t> histograms[HISTOGRAM_COUNT][XP3_STATS_HISTOGRAM_BUCKETS];
+    };
+    Shard& shard();
+    Xp3StatsMode mode;
+    std::unique_ptr<Shard[]> shards;
+};
+
+#if HAVE_STATS
+#define XP3_STATS_ADD(stats, counter, value) do { if (stats) (stats)->Add(Xp3Stats::counter, (value)); } while (0)
+#else
+#define XP3_STATS_ADD(stats, counter, value) do {} while (0)
+#endif
+
+#if HAVE_STATS
+/**
+ * @brief PositionalReader which counts the bytes and time of reads of another reader
+ */
+class StatsPositionalReader : public PositionalReader {
+public:
+    StatsPositionalReader(std::shared_ptr<PositionalReader> reader, std::shared_ptr<Xp3Stats> stats): reader(reader), stats(stats) {}
+    virtual size_t pread(uint8_t* buf, size_t size, uint64_t offset);
+    virtual size_t preadv(const PositionalBuffer* buffers, size_t count, uint64_t offset);
+    virtual bool error() {
+        return reader->error();
+    }
+    virtual void advise(uint64_t offset, uint64_t size) {
+        reader->advise(offset, size);
+    }
+    virtual const uint8_t* map(uint64_t offset, uint64_t size);
+private:
+    std::shared_ptr<PositionalReader> reader;
+    std::shared_ptr<Xp3Stats> stats;
+};
+#endif
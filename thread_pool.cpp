@@ -0,0 +1,58 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return tasks.empty() && running == 0; });
+        stopping = true;
+    }
+    task_cv.notify_all();
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        tasks.push_back(std::move(task));
+    }
+    task_cv.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this] { return tasks.empty() && running == 0; });
+}
+
+void ThreadPool::worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            running++;
+        }
+        task();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            running--;
+            if (tasks.empty() && running == 0) {
+                done_cv.notify_all();
+            }
+        }
+    }
+}
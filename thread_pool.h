@@ -0,0 +1,37 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed size pool of worker threads running tasks in submission order
+ */
+class ThreadPool {
+public:
+    /**
+     * @param threads Number of worker threads. 0 to use the number of hardware threads.
+     */
+    ThreadPool(size_t threads = 0);
+    /// Waits for all submitted tasks
+    ~ThreadPool();
+    void Submit(std::function<void()> task);
+    /**
+     * @brief Wait until all submitted tasks are finished
+     */
+    void Wait();
+    size_t Size() const {
+        return workers.size();
+    }
+private:
+    void worker();
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_cv;
+    std::condition_variable done_cv;
+    size_t running = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,159 @@
+#include "utf16.h"
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define UTF16_SSE2 1
+#include <emmintrin.h>
+#endif
+#if UTF16_SSE2 && (defined(__GNUC__) || defined(__clang__))
+#define UTF16_AVX2 1
+#include <immintrin.h>
+#endif
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+    /// Copy the leading ASCII code units of in to out, returns how many were copied
+    typedef size_t (*AsciiCopy)(const uint8_t* in, size_t length, char* out);
+
+    size_t copy_ascii_scalar(const uint8_t* in, size_t length, char* out) {
+        size_t n = 0;
+        while (n < length && in[n * 2] < 0x80 && in[n * 2 + 1] == 0) {
+            out[n] = (char)in[n * 2];
+            n++;
+        }
+        return n;
+    }
+
+#if UTF16_SSE2
+    inline unsigned count_trailing_zeros(uint32_t value) {
+#if _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return (unsigned)index;
+#else
+        return (unsigned)__builtin_ctz(value);
+#endif
+    }
+
+    // Full blocks are always stored, out has room for them because every code unit may take 3 bytes
+    size_t copy_ascii_sse2(const uint8_t* in, size_t length, char* out) {
+        const __m128i high = _mm_set1_epi16((short)0xFF80);
+        const __m128i zero = _mm_setzero_si128();
+        size_t n = 0;
+        while (length - n >= 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(in + n * 2));
+            __m128i b = _mm_loadu_si128((const __m128i*)(in + n * 2 + 16));
+            // packus saturates units >= 0x8000 to 0, so ASCII is decided on the 16-bit units
+            __m128i ascii_a = _mm_cmpeq_epi16(_mm_and_si128(a, high), zero);
+            __m128i ascii_b = _mm_cmpeq_epi16(_mm_and_si128(b, high), zero);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(ascii_a, ascii_b));
+            _mm_storeu_si128((__m128i*)(out + n), _mm_packus_epi16(a, b));
+            if (mask != 0xFFFF) {
+                return n + count_trailing_zeros(~mask);
+            }
+            n += 16;
+        }
+        return n + copy_ascii_scalar(in + n * 2, length - n, out + n);
+    }
+#endif
+
+#if UTF16_AVX2
+    __attribute__((target("avx2")))
+    size_t copy_ascii_avx2(const uint8_t* in, size_t length, char* out) {
+        const __m256i high = _mm256_set1_epi16((short)0xFF80);
+        const __m256i zero = _mm256_setzero_si256();
+        size_t n = 0;
+        while (length - n >= 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(in + n * 2));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(in + n * 2 + 32));
+            __m256i ascii_a = _mm256_cmpeq_epi16(_mm256_and_si256(a, high), zero);
+            __m256i ascii_b = _mm256_cmpeq_epi16(_mm256_and_si256(b, high), zero);
+            // Packing works per 128-bit lane, restore the order of the 64-bit quarters
+            __m256i ascii = _mm256_permute4x64_epi64(_mm256_packs_epi16(ascii_a, ascii_b), 0xD8);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(ascii);
+            _mm256_storeu_si256((__m256i*)(out + n), packed);
+            if (mask != 0xFFFFFFFF) {
+                return n + count_trailing_zeros(~mask);
+            }
+            n += 32;
+        }
+        return n + copy_ascii_sse2(in + n * 2, length - n, out + n);
+    }
+#endif
+
+    struct Backend {
+        AsciiCopy copy;
+        const char* name;
+    };
+
+    Backend select_backend() {
+#if UTF16_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return { copy_ascii_avx2, "avx2" };
+        }
+#endif
+#if UTF16_SSE2
+        return { copy_ascii_sse2, "sse2" };
+#else
+        return { copy_ascii_scalar, "scalar" };
+#endif
+    }
+
+    const Backend& get_backend() {
+        static const Backend backend = select_backend();
+        return backend;
+    }
+}
+
+bool append_utf16le_to_utf8(const uint8_t* data, size_t length, std::string& out) {
+    AsciiCopy copy_ascii = get_backend().copy;
+    size_t old_size = out.size();
+    out.resize(old_size + length * 3);
+    char* start = &out[old_size];
+    char* p = start;
+    size_t i = 0;
+    while (i < length) {
+        size_t copied = copy_ascii(data + i * 2, length - i, p);
+        i += copied;
+        p += copied;
+        // Non-ASCII run, back to the vector path at the next ASCII unit
+        while (i < length) {
+            uint32_t c = data[i * 2] | ((uint32_t)data[i * 2 + 1] << 8);
+            if (c < 0x80) {
+                break;
+            }
+            if (c < 0x800) {
+                p[0] = (char)(0xC0 | (c >> 6));
+                p[1] = (char)(0x80 | (c & 0x3F));
+                p += 2;
+                i++;
+            } else if (c < 0xD800 || c >= 0xE000) {
+                p[0] = (char)(0xE0 | (c >> 12));
+                p[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+                p[2] = (char)(0x80 | (c & 0x3F));
+                p += 3;
+                i++;
+            } else {
+                uint32_t low = i + 1 < length ? data[i * 2 + 2] | ((uint32_t)data[i * 2 + 3] << 8) : 0;
+                if (c >= 0xDC00 || low < 0xDC00 || low >= 0xE000) {
+                    out.resize(old_size);
+                    return false;
+                }
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                p[0] = (char)(0xF0 | (c >> 18));
+                p[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+                p[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+                p[3] = (char)(0x80 | (c & 0x3F));
+                p += 4;
+                i += 2;
+            }
+        }
+    }
+    out.resize(old_size + (p - start));
+    return true;
+}
+
+const char* get_utf16_backend() {
+    return get_backend().name;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/**
+ * @brief Append UTF-16LE text to out as UTF-8
+ *
+ * Runs of ASCII are converted 16 or 32 code units at a time with SSE2 / AVX2 when available.
+ * @param data UTF-16LE code units, does not need to be aligned
+ * @param length Number of code units
+ * @param out Output. Unchanged on failure.
+ * @return false if data contains an unpaired surrogate
+ */
+bool append_utf16le_to_utf8(const uint8_t* data, size_t length, std::string& out);
+/**
+ * @brief Name of the vector path used by append_utf16le_to_utf8, "avx2", "sse2" or "scalar"
+ */
+const char* get_utf16_backend();
@@ -1,12 +1,47 @@
 #include "xp3.h"
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include "decompressor.h"
 #include "wchar_util.h"
 #include <inttypes.h>
-#include "encoding.h"
+#include "utf16.h"
+#include "index_cache.h"
+#include "inflate_index.h"
 
-bool Xp3Archive::ReadIndex() {
+template <typename T>
+static inline T read_le(const uint8_t* data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// flag (4) + start (8) + original size (8) + packed size (8)
+static const size_t SEGMENT_RECORD_SIZE = 28;
+
+static inline Segment read_segment(const uint8_t* data) {
+    Segment seg;
+    seg.flag = read_le<uint32_t>(data);
+    seg.start = read_le<uint64_t>(data + 4);
+    seg.original_size = read_le<uint64_t>(data + 12);
+    seg.packed_size = read_le<uint64_t>(data + 20);
+    return seg;
+}
+
+static uint32_t checksum(const uint8_t* data, size_t size) {
+    uLong adler = adler32(0, Z_NULL, 0);
+    while (size > 0) {
+        uInt len = size > 0x40000000 ? 0x40000000 : (uInt)size;
+        adler = adler32(adler, data, len);
+        data += len;
+        size -= len;
+    }
+    return (uint32_t)adler;
+}
+
+bool Xp3Archive::ReadIndexHeader(IndexLocation& location) {
     uint8_t magic[11];
     if (!stream->readall(magic)) {
         return false;
@@ -46,180 +81,1299 @@ bool Xp3Archive::ReadIndex() {
     if (!stream->seek(index_offset, SEEK_SET)) {
         return false;
     }
-    std::vector<uint8_t> index;
-    uint8_t index_encode_method;
-    if (!stream->readu8(index_encode_method)) {
+    location.offset = index_offset;
+    location.original_size = 0;
+    if (!stream->readu8(location.encode_method)) {
         return false;
     }
-    switch (index_encode_method) {
+    switch (location.encode_method) {
     case TVP_XP3_INDEX_ENCODE_RAW:
     {
-        uint64_t index_size;
-        if (!stream->readu64(index_size)) {
+        if (!stream->readu64(location.stored_size)) {
+            return false;
+        }
+        location.data_offset = index_offset + 9;
+        break;
+    }
+    case TVP_XP3_INDEX_ENCODE_ZLIB:
+    {
+        if (!stream->readu64(location.stored_size)) {
             return false;
         }
-        index.resize(index_size);
-        if (!stream->readall(index)) {
+        if (!stream->readu64(location.original_size)) {
             return false;
         }
+        location.data_offset = index_offset + 17;
         break;
     }
-    case TVP_XP3_INDEX_ENCODE_ZLIB:
+    default:
     {
-        uint64_t packed_size;
-        if (!stream->readu64(packed_size)) {
+        printf("Unknown index encode method: %u\n", location.encode_method);
+        return false;
+    }
+    }
+    return true;
+}
+
+bool Xp3Archive::ReadIndex() {
+    WaitIndex();
+    IndexLocation location;
+    if (!ReadIndexHeader(location)) {
+        return false;
+    }
+    if (use_lazy) {
+        return StartLazyIndex(location, false);
+    }
+    if (streaming_index) {
+        return StartIndexStream(location, false);
+    }
+    std::vector<uint8_t> index;
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t>& stored = location.encode_method == TVP_XP3_INDEX_ENCODE_RAW ? index : packed;
+    stored.resize(location.stored_size);
+    if (!stream->readall(stored)) {
+        return false;
+    }
+    index_from_cache = false;
+    bool use_cache = !index_cache_path.empty() && !filename.empty();
+    IndexCacheKey key;
+    if (use_cache) {
+        use_cache = get_file_stat(filename, key.archive_size, key.archive_mtime);
+        key.index_offset = location.offset;
+        key.index_checksum = checksum(stored.data(), stored.size());
+        key.minor_version = minor_version;
+    }
+    if (use_cache && LoadIndexCache(key)) {
+        index_from_cache = true;
+        return true;
+    }
+    if (location.encode_method == TVP_XP3_INDEX_ENCODE_ZLIB) {
+        if (!decompress(packed.data(), packed.size(), index, location.original_size)) {
             return false;
         }
-        uint64_t original_size;
-        if (!stream->readu64(original_size)) {
+        packed.clear();
+        packed.shrink_to_fit();
+    }
+    if (!ParseIndex(index.data(), index.size())) {
+        return false;
+    }
+    if (use_cache) {
+        SaveIndexCache(key);
+    }
+    return true;
+}
+
+bool Xp3Archive::LoadIndexCache(const IndexCacheKey& key) {
+    bool path_index_loaded;
+    CompactIndex cached_index;
+    CompactIndex& target = use_compact ? compact_index : cached_index;
+    if (!load_index_cache(index_cache_path, key, target, path_index, path_flags, path_index_loaded)) {
+        return false;
+    }
+    if (!use_compact) {
+        files.clear();
+        files.reserve(cached_index.size());
+        for (size_t i = 0; i < cached_index.size(); i++) {
+            files.push_back(cached_index.ToFileEntry(i));
+        }
+    }
+    loaded_count = GetFileCount();
+    if (path_index_loaded) {
+        std::lock_guard<std::mutex> guard(dir_tree_mutex);
+        dir_tree = DirectoryTree();
+    } else {
+        BuildPathIndex();
+    }
+    return true;
+}
+
+void Xp3Archive::SaveIndexCache(const IndexCacheKey& key) {
+    if (use_compact) {
+        save_index_cache(index_cache_path, key, compact_index, path_index);
+        return;
+    }
+    CompactIndex cached_index;
+    for (const auto& file : files) {
+        CompactEntry entry;
+        entry.name_offset = (uint32_t)cached_index.names.size();
+        entry.name_length = (uint32_t)file.filename.size();
+        entry.flags = file.flags;
+        entry.adler32 = file.adler32;
+        entry.original_size = file.original_size;
+        entry.packed_size = file.packed_size;
+        entry.segment_offset = (uint32_t)cached_index.segments.size();
+        entry.segment_count = (uint32_t)file.segments.size();
+        cached_index.names.append(file.filename);
+        cached_index.segments.insert(cached_index.segments.end(), file.segments.begin(), file.segments.end());
+        cached_index.entries.push_back(entry);
+    }
+    save_index_cache(index_cache_path, key, cached_index, path_index);
+}
+
+bool Xp3Archive::ReadIndexInBackground() {
+    WaitIndex();
+    IndexLocation location;
+    if (!ReadIndexHeader(location)) {
+        return false;
+    }
+    if (use_lazy) {
+        return StartLazyIndex(location, true);
+    }
+    return StartIndexStream(location, true);
+}
+
+// Adler32 of [offset, offset + size) read in pieces
+static bool checksum_region(PositionalReader& reader, uint64_t offset, uint64_t size, uint32_t& result) {
+    const uint8_t* mapped = reader.map(offset, size);
+    if (mapped) {
+        result = checksum(mapped, size);
+        return true;
+    }
+    std::vector<uint8_t> buffer(READ_AHEAD_MIN_WINDOW);
+    uLong adler = adler32(0, Z_NULL, 0);
+    while (size > 0) {
+        size_t len = size > buffer.size() ? buffer.size() : (size_t)size;
+        if (reader.pread(buffer.data(), len, offset) != len) {
             return false;
         }
-        int64_t current_pos = stream->tell();
-        if (current_pos < 0) {
+        adler = adler32(adler, buffer.data(), (uInt)len);
+        offset += len;
+        size -= len;
+    }
+    result = (uint32_t)adler;
+    return true;
+}
+
+bool Xp3Archive::StartIndexStream(const IndexLocation& location, bool background) {
+    index_from_cache = false;
+    bool use_cache = !index_cache_path.empty() && !filename.empty();
+    IndexCacheKey key;
+    if (use_cache) {
+        use_cache = get_file_stat(filename, key.archive_size, key.archive_mtime) && checksum_region(*reader, location.data_offset, location.stored_size, key.index_checksum);
+        key.index_offset = location.offset;
+        key.minor_version = minor_version;
+    }
+    if (use_cache && LoadIndexCache(key)) {
+        index_from_cache = true;
+        return true;
+    }
+    files.clear();
+    compact_index.Clear();
+    path_index.Clear();
+    path_index.SetFlags(path_flags);
+    {
+        std::lock_guard<std::mutex> guard(dir_tree_mutex);
+        dir_tree = DirectoryTree();
+    }
+    loaded_count = 0;
+    index_failed = false;
+    index_cancel = false;
+    index_loading = true;
+    if (!background) {
+        return FinishIndexStream(location, use_cache, key);
+    }
+    std::lock_guard<std::mutex> guard(index_thread_mutex);
+    index_thread = std::thread([this, location, use_cache, key]() {
+        FinishIndexStream(location, use_cache, key);
+    });
+    return true;
+}
+
+bool Xp3Archive::FinishIndexStream(const IndexLocation& location, bool use_cache, const IndexCacheKey& key) {
+    ReadStream* source = new PositionalRegion(reader, location.data_offset, location.data_offset + location.stored_size, READ_AHEAD_MIN_WINDOW);
+    uint64_t size = location.stored_size;
+    if (location.encode_method == TVP_XP3_INDEX_ENCODE_ZLIB) {
+        source = create_decompressor(source);
+        // Without the original size the index ends with the decompressed data
+        size = location.original_size ? location.original_size : UINT64_MAX;
+    }
+    bool ok = source && ParseIndexStream(source, size);
+    if (source) {
+        ok = ok && !source->error();
+        source->close();
+        delete source;
+    }
+    if (ok && use_cache) {
+        // Only this thread adds entries, readers do not block saving
+        SaveIndexCache(key);
+    }
+    {
+        std::unique_lock<std::shared_mutex> guard(index_mutex);
+        if (use_compact) {
+            compact_index.ShrinkToFit();
+        }
+        index_failed = !ok;
+        index_loading = false;
+    }
+    index_cv.notify_all();
+    return ok;
+}
+
+// Read exactly size bytes from a stream which may return less per call
+static bool read_exact(ReadStream* source, uint8_t* buf, size_t size) {
+    while (size > 0) {
+        size_t readed = source->read(buf, size);
+        if (readed == 0) {
             return false;
         }
-        ReadStream* region = new ReadStreamRegion(stream, current_pos, current_pos + packed_size);
-        if (!decompress(region, index, original_size)) {
+        buf += readed;
+        size -= readed;
+    }
+    return true;
+}
+
+bool Xp3Archive::ParseIndexStream(ReadStream* source, uint64_t size) {
+    // Holds one File chunk, grows only to the largest one
+    std::vector<uint8_t> window;
+    auto name_of = [this](size_t i) { return GetFileName(i); };
+    uint64_t offset = 0;
+    size_t unpublished = 0;
+    while (offset < size) {
+        if (index_cancel) {
             return false;
         }
-        break;
+        uint8_t header[12];
+        if (size == UINT64_MAX) {
+            size_t readed = source->read(header, 1);
+            if (readed == 0 && !source->error()) {
+                break;
+            }
+            if (readed != 1 || !read_exact(source, header + 1, 11)) {
+                return false;
+            }
+        } else if (size - offset < 12 || !read_exact(source, header, 12)) {
+            return false;
+        }
+        uint64_t chunk_size = read_le<uint64_t>(header + 4);
+        offset += 12;
+        if (chunk_size > size - offset) {
+            return false;
+        }
+        offset += chunk_size;
+        if (memcmp(header, CHUNK_FILE, 4)) {
+            printf("Unknown chunk type: %.4s, chunk size: %" PRIu64 "\n", header, chunk_size);
+            while (chunk_size > 0) {
+                window.resize(chunk_size > READ_AHEAD_MIN_WINDOW ? READ_AHEAD_MIN_WINDOW : (size_t)chunk_size);
+                if (!read_exact(source, window.data(), window.size())) {
+                    return false;
+                }
+                chunk_size -= window.size();
+            }
+            continue;
+        }
+        window.resize(chunk_size);
+        if (!read_exact(source, window.data(), window.size())) {
+            return false;
+        }
+        {
+            std::unique_lock<std::shared_mutex> guard(index_mutex);
+            if (!ReadFileEntry(window.data(), window.size())) {
+                return false;
+            }
+            path_index.Insert(GetFileCount() - 1, name_of);
+            loaded_count = GetFileCount();
+        }
+        if (++unpublished == XP3_INDEX_PUBLISH_BATCH) {
+            index_cv.notify_all();
+            unpublished = 0;
+        }
     }
-    default:
+    return true;
+}
+
+bool Xp3Archive::WaitIndex() {
+    std::lock_guard<std::mutex> guard(index_thread_mutex);
+    if (index_thread.joinable()) {
+        index_thread.join();
+    }
+    return !index_failed;
+}
+
+bool Xp3Archive::StartLazyIndex(const IndexLocation& location, bool background) {
+    index_from_cache = false;
+    files.clear();
+    compact_index.Clear();
+    lazy_index.Clear();
+    path_index.Clear();
     {
-        printf("Unknown index encode method: %u\n", index_encode_method);
-        return false;
+        std::lock_guard<std::mutex> guard(dir_tree_mutex);
+        dir_tree = DirectoryTree();
+    }
+    loaded_count = 0;
+    index_failed = false;
+    index_cancel = false;
+    index_loading = true;
+    if (!background) {
+        return FinishLazyIndex(location);
+    }
+    std::lock_guard<std::mutex> guard(index_thread_mutex);
+    index_thread = std::thread([this, location]() {
+        FinishLazyIndex(location);
+    });
+    return true;
+}
+
+bool Xp3Archive::FinishLazyIndex(const IndexLocation& location) {
+    // Built aside and published at once, readers waiting on index_cv see all entries or none
+    LazyIndex index;
+    PathIndex paths;
+    bool ok = ReadLazyIndex(location, index, paths);
+    {
+        std::unique_lock<std::shared_mutex> guard(index_mutex);
+        if (ok) {
+            lazy_index = std::move(index);
+            path_index = std::move(paths);
+            loaded_count = lazy_index.size();
+        }
+        index_failed = !ok;
+        index_loading = false;
     }
+    index_cv.notify_all();
+    return ok;
+}
+
+bool Xp3Archive::ReadLazyIndex(const IndexLocation& location, LazyIndex& index, PathIndex& paths) {
+    const uint8_t* mapped = nullptr;
+    if (location.encode_method == TVP_XP3_INDEX_ENCODE_RAW) {
+        mapped = reader->map(location.data_offset, location.stored_size);
+    }
+    if (mapped) {
+        index.SetData(mapped, location.stored_size);
+    } else {
+        std::vector<uint8_t> stored(location.stored_size);
+        if (reader->pread(stored.data(), stored.size(), location.data_offset) != stored.size()) {
+            return false;
+        }
+        if (location.encode_method == TVP_XP3_INDEX_ENCODE_ZLIB) {
+            std::vector<uint8_t> decompressed;
+            if (!decompress(stored.data(), stored.size(), decompressed, location.original_size)) {
+                return false;
+            }
+            stored.swap(decompressed);
+        }
+        index.SetData(std::move(stored));
     }
-    MemReadStream index_stream(index);
-    while (!index_stream.eof()) {
-        uint8_t chunk_type[4];
-        if (!index_stream.readall(chunk_type)) {
+    // First pass: locate File chunks, check them and hash their names. Nothing is allocated per entry.
+    const uint8_t* data = index.GetData();
+    size_t size = index.GetDataSize();
+    std::vector<uint64_t> hashes;
+    std::string name;
+    size_t offset = 0;
+    while (offset < size) {
+        if (index_cancel) {
             return false;
         }
-        uint64_t chunk_size;
-        if (!index_stream.readu64(chunk_size)) {
+        if (size - offset < 12) {
+            return false;
+        }
+        const uint8_t* chunk_type = data + offset;
+        uint64_t chunk_size = read_le<uint64_t>(data + offset + 4);
+        offset += 12;
+        if (chunk_size > size - offset) {
             return false;
         }
         if (memcmp(chunk_type, CHUNK_FILE, 4)) {
             printf("Unknown chunk type: %.4s, chunk size: %" PRIu64 "\n", chunk_type, chunk_size);
-            if (!index_stream.skip(chunk_size)) {
-                return false;
-            }
+            offset += chunk_size;
             continue;
         }
-        std::vector<uint8_t> chunk_data(chunk_size);
-        if (!index_stream.readall(chunk_data)) {
+        if (chunk_size > UINT32_MAX) {
             return false;
         }
-        MemReadStream chunk_stream(chunk_data);
-        if (!ReadFileEntry(chunk_stream)) {
+        index.Add(offset, (uint32_t)chunk_size);
+        if (!index.GetName(index.size() - 1, name)) {
             return false;
         }
+        hashes.push_back(hash_path(name, path_flags));
+        offset += chunk_size;
     }
+    index.Finish();
+    // Names are only decoded for equal hashes, i.e. duplicate paths
+    paths.BuildHashed(index.size(), [&hashes](size_t i) { return hashes[i]; }, [&index](size_t i) { return std::string_view(index.Get(i).filename); }, path_flags);
     return true;
 }
 
-bool Xp3Archive::ReadFileEntry(MemReadStream& stream) {
-    FileEntry entry;
-    while (!stream.eof()) {
-        uint8_t chunk_type[4];
-        if (!stream.readall(chunk_type)) {
+bool Xp3Archive::ParseIndex(const uint8_t* data, size_t size) {
+    if (use_compact) {
+        compact_index.Clear();
+    }
+    size_t offset = 0;
+    while (offset < size) {
+        if (size - offset < 12) {
+            return false;
+        }
+        const uint8_t* chunk_type = data + offset;
+        uint64_t chunk_size = read_le<uint64_t>(data + offset + 4);
+        offset += 12;
+        if (chunk_size > size - offset) {
+            return false;
+        }
+        if (memcmp(chunk_type, CHUNK_FILE, 4)) {
+            printf("Unknown chunk type: %.4s, chunk size: %" PRIu64 "\n", chunk_type, chunk_size);
+            offset += chunk_size;
+            continue;
+        }
+        if (!ReadFileEntry(data + offset, chunk_size)) {
             return false;
         }
-        uint64_t chunk_size;
-        if (!stream.readu64(chunk_size)) {
+        offset += chunk_size;
+    }
+    if (use_compact) {
+        compact_index.ShrinkToFit();
+    }
+    loaded_count = GetFileCount();
+    BuildPathIndex();
+    return true;
+}
+
+// Append the UTF-8 form of a UTF-16LE name to out
+static bool append_name(const uint8_t* name_data, uint16_t name_length, std::string& out, std::string& buffer) {
+#if _WIN32
+    std::wstring wname((const wchar_t*)name_data, name_length);
+    if (!wchar_util::wstr_to_str(buffer, wname, 65001)) {
+        return false;
+    }
+    out.append(buffer);
+    return true;
+#else
+    return append_utf16le_to_utf8(name_data, name_length, out);
+#endif
+}
+
+/// Fields of a File chunk, pointing into the index data
+struct FileChunk {
+    uint32_t flags = 0;
+    uint64_t original_size = 0;
+    uint64_t packed_size = 0;
+    uint32_t adler = 0;
+    const uint8_t* name_data = nullptr;
+    uint16_t name_length = 0;
+    const uint8_t* segm_data = nullptr;
+    size_t segm_count = 0;
+};
+
+// Sub-chunks are read in place, nothing is copied.
+static bool parse_file_chunk(const uint8_t* data, size_t size, FileChunk& result) {
+    size_t offset = 0;
+    while (offset < size) {
+        if (size - offset < 12) {
             return false;
         }
-        std::vector<uint8_t> chunk_data(chunk_size);
-        if (!stream.readall(chunk_data)) {
+        const uint8_t* chunk_type = data + offset;
+        uint64_t chunk_size = read_le<uint64_t>(data + offset + 4);
+        offset += 12;
+        if (chunk_size > size - offset) {
             return false;
         }
-        MemReadStream chunk_stream(chunk_data);
+        const uint8_t* chunk = data + offset;
+        offset += chunk_size;
         if (!memcmp(chunk_type, CHUNK_INFO, 4)) {
-            if (!chunk_stream.readu32(entry.flags)) {
+            if (chunk_size < 22) {
                 return false;
             }
-            if (!chunk_stream.readu64(entry.original_size)) {
+            result.flags = read_le<uint32_t>(chunk);
+            result.original_size = read_le<uint64_t>(chunk + 4);
+            result.packed_size = read_le<uint64_t>(chunk + 12);
+            result.name_length = read_le<uint16_t>(chunk + 20);
+            if ((uint64_t)result.name_length * 2 > chunk_size - 22) {
                 return false;
             }
-            if (!chunk_stream.readu64(entry.packed_size)) {
-                return false;
-            }
-            uint16_t name_length;
-            if (!chunk_stream.readu16(name_length)) {
+            result.name_data = chunk + 22;
+        } else if (!memcmp(chunk_type, CHUNK_ADLR, 4)) {
+            if (chunk_size < 4) {
                 return false;
             }
-            std::vector<uint8_t> name_data(name_length * 2);
-            if (!chunk_stream.readall(name_data)) {
+            result.adler = read_le<uint32_t>(chunk);
+        } else if (!memcmp(chunk_type, CHUNK_SEGM, 4)) {
+            if (chunk_size % SEGMENT_RECORD_SIZE) {
                 return false;
             }
-#if _WIN32
-            std::wstring wname((wchar_t*)name_data.data(), name_length);
-            if (!wchar_util::wstr_to_str(entry.filename, wname, 65001)) {
-                return false;
+            result.segm_data = chunk;
+            result.segm_count = chunk_size / SEGMENT_RECORD_SIZE;
+        }
+    }
+    return true;
+}
+
+// Copy everything but the name of a parsed File chunk into entry
+static void fill_file_entry(const FileChunk& chunk, FileEntry& entry) {
+    entry.flags = chunk.flags;
+    entry.original_size = chunk.original_size;
+    entry.packed_size = chunk.packed_size;
+    entry.adler32 = chunk.adler;
+    entry.segments.reserve(chunk.segm_count);
+    for (size_t i = 0; i < chunk.segm_count; i++) {
+        entry.segments.push_back(read_segment(chunk.segm_data + i * SEGMENT_RECORD_SIZE));
+    }
+}
+
+bool Xp3Archive::ReadFileEntry(const uint8_t* data, size_t size) {
+    FileChunk chunk;
+    if (!parse_file_chunk(data, size, chunk)) {
+        return false;
+    }
+    if (use_compact) {
+        CompactEntry entry;
+        size_t name_offset = compact_index.names.size();
+        if (!append_name(chunk.name_data, chunk.name_length, compact_index.names, name_buffer)) {
+            return false;
+        }
+        if (compact_index.names.size() > UINT32_MAX || compact_index.segments.size() + chunk.segm_count > UINT32_MAX) {
+            compact_index.names.resize(name_offset);
+            return false;
+        }
+        entry.name_offset = (uint32_t)name_offset;
+        entry.name_length = (uint32_t)(compact_index.names.size() - name_offset);
+        entry.flags = chunk.flags;
+        entry.original_size = chunk.original_size;
+        entry.packed_size = chunk.packed_size;
+        entry.adler32 = chunk.adler;
+        entry.segment_offset = (uint32_t)compact_index.segments.size();
+        entry.segment_count = (uint32_t)chunk.segm_count;
+        for (size_t i = 0; i < chunk.segm_count; i++) {
+            compact_index.segments.push_back(read_segment(chunk.segm_data + i * SEGMENT_RECORD_SIZE));
+        }
+        compact_index.entries.push_back(entry);
+        return true;
+    }
+    FileEntry entry;
+    if (!append_name(chunk.name_data, chunk.name_length, entry.filename, name_buffer)) {
+        return false;
+    }
+    fill_file_entry(chunk, entry);
+    files.push_back(std::move(entry));
+    return true;
+}
+
+LazyIndex& LazyIndex::operator=(LazyIndex&& other) noexcept {
+    if (this != &other) {
+        Clear();
+        buffer = std::move(other.buffer);
+        data = other.data;
+        data_size = other.data_size;
+        chunks = std::move(other.chunks);
+        entries = std::move(other.entries);
+        other.data = nullptr;
+        other.data_size = 0;
+        other.chunks.clear();
+    }
+    return *this;
+}
+
+bool LazyIndex::GetName(size_t index, std::string& name) const {
+    const Chunk& chunk = chunks[index];
+    FileChunk parsed;
+    if (!parse_file_chunk(data + chunk.offset, chunk.size, parsed)) {
+        return false;
+    }
+    std::string buffer;
+    name.clear();
+    return append_name(parsed.name_data, parsed.name_length, name, buffer);
+}
+
+void LazyIndex::Finish() {
+    entries.reset(new std::atomic<FileEntry*>[chunks.size()]);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        entries[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+const FileEntry& LazyIndex::decode(size_t index) const {
+    // Chunks were checked by the first pass, parsing them again cannot fail
+    const Chunk& chunk = chunks[index];
+    FileChunk parsed;
+    parse_file_chunk(data + chunk.offset, chunk.size, parsed);
+    std::unique_ptr<FileEntry> decoded(new FileEntry());
+    std::string buffer;
+    append_name(parsed.name_data, parsed.name_length, decoded->filename, buffer);
+    fill_file_entry(parsed, *decoded);
+    FileEntry* expected = nullptr;
+    if (entries[index].compare_exchange_strong(expected, decoded.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return *decoded.release();
+    }
+    // Another thread decoded it first
+    return *expected;
+}
+
+size_t LazyIndex::GetDecodedCount() const {
+    size_t count = 0;
+    for (size_t i = 0; entries && i < chunks.size(); i++) {
+        if (entries[i].load(std::memory_order_acquire)) count++;
+    }
+    return count;
+}
+
+size_t LazyIndex::MemoryUsage() const {
+    size_t usage = buffer.capacity() + chunks.capacity() * sizeof(Chunk);
+    if (!entries) {
+        return usage;
+    }
+    usage += chunks.size() * sizeof(std::atomic<FileEntry*>);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const FileEntry* entry = entries[i].load(std::memory_order_acquire);
+        if (!entry) continue;
+        usage += sizeof(FileEntry) + entry->segments.capacity() * sizeof(Segment);
+        if (entry->filename.capacity() >= sizeof(std::string)) {
+            usage += entry->filename.capacity() + 1;
+        }
+    }
+    return usage;
+}
+
+void LazyIndex::Clear() {
+    if (entries) {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            delete entries[i].load(std::memory_order_relaxed);
+        }
+        entries.reset();
+    }
+    chunks.clear();
+    chunks.shrink_to_fit();
+    buffer.clear();
+    buffer.shrink_to_fit();
+    data = nullptr;
+    data_size = 0;
+}
+
+size_t Xp3Archive::GetIndexMemoryUsage() const {
+    size_t usage = path_index.MemoryUsage();
+    if (use_compact) {
+        return usage + compact_index.MemoryUsage();
+    }
+    if (use_lazy) {
+        return usage + lazy_index.MemoryUsage();
+    }
+    usage += files.capacity() * sizeof(FileEntry);
+    for (const auto& file : files) {
+        // Short names are stored inline by std::string
+        if (file.filename.capacity() >= sizeof(std::string)) {
+            usage += file.filename.capacity() + 1;
+        }
+        usage += file.segments.capacity() * sizeof(Segment);
+    }
+    return usage;
+}
+
+void Xp3Archive::BuildPathIndex() {
+    if (use_lazy) {
+        // Hash the names from the index data, entries are still decoded only for equal hashes
+        std::string name;
+        auto hash_of = [this, &name](size_t i) {
+            lazy_index.GetName(i, name);
+            return hash_path(name, path_flags);
+        };
+        path_index.BuildHashed(GetFileCount(), hash_of, [this](size_t i) { return GetFileName(i); }, path_flags);
+    } else {
+        path_index.Build(GetFileCount(), [this](size_t i) { return GetFileName(i); }, path_flags);
+    }
+    std::lock_guard<std::mutex> guard(dir_tree_mutex);
+    dir_tree = DirectoryTree();
+}
+
+/**
+ * @brief Decode a whole segment into out (seg.original_size bytes)
+ * @param packed Reused buffer for compressed data
+ */
+static bool decode_segment(PositionalReader& reader, const Segment& seg, uint8_t* out, BufferDecompressor& decoder, std::vector<uint8_t>& packed) {
+    if (seg.flag != TVP_XP3_SEGM_ENCODE_ZLIB) {
+        return reader.pread(out, seg.original_size, seg.start) == seg.original_size;
+    }
+    const uint8_t* mapped = reader.map(seg.start, seg.packed_size);
+    if (mapped) {
+        return decoder.Decompress(mapped, seg.packed_size, out, seg.original_size);
+    }
+    packed.resize(seg.packed_size);
+    if (reader.pread(packed.data(), packed.size(), seg.start) != packed.size()) {
+        return false;
+    }
+    return decoder.Decompress(packed.data(), packed.size(), out, seg.original_size);
+}
+
+static SegmentBuffer load_segment(SegmentCache* segment_cache, PositionalReader& reader, const Segment& seg) {
+    if (segment_cache) {
+        auto cached = segment_cache->Get(seg.start);
+        if (cached) return cached;
+    }
+    auto data = std::make_shared<std::vector<uint8_t>>(seg.original_size);
+    BufferDecompressor decoder;
+    std::vector<uint8_t> packed;
+    if (!decode_segment(reader, seg, data->data(), decoder, packed)) {
+        return nullptr;
+    }
+    if (segment_cache) {
+        segment_cache->Put(seg.start, data);
+    }
+    return data;
+}
+
+SegmentBuffer Xp3Archive::GetSegmentData(const Segment& seg) {
+    return load_segment(segment_cache.get(), *reader, seg);
+}
+
+void Xp3Archive::EnableSegmentCache(size_t byte_budget, size_t max_segment_size) {
+    segment_cache = std::make_shared<SegmentCache>(byte_budget, max_segment_size);
+}
+
+bool Xp3Archive::GetSegmentCacheStats(SegmentCache::Stats& stats) {
+    if (!segment_cache) return false;
+    stats = segment_cache->GetStats();
+    return true;
+}
+
+Xp3File* Xp3Archive::OpenFile(size_t index) {
+    if (index_loading) {
+        std::shared_lock<std::shared_mutex> guard(index_mutex);
+        index_cv.wait(guard, [this, index]() { return index < GetFileCount() || !index_loading; });
+        if (index >= GetFileCount()) {
+            return nullptr;
+        }
+        FileEntry entry = GetFileEntry(index);
+        guard.unlock();
+        return OpenFile(std::move(entry));
+    }
+    return OpenFile(GetFileEntry(index));
+}
+
+Xp3File* Xp3Archive::OpenFile(FileEntry entry) {
+#if HAVE_STATS
+    uint64_t start = stats ? Xp3Stats::Now() : 0;
+#endif
+    auto trace = access_trace;
+    uint32_t trace_file = trace ? trace->RegisterFile(entry.filename) : 0;
+    Xp3File* file = new Xp3File(std::move(entry), reader, thread_safety, checkpoints, segment_cache, read_ahead);
+    if (trace) {
+        trace->Record(ACCESS_TRACE_OPEN, trace_file, 0, 0);
+        file->SetAccessTrace(std::move(trace), trace_file);
+    }
+#if HAVE_STATS
+    if (stats) {
+        file->SetStats(stats);
+        stats->AddLatency(Xp3Stats::OPEN_LATENCY, Xp3Stats::Now() - start);
+    }
+#endif
+    return file;
+}
+
+void Xp3Archive::EnablePrefetch(size_t threads) {
+    prefetcher.reset(new Prefetcher(reader, segment_cache, threads));
+}
+
+bool Xp3Archive::Prefetch(const std::vector<size_t>& indexes, bool decompress) {
+    if (!prefetcher) return false;
+    std::vector<Segment> segments;
+    for (size_t index : indexes) {
+        if (index >= GetFileCount()) continue;
+        if (use_compact) {
+            const Segment* segs = compact_index.GetSegments(index);
+            segments.insert(segments.end(), segs, segs + compact_index.entries[index].segment_count);
+        } else {
+            const auto& segs = GetEntryRef(index).segments;
+            segments.insert(segments.end(), segs.begin(), segs.end());
+        }
+    }
+    prefetcher->Prefetch(std::move(segments), decompress);
+    return true;
+}
+
+void Xp3Archive::CancelPrefetch() {
+    if (prefetcher) prefetcher->Cancel();
+}
+
+void Xp3Archive::WaitPrefetch() {
+    if (prefetcher) prefetcher->Wait();
+}
+
+bool Xp3Archive::GetPrefetchStats(Prefetcher::Stats& stats) {
+    if (!prefetcher) return false;
+    stats = prefetcher->GetStats();
+    return true;
+}
+
+void Xp3Archive::EnableInflateCheckpoints(uint64_t interval, size_t memory_limit) {
+    checkpoints = std::make_shared<InflateIndexCache>(interval, memory_limit);
+}
+
+bool Xp3Archive::BuildInflateCheckpoints(size_t index) {
+    if (!checkpoints) return false;
+    std::unique_ptr<Xp3File> file(OpenFile(index));
+    const size_t chunk_size = 65536;
+    std::vector<uint8_t> buffer(chunk_size);
+    while (file->read(buffer.data(), chunk_size) > 0);
+    return !file->error();
+}
+
+Xp3File* Xp3Archive::OpenFile(std::string_view path) {
+    size_t index;
+    if (!Find(path, index)) {
+        return nullptr;
+    }
+    return OpenFile(index);
+}
+
+bool Xp3Archive::ReadAll(size_t index, std::vector<uint8_t>& data) {
+    data.resize(use_compact ? compact_index.entries[index].original_size : GetEntryRef(index).original_size);
+    return ReadInto(index, data.data(), data.size());
+}
+
+bool Xp3Archive::ReadInto(size_t index, uint8_t* dst, size_t size) {
+    Xp3ReadRequest request = { index, dst, size, false };
+    return ReadMany(&request, 1);
+}
+
+size_t Xp3Archive::LoadZstdDictionaries() {
+    const size_t extension_length = sizeof(ZSTD_DICTIONARY_EXTENSION) - 1;
+    size_t count = 0;
+    std::vector<uint8_t> data;
+    for (size_t i = 0; i < GetFileCount(); i++) {
+        std::string_view name = GetFileName(i);
+        if (name.size() < extension_length || name.compare(name.size() - extension_length, extension_length, ZSTD_DICTIONARY_EXTENSION)) continue;
+        if (ReadAll(i, data) && ZstdDictionaries::Register(data.data(), data.size())) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Merged reads which need a staging buffer (compressed or overlapping segments) are limited to this size
+inline const uint64_t MAX_MERGED_READ = 8 << 20;
+
+bool Xp3Archive::ReadMany(Xp3ReadRequest* requests, size_t count) {
+    struct PlanItem {
+        uint64_t start;
+        uint64_t packed_size;
+        uint64_t original_size;
+        uint8_t* dst;
+        size_t request;
+        bool compressed;
+    };
+#if HAVE_STATS
+    uint64_t stats_start = stats ? Xp3Stats::Now() : 0;
+#endif
+    size_t total_segments = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t index = requests[i].index;
+        total_segments += use_compact ? compact_index.entries[index].segment_count : GetEntryRef(index).segments.size();
+    }
+    if (auto trace = access_trace) {
+        for (size_t i = 0; i < count; i++) {
+            size_t index = requests[i].index;
+            uint32_t file = trace->RegisterFile(GetFileName(index));
+            trace->Record(ACCESS_TRACE_OPEN, file, 0, 0);
+            trace->Record(ACCESS_TRACE_READ, file, 0, use_compact ? compact_index.entries[index].original_size : GetEntryRef(index).original_size);
+        }
+    }
+    std::vector<PlanItem> plan;
+    plan.reserve(total_segments);
+    for (size_t i = 0; i < count; i++) {
+        Xp3ReadRequest& request = requests[i];
+        const Segment* segs;
+        size_t seg_count;
+        uint64_t original_size;
+        if (use_compact) {
+            const CompactEntry& entry = compact_index.entries[request.index];
+            segs = compact_index.GetSegments(request.index);
+            seg_count = entry.segment_count;
+            original_size = entry.original_size;
+        } else {
+            const FileEntry& entry = GetEntryRef(request.index);
+            segs = entry.segments.data();
+            seg_count = entry.segments.size();
+            original_size = entry.original_size;
+        }
+        request.ok = false;
+        if (!request.dst && original_size > 0) continue;
+        if (request.size < original_size) continue;
+        uint64_t total = 0;
+        bool valid = true;
+        for (size_t j = 0; j < seg_count; j++) {
+            const Segment& seg = segs[j];
+            bool compressed = seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB;
+            if ((!compressed && seg.packed_size != seg.original_size) || seg.original_size > original_size - total) {
+                valid = false;
+                break;
             }
-#else
-            std::string name((char*)name_data.data(), name_length * 2);
-            if (!encoding::convert(name, entry.filename, "UTF-16LE", "UTF-8")) {
-                return false;
+            plan.push_back({ seg.start, seg.packed_size, seg.original_size, request.dst + total, i, compressed });
+            total += seg.original_size;
+        }
+        if (!valid || total != original_size) {
+            while (!plan.empty() && plan.back().request == i) plan.pop_back();
+            continue;
+        }
+        request.ok = true;
+    }
+    std::sort(plan.begin(), plan.end(), [](const PlanItem& a, const PlanItem& b) { return a.start < b.start; });
+    std::vector<PositionalBuffer> buffers;
+    std::vector<uint8_t> staging;
+    BufferDecompressor decoder;
+    for (size_t i = 0; i < plan.size();) {
+        uint64_t run_start = plan[i].start;
+        uint64_t run_end = run_start + plan[i].packed_size;
+        // Stored segments which follow each other on disk are read straight into their destinations
+        bool direct = !plan[i].compressed;
+        size_t j = i + 1;
+        while (j < plan.size() && plan[j].start <= run_end) {
+            uint64_t end = std::max(run_end, plan[j].start + plan[j].packed_size);
+            bool item_direct = direct && !plan[j].compressed && plan[j].start == run_end;
+            if (!item_direct && end - run_start > MAX_MERGED_READ) break;
+            direct = item_direct;
+            run_end = end;
+            j++;
+        }
+        const uint8_t* base = reader->map(run_start, run_end - run_start);
+        bool run_ok = true;
+        if (!base && direct) {
+            buffers.clear();
+            for (size_t k = i; k < j; k++) {
+                buffers.push_back({ plan[k].dst, (size_t)plan[k].packed_size });
             }
-#endif
-        } else if (!memcmp(chunk_type, CHUNK_ADLR, 4)) {
-            if (!chunk_stream.readu32(entry.adler32)) {
-                return false;
+            run_ok = reader->preadv(buffers.data(), buffers.size(), run_start) == run_end - run_start;
+        } else {
+            if (!base) {
+                staging.resize(run_end - run_start);
+                run_ok = reader->pread(staging.data(), staging.size(), run_start) == staging.size();
+                base = staging.data();
             }
-        } else if (!memcmp(chunk_type, CHUNK_SEGM, 4)) {
-            while (!chunk_stream.eof()) {
-                Segment seg;
-                if (!chunk_stream.readu32(seg.flag)) {
-                    return false;
+            for (size_t k = i; run_ok && k < j; k++) {
+                const PlanItem& item = plan[k];
+                const uint8_t* src = base + (item.start - run_start);
+                if (!item.compressed) {
+                    memcpy(item.dst, src, item.original_size);
+                    continue;
                 }
-                if (!chunk_stream.readu64(seg.start)) {
-                    return false;
+                if (segment_cache && segment_cache->Cacheable(item.original_size)) {
+                    auto cached = segment_cache->Get(item.start);
+                    if (cached && cached->size() == item.original_size) {
+                        memcpy(item.dst, cached->data(), item.original_size);
+                        continue;
+                    }
                 }
-                if (!chunk_stream.readu64(seg.original_size)) {
-                    return false;
+                if (!decoder.Decompress(src, item.packed_size, item.dst, item.original_size)) {
+                    requests[item.request].ok = false;
                 }
-                if (!chunk_stream.readu64(seg.packed_size)) {
-                    return false;
+            }
+        }
+        if (!run_ok) {
+            for (size_t k = i; k < j; k++) {
+                requests[plan[k].request].ok = false;
+            }
+        }
+        i = j;
+    }
+    bool all_ok = true;
+    for (size_t i = 0; i < count; i++) {
+        all_ok = all_ok && requests[i].ok;
+    }
+#if HAVE_STATS
+    if (stats) {
+        for (size_t i = 0; i < count; i++) {
+            if (!requests[i].ok) continue;
+            size_t index = requests[i].index;
+            stats->Add(Xp3Stats::BYTES_DELIVERED, use_compact ? compact_index.entries[index].original_size : GetEntryRef(index).original_size);
+        }
+        stats->AddLatency(Xp3Stats::READ_LATENCY, Xp3Stats::Now() - stats_start);
+    }
+#endif
+    return all_ok;
+}
+
+bool Xp3Archive::EnableStats(Xp3StatsMode mode) {
+#if HAVE_STATS
+    if (!stats) {
+        stats = std::make_shared<Xp3Stats>(mode);
+        reader = std::make_shared<StatsPositionalReader>(reader, stats);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Xp3Archive::GetStats(Xp3Stats::Snapshot& snapshot) {
+#if HAVE_STATS
+    if (!stats) return false;
+    snapshot = stats->GetSnapshot();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Xp3Archive::ResetStats() {
+#if HAVE_STATS
+    if (stats) {
+        stats->Reset();
+    }
+#endif
+}
+
+void Xp3Archive::EnableAsyncIo(size_t queue_depth, size_t workers) {
+    // A mapped archive has nothing to wait for
+    async_reader.reset(new AsyncReader(reader, IsMapped() ? std::string() : filename, queue_depth, workers));
+}
+
+bool Xp3Archive::ReadAsync(size_t index, uint8_t* dst, size_t size, AsyncReadCallback callback) {
+    if (!async_reader) return false;
+    if (use_compact) {
+        const CompactEntry& entry = compact_index.entries[index];
+        if (size < entry.original_size) return false;
+        async_reader->Read(compact_index.GetSegments(index), entry.segment_count, dst, std::move(callback));
+    } else {
+        const FileEntry& entry = GetEntryRef(index);
+        if (size < entry.original_size) return false;
+        async_reader->Read(entry.segments.data(), entry.segments.size(), dst, std::move(callback));
+    }
+    return true;
+}
+
+std::future<bool> Xp3Archive::ReadAsync(size_t index, uint8_t* dst, size_t size) {
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto future = promise->get_future();
+    if (!ReadAsync(index, dst, size, [promise](bool ok) { promise->set_value(ok); })) {
+        promise->set_value(false);
+    }
+    return future;
+}
+
+void Xp3Archive::WaitAsync() {
+    if (async_reader) async_reader->Wait();
+}
+
+void Xp3Archive::EnableParallelDecode(size_t threads) {
+    decode_pool.reset(new ThreadPool(threads));
+}
+
+bool Xp3Archive::ReadParallel(size_t index, std::vector<uint8_t>& data, bool verify) {
+    data.resize(use_compact ? compact_index.entries[index].original_size : GetEntryRef(index).original_size);
+    return ReadParallel(index, data.data(), data.size(), verify);
+}
+
+// Segments of ReadParallel are grouped into tasks of at least this many decompressed bytes
+inline const uint64_t PARALLEL_DECODE_MIN_TASK = 1 << 20;
+
+bool Xp3Archive::ReadParallel(size_t index, uint8_t* dst, size_t size, bool verify) {
+    struct Task {
+        size_t first; // first segment
+        size_t count;
+        uint64_t offset; // offset of the first segment in the file
+    };
+    // Shared with helpers, a helper started after the read finished finds no work
+    struct State {
+        std::vector<Segment> segments;
+        std::vector<Task> tasks;
+        std::vector<uint32_t> adlers;
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        size_t done = 0;
+    };
+    FileEntry entry = GetFileEntry(index);
+    if (size < entry.original_size) return false;
+    auto state = std::make_shared<State>();
+    state->segments = std::move(entry.segments);
+    uint64_t total = 0;
+    for (auto& seg : state->segments) {
+        total += seg.original_size;
+    }
+    if (total != entry.original_size) return false;
+    size_t threads = decode_pool ? decode_pool->Size() + 1 : 1;
+    uint64_t target = std::max<uint64_t>(PARALLEL_DECODE_MIN_TASK, total / (threads * 2));
+    uint64_t offset = 0;
+    for (size_t i = 0; i < state->segments.size(); i++) {
+        if (state->tasks.empty() || offset - state->tasks.back().offset >= target) {
+            state->tasks.push_back({ i, 0, offset });
+        }
+        state->tasks.back().count++;
+        offset += state->segments[i].original_size;
+    }
+    state->adlers.resize(state->segments.size());
+    auto work = [this, state, dst, verify] {
+        BufferDecompressor decoder;
+        std::vector<uint8_t> packed;
+        while (true) {
+            size_t n = state->next++;
+            if (n >= state->tasks.size()) break;
+            const Task& task = state->tasks[n];
+            uint8_t* out = dst + task.offset;
+            // Claimed tasks are always counted as done, after a failure they are skipped
+            for (size_t i = task.first; i < task.first + task.count && !state->failed; i++) {
+                const Segment& seg = state->segments[i];
+                SegmentBuffer cached = seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB && segment_cache && segment_cache->Cacheable(seg.original_size) ? segment_cache->Get(seg.start) : nullptr;
+                if (cached && cached->size() == seg.original_size) {
+                    memcpy(out, cached->data(), seg.original_size);
+                } else if (!decode_segment(*reader, seg, out, decoder, packed)) {
+                    state->failed = true;
+                }
+                if (verify) {
+                    state->adlers[i] = checksum(out, seg.original_size);
                 }
-                entry.segments.push_back(seg);
+                out += seg.original_size;
             }
+            std::lock_guard<std::mutex> guard(state->mutex);
+            if (++state->done == state->tasks.size()) {
+                state->done_cv.notify_all();
+            }
+        }
+    };
+    if (decode_pool && state->tasks.size() > 1) {
+        for (size_t i = 1; i < std::min(threads, state->tasks.size()); i++) {
+            decode_pool->Submit(work);
         }
     }
-    files.push_back(std::move(entry));
+    // The calling thread works too, so a busy pool cannot stall the read
+    work();
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->done_cv.wait(lock, [&state] { return state->done == state->tasks.size(); });
+    }
+    if (state->failed) return false;
+    if (verify) {
+        uint32_t adler = adler32(0, nullptr, 0);
+        for (size_t i = 0; i < state->segments.size(); i++) {
+            adler = adler32_combine(adler, state->adlers[i], (z_off_t)state->segments[i].original_size);
+        }
+        return adler == entry.adler32;
+    }
     return true;
 }
 
-Xp3File* Xp3Archive::OpenFile(size_t index) {
-    return new Xp3File(files[index], stream, thread_safety ? mutex : nullptr);
+bool Xp3Archive::Find(std::string_view path, size_t& index) {
+    if (index_loading) {
+        return FindLoading(path, index);
+    }
+    size_t found = path_index.Find(path, [this](size_t i) { return GetFileName(i); });
+    if (found == PathIndex::npos) {
+        return false;
+    }
+    index = found;
+    return true;
 }
 
-Xp3File* Xp3Archive::OpenFile(FileEntry entry) {
-    return new Xp3File(std::move(entry), stream, thread_safety ? mutex : nullptr);
+bool Xp3Archive::FindLoading(std::string_view path, size_t& index) {
+    std::shared_lock<std::shared_mutex> guard(index_mutex);
+    while (true) {
+        size_t found = path_index.Find(path, [this](size_t i) { return GetFileName(i); });
+        if (found != PathIndex::npos) {
+            index = found;
+            return true;
+        }
+        if (!index_loading) {
+            return false;
+        }
+        index_cv.wait(guard);
+    }
+}
+
+void Xp3Archive::SetPathFlags(uint32_t flags) {
+    if (flags == path_flags) return;
+    path_flags = flags;
+    if (GetFileCount() > 0) {
+        BuildPathIndex();
+    }
+}
+
+bool Xp3Archive::ListDirectory(std::string_view dir, DirectoryTree::Node& node) {
+    std::lock_guard<std::mutex> guard(dir_tree_mutex);
+    if (dir_tree.Empty()) {
+        dir_tree.Build(GetFileCount(), [this](size_t i) { return GetFileName(i); }, path_flags);
+    }
+    // Copied under the lock, the tree is reset when the index or path flags change
+    const DirectoryTree::Node* found = dir_tree.Get(dir);
+    if (!found) {
+        return false;
+    }
+    node = *found;
+    return true;
+}
+
+bool Xp3Archive::GetFileView(size_t index, const uint8_t*& data, uint64_t& size) {
+    if (use_compact) {
+        const CompactEntry& entry = compact_index.entries[index];
+        return GetSegmentsView(compact_index.GetSegments(index), entry.segment_count, entry.original_size, data, size);
+    }
+    return GetFileView(GetEntryRef(index), data, size);
+}
+
+bool Xp3Archive::GetFileView(const FileEntry& entry, const uint8_t*& data, uint64_t& size) {
+    return GetSegmentsView(entry.segments.data(), entry.segments.size(), entry.original_size, data, size);
+}
+
+bool Xp3Archive::GetSegmentsView(const Segment* segs, size_t count, uint64_t original_size, const uint8_t*& data, uint64_t& size) {
+    if (count != 1) {
+        if (count == 0 && original_size == 0 && IsMapped()) {
+            data = nullptr;
+            size = 0;
+            return true;
+        }
+        return false;
+    }
+    const Segment& seg = segs[0];
+    if (seg.flag != TVP_XP3_SEGM_ENCODE_RAW || seg.original_size != original_size) {
+        return false;
+    }
+    const uint8_t* mapped = reader->map(seg.start, seg.original_size);
+    if (!mapped) {
+        return false;
+    }
+    data = mapped;
+    size = seg.original_size;
+    return true;
 }
 
 size_t Xp3File::read(uint8_t* buf, size_t size) {
+#if HAVE_STATS
+    if (stats) {
+        return read_counted(buf, size);
+    }
+#endif
+    if (mutex) {
+        std::lock_guard<std::mutex> guard(*mutex);
+        return read_recorded(buf, size);
+    } else {
+        return read_recorded(buf, size);
+    }
+}
+
+#if HAVE_STATS
+size_t Xp3File::read_counted(uint8_t* buf, size_t size) {
+    uint64_t start = Xp3Stats::Now();
+    size_t readed;
     if (mutex) {
         std::lock_guard<std::mutex> guard(*mutex);
-        return read_internal(buf, size);
+        stats->Add(Xp3Stats::LOCK_WAIT_NS, Xp3Stats::Now() - start);
+        readed = read_recorded(buf, size);
     } else {
-        return read_internal(buf, size);
+        readed = read_recorded(buf, size);
     }
+    stats->Add(Xp3Stats::BYTES_DELIVERED, readed);
+    stats->AddLatency(Xp3Stats::READ_LATENCY, Xp3Stats::Now() - start);
+    return readed;
+}
+#endif
+
+size_t Xp3File::read_recorded(uint8_t* buf, size_t size) {
+    if (!trace) return read_internal(buf, size);
+    uint64_t start = pos;
+    size_t readed = read_internal(buf, size);
+    trace->Record(ACCESS_TRACE_READ, trace_file, start, readed);
+    return readed;
 }
 
 size_t Xp3File::read_internal(uint8_t* buf, size_t size) {
     if (!buf) return 0;
     if (pos >= entry.original_size) return 0;
+    if (cache && pos != cache_pos && !move_cache()) {
+        XP3_STATS_ADD(stats, CACHE_DISCARDS, 1);
+        drop_cache();
+    }
     if (cache) {
         auto readed = cache->read(buf, size);
         if (readed > 0) {
             pos += readed;
+            cache_pos = pos;
             return readed;
         }
-        cache->close();
-        delete cache;
-        cache = nullptr;
+        drop_cache();
     }
     size_t seg_index = binary_search_pos(pos);
     Segment& seg = entry.segments[seg_index];
@@ -227,32 +1381,117 @@ size_t Xp3File::read_internal(uint8_t* buf, size_t size) {
     uint64_t seg_pos = this->seg_pos[seg_index];
     uint64_t skip_pos = this->pos - seg_pos;
     uint64_t read_size = seg.packed_size;
+    if (seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB && segment_cache && segment_cache->Cacheable(seg.original_size)) {
+        auto data = load_segment(segment_cache.get(), *reader, seg);
+        if (!data) return 0;
+        cache = new SegmentBufferReadStream(data);
+        cache_seg = seg_index;
+        if (skip_pos > 0) {
+            cache->seek(skip_pos, SEEK_SET);
+        }
+        size_t readed = cache->read(buf, size);
+        this->pos += readed;
+        cache_pos = pos;
+        return readed;
+    }
     if (seg.flag == TVP_XP3_SEGM_ENCODE_ZLIB) {
-        ReadStream* region = new ReadStreamRegion(stream, start_pos, start_pos + read_size);
-        cache = create_decompressor(region);
+        cache = open_compressed(seg, skip_pos);
         if (!cache) return 0;
-        if (skip_pos > 0) {
-            cache->skip(skip_pos);
+        cache_seg = seg_index;
+        if (skip_pos > 0 && !skip_decoded(skip_pos)) {
+            drop_cache();
+            return 0;
         }
         size_t readed = cache->read(buf, size);
         this->pos += readed;
+        cache_pos = pos;
         return readed;
     }
-    std::unique_ptr<ReadStream> region(new ReadStreamRegion(stream, start_pos + skip_pos, start_pos + read_size));
-    size_t readed = region->read(buf, size);
+    // Stored segments are read at the offset, seeking never touches them
+    if (skip_pos >= read_size) return 0;
+    if (size > read_size - skip_pos) size = read_size - skip_pos;
+    size_t readed = read_ahead ? read_ahead->Read(*reader, buf, size, start_pos + skip_pos, start_pos + read_size) : reader->pread(buf, size, start_pos + skip_pos);
     this->pos += readed;
     return readed;
 }
 
+bool Xp3File::move_cache() {
+    uint64_t seg_start = seg_pos[cache_seg];
+    // A decoded segment from the segment cache moves both ways for free
+    if (cache->seekable()) {
+        return cache->seek(pos - seg_start, SEEK_SET);
+    }
+    if (pos < cache_pos) {
+        return false;
+    }
+    auto decoder = checkpoints ? dynamic_cast<CheckpointZlibDecompressor*>(cache) : nullptr;
+    if (decoder && decoder->HasCheckpointBefore(pos - seg_start)) {
+        return false;
+    }
+    if (!skip_decoded(pos - cache_pos)) {
+        return false;
+    }
+    cache_pos = pos;
+    return true;
+}
+
+bool Xp3File::skip_decoded(uint64_t size) {
+    XP3_STATS_ADD(stats, SKIPPED_BYTES, size);
+    // Shared by the files of a thread, one large read lets inflate work on long runs
+    static thread_local std::vector<uint8_t> scratch;
+    if (scratch.empty()) {
+        scratch.resize(XP3_SKIP_BUFFER_SIZE);
+    }
+    while (size > 0) {
+        size_t len = size > scratch.size() ? scratch.size() : (size_t)size;
+        size_t readed = cache->read(scratch.data(), len);
+        if (readed == 0) {
+            return false;
+        }
+        size -= readed;
+    }
+    return true;
+}
+
+ReadStream* Xp3File::open_compressed(const Segment& seg, uint64_t& skip_pos) {
+    XP3_STATS_ADD(stats, DECODER_CREATIONS, 1);
+    const uint8_t* mapped = reader->map(seg.start, seg.packed_size);
+    if (checkpoints) {
+        uint8_t header[4];
+        size_t header_size = mapped ? (seg.packed_size < 4 ? (size_t)seg.packed_size : 4) : reader->pread(header, seg.packed_size < 4 ? (size_t)seg.packed_size : 4, seg.start);
+        if (!is_zstd_data(mapped ? mapped : header, header_size)) {
+            auto index = checkpoints->Get(seg.start);
+            auto point = checkpoints->FindPoint(*index, skip_pos);
+            ReadStream* region = mapped ? nullptr : new PositionalRegion(reader, seg.start, seg.start + seg.packed_size, read_ahead_size);
+            auto decoder = new CheckpointZlibDecompressor(region, mapped, (size_t)seg.packed_size, checkpoints, index, point);
+            skip_pos -= decoder->position();
+            return decoder;
+        }
+    }
+    if (mapped) {
+        return create_decompressor(mapped, seg.packed_size);
+    }
+    ReadStream* region = new PositionalRegion(reader, seg.start, seg.start + seg.packed_size, read_ahead_size);
+    return create_decompressor(region);
+}
+
 bool Xp3File::seek(int64_t offset, int whence) {
     if (mutex) {
         std::lock_guard<std::mutex> guard(*mutex);
-        return seek_internal(offset, whence);
+        return seek_recorded(offset, whence);
     } else {
-        return seek_internal(offset, whence);
+        return seek_recorded(offset, whence);
     }
 }
 
+bool Xp3File::seek_recorded(int64_t offset, int whence) {
+    bool ok = seek_internal(offset, whence);
+    if (ok && trace) {
+        trace->Record(ACCESS_TRACE_SEEK, trace_file, pos, 0);
+    }
+    return ok;
+}
+
 bool Xp3File::seek_internal(int64_t offset, int whence) {
     uint64_t new_pos = 0;
     if (whence == SEEK_SET) {
@@ -267,22 +1506,10 @@ bool Xp3File::seek_internal(int64_t offset, int whence) {
     if (new_pos > entry.original_size) {
         return false;
     }
-    if (cache && new_pos < entry.original_size) {
-        size_t old_seg_index = binary_search_pos(pos);
-        size_t new_seg_index = binary_search_pos(new_pos);
-        if (old_seg_index == new_seg_index) {
-            if (new_pos >= pos) {
-                cache->skip(new_pos - pos);
-            } else {
-                cache->close();
-                delete cache;
-                cache = nullptr;
-            }
-        } else {
-            cache->close();
-            delete cache;
-            cache = nullptr;
-        }
+    // Keep the decoder if the next read can still use it, nothing is decoded until then
+    if (cache && (binary_search_pos(new_pos) != cache_seg || (new_pos < cache_pos && !cache->seekable()))) {
+        XP3_STATS_ADD(stats, CACHE_DISCARDS, 1);
+        drop_cache();
     }
     pos = new_pos;
     return true;
@@ -1,7 +1,23 @@
 #pragma once
 #include <stdint.h>
 #include "stream.h"
+#include "positional.h"
+#include "path_index.h"
+#include "inflate_index.h"
+#include "segment_cache.h"
+#include "prefetch.h"
+#include "async_io.h"
+#include "access_trace.h"
+#include "stats.h"
+#include <atomic>
+#include <condition_variable>
+#include <future>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 inline const char* XP3_MAGIC = "XP3\r\n \n\x1a\x8b\x67\x01";
 
@@ -23,6 +39,13 @@ inline const uint32_t TVP_XP3_SEGM_ENCODE_ZLIB = 0x01;
 
 inline const uint64_t TVP_XP3_CURRENT_HEADER_VERSION = 0x17;
 
+struct IndexCacheKey;
+
+/// Entries parsed by a streaming index parse between wake-ups of waiting readers
+inline const size_t XP3_INDEX_PUBLISH_BATCH = 64;
+/// Scratch buffer used to decode and drop data when skipping forward inside a compressed segment
+inline const size_t XP3_SKIP_BUFFER_SIZE = 256 << 10;
+
 struct Segment {
     uint32_t flag;
     uint64_t start; // start offset in the file
@@ -40,9 +63,160 @@ public:
     std::vector<Segment> segments;
 };
 
+struct CompactEntry {
+    uint32_t name_offset; // offset of the name in CompactIndex::names
+    uint32_t name_length;
+    uint32_t flags;
+    uint32_t adler32;
+    uint64_t original_size;
+    uint64_t packed_size;
+    uint32_t segment_offset; // index of the first segment in CompactIndex::segments
+    uint32_t segment_count;
+};
+
+/**
+ * @brief File table which stores all names in one arena and all segments in one array
+ */
+class CompactIndex {
+public:
+    size_t size() const {
+        return entries.size();
+    }
+    std::string_view GetName(size_t index) const {
+        const CompactEntry& entry = entries[index];
+        return std::string_view(names.data() + entry.name_offset, entry.name_length);
+    }
+    const Segment* GetSegments(size_t index) const {
+        return segments.data() + entries[index].segment_offset;
+    }
+    FileEntry ToFileEntry(size_t index) const {
+        const CompactEntry& entry = entries[index];
+        FileEntry result;
+        result.filename = std::string(GetName(index));
+        result.flags = entry.flags;
+        result.original_size = entry.original_size;
+        result.packed_size = entry.packed_size;
+        result.adler32 = entry.adler32;
+        const Segment* segs = GetSegments(index);
+        result.segments.assign(segs, segs + entry.segment_count);
+        return result;
+    }
+    size_t MemoryUsage() const {
+        return names.capacity() + entries.capacity() * sizeof(CompactEntry) + segments.capacity() * sizeof(Segment);
+    }
+    void Clear() {
+        names.clear();
+        entries.clear();
+        segments.clear();
+    }
+    /// Release unused capacity after parsing
+    void ShrinkToFit() {
+        names.shrink_to_fit();
+        entries.shrink_to_fit();
+        segments.shrink_to_fit();
+    }
+    std::string names;
+    std::vector<CompactEntry> entries;
+    std::vector<Segment> segments;
+};
+
+/**
+ * @brief File table which keeps the File chunks of the index and decodes an entry when it is first used
+ *
+ * Get may be called from multiple threads. Each entry is decoded at most once and never changes afterwards.
+ */
+class LazyIndex {
+public:
+    LazyIndex() = default;
+    LazyIndex(const LazyIndex&) = delete;
+    LazyIndex& operator=(const LazyIndex&) = delete;
+    LazyIndex& operator=(LazyIndex&& other) noexcept;
+    ~LazyIndex() {
+        Clear();
+    }
+    size_t size() const {
+        return chunks.size();
+    }
+    /**
+     * @brief Get an entry, decoding it on first use
+     */
+    const FileEntry& Get(size_t index) const {
+        FileEntry* entry = entries[index].load(std::memory_order_acquire);
+        return entry ? *entry : decode(index);
+    }
+    /**
+     * @brief Convert the name of an entry to UTF-8 without decoding the entry
+     * @param name Receives the name
+     * @return false if the File chunk or the name is invalid
+     */
+    bool GetName(size_t index, std::string& name) const;
+    /**
+     * @brief Take the decompressed index
+     */
+    void SetData(std::vector<uint8_t> buffer) {
+        this->buffer = std::move(buffer);
+        data = this->buffer.data();
+        data_size = this->buffer.size();
+    }
+    /**
+     * @brief Use index data owned by someone else, e.g. a memory mapping, which outlives this table
+     */
+    void SetData(const uint8_t* data, size_t size) {
+        buffer.clear();
+        this->data = data;
+        data_size = size;
+    }
+    const uint8_t* GetData() const {
+        return data;
+    }
+    size_t GetDataSize() const {
+        return data_size;
+    }
+    /**
+     * @brief Add the File chunk at offset in the index data
+     */
+    void Add(size_t offset, uint32_t size) {
+        chunks.push_back({ offset, size });
+    }
+    /**
+     * @brief Allocate the decoded entry table after all chunks are added. Get can be used afterwards.
+     */
+    void Finish();
+    /**
+     * @brief Number of entries decoded so far
+     */
+    size_t GetDecodedCount() const;
+    size_t MemoryUsage() const;
+    void Clear();
+private:
+    struct Chunk {
+        size_t offset; // offset of the File chunk data in data
+        uint32_t size;
+    };
+    const FileEntry& decode(size_t index) const;
+    std::vector<uint8_t> buffer;
+    const uint8_t* data = nullptr;
+    size_t data_size = 0;
+    std::vector<Chunk> chunks;
+    // Decoded entries, nullptr until first used
+    std::unique_ptr<std::atomic<FileEntry*>[]> entries;
+};
+
 class Xp3File: public ReadStream {
 public:
-    Xp3File(FileEntry entry, ReadStream* stream, std::shared_ptr<std::mutex> lock): entry(entry), stream(stream), pos(0), mutex(lock) {
+    /**
+     * @brief Create a Xp3File
+     * @param entry File entry
+     * @param reader Reader of the whole archive. Reads never move a shared cursor.
+     * @param thread_safety Whether this object's own state is guarded by a lock
+     * @param checkpoints Inflate checkpoints used to seek inside zlib segments. Can be nullptr.
+     * @param segment_cache Cache of decompressed segments. Can be nullptr.
+     * @param read_ahead Maximum read-ahead window for sequential reads. 0 to disable.
+     */
+    Xp3File(FileEntry entry, std::shared_ptr<PositionalReader> reader, bool thread_safety, std::shared_ptr<InflateIndexCache> checkpoints = nullptr, std::shared_ptr<SegmentCache> segment_cache = nullptr, size_t read_ahead = 0): entry(entry), reader(reader), pos(0), mutex(thread_safety ? new std::mutex() : nullptr), checkpoints(checkpoints), segment_cache(segment_cache), read_ahead_size(read_ahead) {
+        if (read_ahead) {
+            this->read_ahead.reset(new ReadAhead(read_ahead));
+        }
         uint64_t pos = 0;
         for (auto& seg : entry.segments) {
             seg_pos.push_back(pos);
@@ -105,21 +279,60 @@ public:
     uint64_t get_original_size() const {
         return entry.original_size;
     }
+    /**
+     * @brief Record reads and seeks of this file
+     * @param file Id of the file name in trace
+     */
+    void SetAccessTrace(std::shared_ptr<AccessTrace> trace, uint32_t file) {
+        this->trace = std::move(trace);
+        trace_file = file;
+    }
+    /**
+     * @brief Count reads, decoders, skips and lock waits of this file. Does nothing when built without stats.
+     * @param stats Counters, can be shared with the archive and other files. nullptr to stop counting.
+     */
+    void SetStats(std::shared_ptr<Xp3Stats> stats) {
+#if HAVE_STATS
+        this->stats = std::move(stats);
+#endif
+    }
 private:
+#if HAVE_STATS
+    size_t read_counted(uint8_t* buf, size_t size);
+#endif
+    size_t read_recorded(uint8_t* buf, size_t size);
     size_t read_internal(uint8_t* buf, size_t size);
+    /**
+     * @brief Create a decoder for a compressed segment
+     * @param skip_pos Offset in the segment to read from. Set to the number of bytes still to skip from the decoder's position.
+     */
+    ReadStream* open_compressed(const Segment& seg, uint64_t& skip_pos);
+    /**
+     * @brief Bring cache to pos after seeks, the cheapest way
+     * @return false if cache cannot get there, reopening the segment is then needed
+     */
+    bool move_cache();
+    /**
+     * @brief Decode and drop size bytes of cache
+     */
+    bool skip_decoded(uint64_t size);
+    void drop_cache() {
+        if (cache) {
+            cache->close();
+            delete cache;
+            cache = nullptr;
+        }
+    }
+    bool seek_recorded(int64_t offset, int whence);
     bool seek_internal(int64_t offset, int whence);
     bool error_internal() {
-        return stream->error() || (cache && cache->error());
+        return reader->error() || (cache && cache->error());
     }
     bool eof_internal() {
         return pos >= entry.original_size;
     }
     bool close_internal() {
-        if (cache) {
-            cache->close();
-            delete cache;
-            cache = nullptr;
-        }
+        drop_cache();
         return true;
     }
     size_t binary_search_pos(uint64_t offset) {
@@ -138,18 +351,78 @@ private:
         return left > 0 ? left - 1 : 0;
     }
     FileEntry entry;
-    ReadStream* stream;
+    std::shared_ptr<PositionalReader> reader;
     std::vector<uint64_t> seg_pos;
     uint64_t pos;
     ReadStream* cache = nullptr;
-    std::shared_ptr<std::mutex> mutex = nullptr;
+    // Segment decoded by cache and the file position of the next byte it returns.
+    // Seeks only move pos, cache catches up on the next read.
+    size_t cache_seg = 0;
+    uint64_t cache_pos = 0;
+    // Only guards this file's position and decoder state, never shared with other files.
+    std::unique_ptr<std::mutex> mutex = nullptr;
+    std::shared_ptr<InflateIndexCache> checkpoints;
+    std::shared_ptr<SegmentCache> segment_cache;
+    size_t read_ahead_size;
+    // Read-ahead of stored segments, compressed segments get their own in PositionalRegion
+    std::unique_ptr<ReadAhead> read_ahead;
+    std::shared_ptr<AccessTrace> trace;
+    uint32_t trace_file = 0;
+#if HAVE_STATS
+    std::shared_ptr<Xp3Stats> stats;
+#endif
+};
+
+/**
+ * @brief One file to read with Xp3Archive::ReadMany
+ */
+struct Xp3ReadRequest {
+    size_t index; // index of the file
+    uint8_t* dst; // receives the whole file
+    size_t size;  // size of dst, at least the original size of the file
+    bool ok;      // set by ReadMany
 };
 
 class Xp3Archive {
 public:
-    Xp3Archive(const char* filename, bool thread_safety = true) : stream(new FileReadStream(filename)), thread_safety(thread_safety), mutex(thread_safety ? std::make_shared<std::mutex>() : nullptr) {}
-    Xp3Archive(ReadStream* stream, bool thread_safety = true) : stream(stream), thread_safety(thread_safety), mutex(thread_safety ? std::make_shared<std::mutex>() : nullptr) {}
+    /**
+     * @brief Open a archive from file
+     * @param filename Path to the archive
+     * @param thread_safety If true, opened files read the archive with positional I/O and can be used concurrently
+     * @param use_mmap If true, map the whole archive into memory. Stored segments can then be accessed with GetFileView.
+     */
+    Xp3Archive(const char* filename, bool thread_safety = true, bool use_mmap = false) : stream(new FileReadStream(filename)), thread_safety(thread_safety), mutex(thread_safety ? std::make_shared<std::mutex>() : nullptr), filename(filename) {
+        if (use_mmap) {
+            auto mmap_reader = std::make_shared<MmapPositionalReader>(filename);
+            if (mmap_reader->is_open()) {
+                reader = mmap_reader;
+                return;
+            }
+        }
+        if (thread_safety) {
+            auto file_reader = std::make_shared<FilePositionalReader>(filename);
+            if (file_reader->is_open()) {
+                reader = file_reader;
+                return;
+            }
+        }
+        reader = std::make_shared<StreamPositionalReader>(stream, mutex);
+    }
+    /**
+     * @brief Open a archive from stream
+     * @param stream Seekable stream (will be closed and deleted when this object is destroyed)
+     * @param thread_safety If true, reads of the stream are serialized by a lock. Decompression still runs without the lock.
+     */
+    Xp3Archive(ReadStream* stream, bool thread_safety = true) : stream(stream), thread_safety(thread_safety), mutex(thread_safety ? std::make_shared<std::mutex>() : nullptr) {
+        reader = std::make_shared<StreamPositionalReader>(stream, mutex);
+    }
     ~Xp3Archive() {
+        index_cancel = true;
+        WaitIndex();
+        // Workers may still read through stream
+        prefetcher.reset();
+        async_reader.reset();
+        decode_pool.reset();
         if (stream) {
             stream->close();
             delete stream;
@@ -157,16 +430,367 @@ public:
         }
     }
     bool ReadIndex();
+    /**
+     * @brief Read the index header and parse the entries on a background thread
+     *
+     * The index is parsed in streaming mode, see SetStreamingIndex, or with SetLazyIndex only its first pass
+     * runs in the background. While it is loading only
+     * Find, OpenFile, GetLoadedFileCount and WaitIndex may be used, they wait for entries which are not parsed yet.
+     * Reading opened files before the index is finished needs an archive opened with thread_safety.
+     * @return false if the index header cannot be read
+     */
+    bool ReadIndexInBackground();
+    /**
+     * @brief Wait until a background index parse is finished
+     * @return false if it failed. Entries parsed before the failure stay available.
+     */
+    bool WaitIndex();
+    /**
+     * @brief Number of entries parsed so far. Safe while the index is loading.
+     */
+    size_t GetLoadedFileCount() const {
+        return loaded_count;
+    }
+    bool IsIndexLoading() const {
+        return index_loading;
+    }
+    /**
+     * @brief Parse the index while it is decompressed instead of decompressing it whole first. Must be called before ReadIndex.
+     *
+     * Chunks are read through a window holding one File chunk, so the decompressed index is never
+     * held in memory, and entries are added to the file table and path index one by one.
+     */
+    void SetStreamingIndex(bool streaming) {
+        streaming_index = streaming;
+    }
+    /// File table. Empty when compact or lazy index is enabled, use GetFileCount and GetFileEntry instead.
     std::vector<FileEntry> files;
+    /**
+     * @brief Store the file table in a CompactIndex instead of files. Must be called before ReadIndex.
+     */
+    void SetCompactIndex(bool compact) {
+        use_compact = compact;
+        if (compact) use_lazy = false;
+    }
+    bool IsCompactIndex() const {
+        return use_compact;
+    }
+    /**
+     * @brief Decode entries only when they are looked up or opened. Must be called before ReadIndex.
+     *
+     * ReadIndex keeps the decompressed index (or only maps it when it is stored uncompressed in a mapped archive)
+     * and only records where each File chunk is and the hash of its name. The entry is decoded by the first
+     * Find, GetFileName, GetFileEntry or open which needs it, from any thread. ListDirectory and
+     * LoadZstdDictionaries need all names and decode every entry. SetPathFlags rehashes the names from the
+     * index data without decoding entries, it must not be called while the first pass runs in the background.
+     * Replaces the compact index, the streaming parse and the index cache, which are not used in this mode.
+     */
+    void SetLazyIndex(bool lazy) {
+        use_lazy = lazy;
+        if (lazy) use_compact = false;
+    }
+    bool IsLazyIndex() const {
+        return use_lazy;
+    }
+    /**
+     * @brief Number of entries decoded so far by a lazy index
+     */
+    size_t GetDecodedFileCount() const {
+        return use_lazy ? lazy_index.GetDecodedCount() : GetFileCount();
+    }
+    /**
+     * @brief Use a sidecar index cache file. Must be called before ReadIndex.
+     *
+     * ReadIndex loads the cache if it matches the archive size, modification time and index checksum,
+     * otherwise it parses the index and rewrites the cache. Only available for archives opened from a file.
+     * @param path Path of the cache file. Empty to disable.
+     */
+    void SetIndexCache(std::string path) {
+        index_cache_path = std::move(path);
+    }
+    /**
+     * @brief Whether the last ReadIndex was served from the index cache
+     */
+    bool IsIndexFromCache() const {
+        return index_from_cache;
+    }
+    const CompactIndex& GetCompactIndex() const {
+        return compact_index;
+    }
+    size_t GetFileCount() const {
+        return use_compact ? compact_index.size() : use_lazy ? lazy_index.size() : files.size();
+    }
+    std::string_view GetFileName(size_t index) const {
+        return use_compact ? compact_index.GetName(index) : std::string_view(GetEntryRef(index).filename);
+    }
+    FileEntry GetFileEntry(size_t index) const {
+        return use_compact ? compact_index.ToFileEntry(index) : GetEntryRef(index);
+    }
+    /**
+     * @brief Approximate heap memory used by the file table and path index
+     */
+    size_t GetIndexMemoryUsage() const;
     Xp3File* OpenFile(size_t index);
     Xp3File* OpenFile(FileEntry entry);
+    /**
+     * @brief Open a file by path
+     * @return nullptr if not found
+     */
+    Xp3File* OpenFile(std::string_view path);
+    /**
+     * @brief Read a whole file without opening a stream
+     * @param index Index of the file
+     * @param data Resized to the original size of the file
+     */
+    bool ReadAll(size_t index, std::vector<uint8_t>& data);
+    /**
+     * @brief Read a whole file into dst
+     * @param size Size of dst, must be at least the original size of the file
+     */
+    bool ReadInto(size_t index, uint8_t* dst, size_t size);
+    /**
+     * @brief Read several whole files in one pass
+     *
+     * Segments of all files are read in archive order. Adjacent segments are merged into one read
+     * and stored segments are read directly into the destinations. Safe to call from multiple threads.
+     * @return true if every request succeeded. Each request's ok tells which one failed.
+     */
+    bool ReadMany(Xp3ReadRequest* requests, size_t count);
+    bool ReadMany(std::vector<Xp3ReadRequest>& requests) {
+        return ReadMany(requests.data(), requests.size());
+    }
+    /**
+     * @brief Start the threads used by ReadParallel
+     * @param threads Number of helper threads. 0 to use the number of hardware threads.
+     */
+    void EnableParallelDecode(size_t threads = 0);
+    /**
+     * @brief Read a whole file, decoding its segments on several threads
+     *
+     * Segments are grouped into tasks which decode straight into their final offset in dst.
+     * The calling thread takes tasks too. Without EnableParallelDecode the file is read on the calling thread.
+     * @param size Size of dst, must be at least the original size of the file
+     * @param verify Also check the adler32 of the file, combined from per-segment checksums
+     */
+    bool ReadParallel(size_t index, uint8_t* dst, size_t size, bool verify = false);
+    bool ReadParallel(size_t index, std::vector<uint8_t>& data, bool verify = false);
+    /**
+     * @brief Find a file by path using the hash index built by ReadIndex
+     *
+     * While the index is loading in the background, waits until the path is parsed or the index is finished.
+     * A later entry with the same path then does not override the one found.
+     * @param path Path of the file. Matching depends on SetPathFlags.
+     * @param index Set to the index in files if found
+     */
+    bool Find(std::string_view path, size_t& index);
+    /**
+     * @brief Set how paths are matched by Find, OpenFile and ListDirectory. Must not be called while the index is loading.
+     * @param flags XP3_PATH_* flags
+     */
+    void SetPathFlags(uint32_t flags);
+    /**
+     * @brief List a directory. The tree is built on first call.
+     * @param dir Directory path, "" for root
+     * @param node Set to a copy of the directory, which stays valid when the index or path flags change.
+     * Subdirectory names are normalized with path flags.
+     * @return false if the directory does not exist
+     */
+    bool ListDirectory(std::string_view dir, DirectoryTree::Node& node);
+    /**
+     * @brief Record inflate checkpoints so seeks inside zlib segments resume from a nearby checkpoint
+     *
+     * Checkpoints are recorded while segments are decoded. Must be called before opening files.
+     * @param interval Distance in decompressed bytes between checkpoints
+     * @param memory_limit Maximum memory used by checkpoints of all segments. Each checkpoint uses about 32 KiB.
+     */
+    void EnableInflateCheckpoints(uint64_t interval = 1 << 20, size_t memory_limit = 64 << 20);
+    /**
+     * @brief Decode a file once to record all of its inflate checkpoints
+     */
+    bool BuildInflateCheckpoints(size_t index);
+    /**
+     * @brief Share decompressed segments between files and opens
+     *
+     * Compressed segments not larger than max_segment_size are decoded once and kept in a LRU cache. Must be called before opening files.
+     * @param byte_budget Maximum bytes of decompressed data kept
+     * @param max_segment_size Larger segments are streamed as before
+     */
+    void EnableSegmentCache(size_t byte_budget = 32 << 20, size_t max_segment_size = 1 << 20);
+    bool GetSegmentCacheStats(SegmentCache::Stats& stats);
+    /**
+     * @brief Get the decompressed data of a segment, from the segment cache if enabled
+     * @return nullptr on error
+     */
+    SegmentBuffer GetSegmentData(const Segment& seg);
+    /**
+     * @brief Read ahead when files are read sequentially. Must be called before opening files.
+     * @param max_window Maximum read-ahead window per file
+     */
+    void EnableReadAhead(size_t max_window = 1 << 20) {
+        read_ahead = max_window;
+    }
+    /**
+     * @brief Start background threads used by Prefetch
+     *
+     * Must be called after EnableSegmentCache and EnableStats, the prefetcher keeps the cache and reader they set up.
+     * @param threads Number of worker threads
+     */
+    void EnablePrefetch(size_t threads = 1);
+    /**
+     * @brief Warm files on background threads before they are opened
+     *
+     * Segments are read in archive order. EnablePrefetch must be called first.
+     * @param indexes Indexes of the files
+     * @param decompress Also decompress segments into the segment cache (needs EnableSegmentCache)
+     */
+    bool Prefetch(const std::vector<size_t>& indexes, bool decompress = false);
+    /**
+     * @brief Drop queued prefetch work, e.g. when the next scene changes
+     */
+    void CancelPrefetch();
+    /**
+     * @brief Wait until all queued prefetch work is done
+     */
+    void WaitPrefetch();
+    bool GetPrefetchStats(Prefetcher::Stats& stats);
+    /**
+     * @brief Start the asynchronous read engine used by ReadAsync
+     *
+     * io_uring is used on Linux when the archive was opened from a file name and the kernel allows it,
+     * otherwise a pool of threads doing pread.
+     * @param queue_depth Maximum number of segment reads in flight
+     * @param workers Number of decompression threads. 0 to use the number of hardware threads.
+     */
+    void EnableAsyncIo(size_t queue_depth = 64, size_t workers = 0);
+    bool IsAsyncIoUring() const {
+        return async_reader && async_reader->UsesIoUring();
+    }
+    /**
+     * @brief Read a whole file without blocking
+     * @param index Index of the file
+     * @param dst Receives the file, must stay valid until the callback
+     * @param size Size of dst, must be at least the original size of the file
+     * @param callback Called on an internal thread when the file is read and decompressed
+     * @return false if EnableAsyncIo was not called or dst is too small. The callback is not called then.
+     */
+    bool ReadAsync(size_t index, uint8_t* dst, size_t size, AsyncReadCallback callback);
+    /**
+     * @brief Read a whole file without blocking
+     * @return Future set to whether the read succeeded
+     */
+    std::future<bool> ReadAsync(size_t index, uint8_t* dst, size_t size);
+    /**
+     * @brief Wait until all asynchronous reads are finished
+     */
+    void WaitAsync();
+    /**
+     * @brief Register the zstd dictionaries stored in the archive as files ending with ZSTD_DICTIONARY_EXTENSION
+     * @return Number of dictionaries registered
+     */
+    size_t LoadZstdDictionaries();
+    /**
+     * @brief Record file opens, reads and seeks. Off by default.
+     *
+     * Must be called before opening files, and not while other threads open or read files, which copy the trace without a lock.
+     * Covers files opened after this call and ReadAll/ReadInto/ReadMany, which are recorded as an open and a whole read.
+     * @param trace Receives the events, nullptr to stop recording
+     */
+    void SetAccessTrace(std::shared_ptr<AccessTrace> trace) {
+        access_trace = std::move(trace);
+    }
+    /**
+     * @brief Count I/O, decoding and latencies of this archive and the files opened from it
+     *
+     * Must be called before opening files, EnablePrefetch and EnableAsyncIo. Reads done by io_uring are not counted.
+     * @param mode XP3_STATS_PER_THREAD avoids contention between threads, XP3_STATS_ATOMIC uses less memory
+     * @return false if built without stats (meson option stats)
+     */
+    bool EnableStats(Xp3StatsMode mode = XP3_STATS_PER_THREAD);
+    /**
+     * @return false if EnableStats was not called
+     */
+    bool GetStats(Xp3Stats::Snapshot& snapshot);
+    void ResetStats();
     uint32_t GetMinorVersion() const {
         return minor_version;
     }
+    /**
+     * @brief Get file content without copying
+     * @param index Index of the file
+     * @param data Set to the content inside the memory mapping
+     * @param size Set to the size of the content
+     * @return false if the archive is not memory mapped or the file is not a single stored (uncompressed) segment
+     */
+    bool GetFileView(size_t index, const uint8_t*& data, uint64_t& size);
+    bool GetFileView(const FileEntry& entry, const uint8_t*& data, uint64_t& size);
+    bool IsMapped() {
+        return reader->map(0, 0) != nullptr;
+    }
 private:
-    bool ReadFileEntry(MemReadStream& stream);
+    /// Where the index is stored, read from the archive header
+    struct IndexLocation {
+        uint64_t offset;
+        uint8_t encode_method;
+        uint64_t data_offset; // start of the stored (maybe compressed) index data
+        uint64_t stored_size;
+        uint64_t original_size; // 0 if not compressed or unknown
+    };
+    bool ReadIndexHeader(IndexLocation& location);
+    bool ReadFileEntry(const uint8_t* data, size_t size);
+    bool ParseIndex(const uint8_t* data, size_t size);
+    bool LoadIndexCache(const IndexCacheKey& key);
+    void SaveIndexCache(const IndexCacheKey& key);
+    bool StartIndexStream(const IndexLocation& location, bool background);
+    bool FinishIndexStream(const IndexLocation& location, bool use_cache, const IndexCacheKey& key);
+    bool ParseIndexStream(ReadStream* source, uint64_t size);
+    bool FindLoading(std::string_view path, size_t& index);
+    bool StartLazyIndex(const IndexLocation& location, bool background);
+    bool FinishLazyIndex(const IndexLocation& location);
+    bool ReadLazyIndex(const IndexLocation& location, LazyIndex& index, PathIndex& paths);
+    /// Entry of files or lazy_index, not for compact index
+    const FileEntry& GetEntryRef(size_t index) const {
+        return use_lazy ? lazy_index.Get(index) : files[index];
+    }
+    bool GetSegmentsView(const Segment* segs, size_t count, uint64_t original_size, const uint8_t*& data, uint64_t& size);
+    void BuildPathIndex();
     ReadStream* stream;
     uint32_t minor_version = 0;
     bool thread_safety;
+    // Guards stream when it is shared with StreamPositionalReader
     std::shared_ptr<std::mutex> mutex;
+    std::shared_ptr<PositionalReader> reader;
+    // Empty if opened from a stream
+    std::string filename;
+    std::string index_cache_path;
+    bool index_from_cache = false;
+    bool use_compact = false;
+    bool streaming_index = false;
+    bool use_lazy = false;
+    // Set while a streaming parse may still add entries. Entries are added with index_mutex held exclusively.
+    std::atomic<bool> index_loading{false};
+    std::atomic<bool> index_cancel{false};
+    std::atomic<bool> index_failed{false};
+    std::atomic<size_t> loaded_count{0};
+    std::shared_mutex index_mutex;
+    std::condition_variable_any index_cv;
+    std::thread index_thread;
+    std::mutex index_thread_mutex;
+    CompactIndex compact_index;
+    LazyIndex lazy_index;
+    // Reused for name conversion on Windows
+    std::string name_buffer;
+    std::shared_ptr<InflateIndexCache> checkpoints;
+    std::shared_ptr<SegmentCache> segment_cache;
+    size_t read_ahead = 0;
+    std::unique_ptr<Prefetcher> prefetcher;
+    std::unique_ptr<AsyncReader> async_reader;
+    std::unique_ptr<ThreadPool> decode_pool;
+    std::shared_ptr<AccessTrace> access_trace;
+#if HAVE_STATS
+    std::shared_ptr<Xp3Stats> stats;
+#endif
+    uint32_t path_flags = 0;
+    PathIndex path_index;
+    DirectoryTree dir_tree;
+    std::mutex dir_tree_mutex;
 };
@@ -0,0 +1,435 @@
+#include "xp3_writer.h"
+#include "fileop.h"
+#include "thread_pool.h"
+#include "wchar_util.h"
+#include "encoding.h"
+#include "zlib.h"
+#if HAVE_ZSTD
+#include "zstd.h"
+#endif
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+
+// Segments are never larger than this, compressBound and the zlib stream sizes are 32 bit
+inline const uint64_t XP3_WRITER_MAX_SEGMENT = 1 << 30;
+
+struct Xp3Writer::Job {
+    // Whole file content, shared by the segments of the file
+    std::shared_ptr<const std::vector<uint8_t>> data;
+    size_t offset;
+    size_t size;
+    // Filled by commit
+    Segment* segment;
+    // Compressed data, empty when the segment is stored
+    std::vector<uint8_t> packed;
+    SegmentKey key;
+    // An earlier job had the same key, so the segment was not compressed
+    bool duplicate = false;
+    bool ok = true;
+    bool done = false;
+    const uint8_t* raw() const {
+        return data->data() + offset;
+    }
+};
+
+static void put_u16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back((uint8_t)value);
+    out.push_back((uint8_t)(value >> 8));
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back((uint8_t)(value >> (i * 8)));
+}
+
+static void put_chunk(std::vector<uint8_t>& out, const char* name, const std::vector<uint8_t>& body) {
+    out.insert(out.end(), name, name + 4);
+    put_u64(out, body.size());
+    out.insert(out.end(), body.begin(), body.end());
+}
+
+static bool read_local_file(const std::string& path, std::vector<uint8_t>& data) {
+    FILE* fp = fileop::fopen(path, "rb");
+    if (!fp) return false;
+    data.clear();
+    uint8_t buffer[65536];
+    size_t r;
+    while ((r = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + r);
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    return !failed;
+}
+
+static bool encode_name(const std::string& name, std::vector<uint8_t>& out) {
+#if _WIN32
+    std::wstring wname;
+    if (!wchar_util::str_to_wstr(wname, name, 65001)) return false;
+    if (wname.size() > UINT16_MAX) return false;
+    put_u16(out, (uint16_t)wname.size());
+    for (wchar_t c : wname) {
+        put_u16(out, (uint16_t)c);
+    }
+#else
+    std::string wname;
+    if (!encoding::convert(name, wname, "UTF-8", "UTF-16LE")) return false;
+    if (wname.size() / 2 > UINT16_MAX) return false;
+    put_u16(out, (uint16_t)(wname.size() / 2));
+    out.insert(out.end(), wname.begin(), wname.end());
+#endif
+    return true;
+}
+
+static inline uint64_t hash_mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// 64 bit content hash, paired with crc32 and the size it identifies segments for deduplication
+static uint64_t hash_segment(const uint8_t* data, size_t size) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        h = (h ^ hash_mix(v)) * 0x9FB21C651E98DF25ULL;
+        h = (h << 29) | (h >> 35);
+    }
+    uint64_t tail = 0;
+    if (size > i) {
+        memcpy(&tail, data + i, size - i);
+    }
+    return hash_mix(h ^ hash_mix(tail ^ (size - i)));
+}
+
+static bool compress_segment(const Xp3WriterOptions& options, const uint8_t* data, size_t size, std::vector<uint8_t>& packed) {
+    packed.clear();
+    if (size == 0 || options.compression == Xp3Compression::Store) return true;
+#if HAVE_ZSTD
+    if (options.compression == Xp3Compression::Zstd) {
+        static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        if (!cctx) return false;
+        packed.resize(ZSTD_compressBound(size));
+        size_t r = ZSTD_compressCCtx(cctx.get(), packed.data(), packed.size(), data, size, options.level);
+        if (ZSTD_isError(r)) {
+            printf("ZSTD_compress failed: %s\n", ZSTD_getErrorName(r));
+            return false;
+        }
+        packed.resize(r);
+    } else
+#endif
+    {
+        uLongf dest_len = compressBound((uLong)size);
+        packed.resize(dest_len);
+        if (compress2(packed.data(), &dest_len, data, (uLong)size, options.level ? options.level : Z_DEFAULT_COMPRESSION) != Z_OK) {
+            printf("compress2 failed\n");
+            return false;
+        }
+        packed.resize(dest_len);
+    }
+    if (packed.size() >= size) {
+        // Incompressible, store it
+        packed.clear();
+        packed.shrink_to_fit();
+    }
+    return true;
+}
+
+Xp3Writer::Xp3Writer(Xp3WriterOptions options): options(options) {}
+
+Xp3Writer::~Xp3Writer() {
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+void Xp3Writer::AddFile(std::string name, Xp3FileSource source) {
+    Entry entry;
+    entry.name = std::move(name);
+    entry.source = std::move(source);
+    entries.push_back(std::move(entry));
+}
+
+void Xp3Writer::AddFile(std::string name, std::vector<uint8_t> data) {
+    auto content = std::make_shared<std::vector<uint8_t>>(std::move(data));
+    AddFile(std::move(name), [content](std::vector<uint8_t>& data) {
+        data.swap(*content);
+        return true;
+    });
+}
+
+void Xp3Writer::AddLocalFile(std::string name, std::string path) {
+    AddFile(std::move(name), [path](std::vector<uint8_t>& data) {
+        return read_local_file(path, data);
+    });
+}
+
+bool Xp3Writer::SetDataOrder(std::vector<size_t> order) {
+    if (order.size() != entries.size()) return false;
+    std::vector<bool> seen(entries.size());
+    for (auto index : order) {
+        if (index >= entries.size() || seen[index]) return false;
+        seen[index] = true;
+    }
+    data_order = std::move(order);
+    return true;
+}
+
+bool Xp3Writer::write_header() {
+    std::vector<uint8_t> header(XP3_MAGIC, XP3_MAGIC + 11);
+    put_u64(header, TVP_XP3_CURRENT_HEADER_VERSION);
+    put_u32(header, 1);
+    header.push_back(TVP_XP3_INDEX_CONTINUE);
+    put_u64(header, 0);
+    // Index offset, patched by write_index
+    put_u64(header, 0);
+    offset = header.size();
+    return fwrite(header.data(), 1, header.size(), fp) == header.size();
+}
+
+bool Xp3Writer::same_content(const Segment& seg, const uint8_t* data, bool& same) {
+    same = false;
+    if (seg.start + seg.packed_size > flushed) {
+        if (fflush(fp)) return false;
+        flushed = offset;
+    }
+    std::vector<uint8_t> packed((size_t)seg.packed_size);
+    if (readback->pread(packed.data(), packed.size(), seg.start) != packed.size()) {
+        return false;
+    }
+    if (seg.flag == TVP_XP3_SEGM_ENCODE_RAW) {
+        same = !memcmp(packed.data(), data, packed.size());
+        return true;
+    }
+    std::vector<uint8_t> decoded((size_t)seg.original_size);
+#if HAVE_ZSTD
+    if (options.compression == Xp3Compression::Zstd) {
+        size_t r = ZSTD_decompress(decoded.data(), decoded.size(), packed.data(), packed.size());
+        same = !ZSTD_isError(r) && r == decoded.size() && !memcmp(decoded.data(), data, decoded.size());
+        return true;
+    }
+#endif
+    uLongf dest_len = (uLongf)decoded.size();
+    if (uncompress(decoded.data(), &dest_len, packed.data(), (uLong)packed.size()) != Z_OK) {
+        return true;
+    }
+    same = dest_len == decoded.size() && !memcmp(decoded.data(), data, decoded.size());
+    return true;
+}
+
+bool Xp3Writer::commit(Job& job) {
+    Segment& seg = *job.segment;
+    if (options.deduplicate) {
+        auto it = written.find(job.key);
+        bool same = false;
+        if (it != written.end() && !same_content(it->second, job.raw(), same)) {
+            return false;
+        }
+        if (same) {
+            seg = it->second;
+            stats.segments++;
+            stats.shared_segments++;
+            return true;
+        }
+        if (job.duplicate) {
+            // The job which claimed the key comes later in data order, or its content differs
+            if (!compress_segment(options, job.raw(), job.size, job.packed)) {
+                return false;
+            }
+        }
+    }
+    bool stored = job.packed.empty();
+    const uint8_t* out = stored ? job.raw() : job.packed.data();
+    size_t out_size = stored ? job.size : job.packed.size();
+    seg.flag = stored ? TVP_XP3_SEGM_ENCODE_RAW : TVP_XP3_SEGM_ENCODE_ZLIB;
+    seg.start = offset;
+    seg.original_size = job.size;
+    seg.packed_size = out_size;
+    if (out_size && fwrite(out, 1, out_size, fp) != out_size) {
+        return false;
+    }
+    offset += out_size;
+    stats.segments++;
+    stats.written_bytes += out_size;
+    if (options.deduplicate) {
+        written.emplace(job.key, seg);
+    }
+    return true;
+}
+
+bool Xp3Writer::write_index() {
+    std::vector<uint8_t> index;
+    for (auto& entry: entries) {
+        std::vector<uint8_t> info, segm, adlr, file;
+        uint64_t packed_size = 0;
+        for (auto& seg: entry.segments) {
+            packed_size += seg.packed_size;
+        }
+        put_u32(info, 0);
+        put_u64(info, entry.original_size);
+        put_u64(info, packed_size);
+        if (!encode_name(entry.name, info)) {
+            printf("Invalid file name %s\n", entry.name.c_str());
+            return false;
+        }
+        for (auto& seg: entry.segments) {
+            put_u32(segm, seg.flag);
+            put_u64(segm, seg.start);
+            put_u64(segm, seg.original_size);
+            put_u64(segm, seg.packed_size);
+        }
+        put_u32(adlr, entry.adler);
+        put_chunk(file, CHUNK_INFO, info);
+        put_chunk(file, CHUNK_SEGM, segm);
+        put_chunk(file, CHUNK_ADLR, adlr);
+        put_chunk(index, CHUNK_FILE, file);
+    }
+    uLongf dest_len = compressBound((uLong)index.size());
+    std::vector<uint8_t> packed(dest_len);
+    if (compress2(packed.data(), &dest_len, index.data(), (uLong)index.size(), Z_BEST_COMPRESSION) != Z_OK) {
+        printf("compress2 failed\n");
+        return false;
+    }
+    std::vector<uint8_t> header;
+    header.push_back(TVP_XP3_INDEX_ENCODE_ZLIB);
+    put_u64(header, dest_len);
+    put_u64(header, index.size());
+    uint64_t index_offset = offset;
+    if (fwrite(header.data(), 1, header.size(), fp) != header.size() || fwrite(packed.data(), 1, dest_len, fp) != dest_len) {
+        return false;
+    }
+    stats.index_bytes = dest_len;
+    std::vector<uint8_t> offset_bytes;
+    put_u64(offset_bytes, index_offset);
+    // Patch the index offset after the continue header
+    return !fseek(fp, 32, SEEK_SET) && fwrite(offset_bytes.data(), 1, 8, fp) == 8;
+}
+
+bool Xp3Writer::Finish(const std::string& path) {
+#if !HAVE_ZSTD
+    if (options.compression == Xp3Compression::Zstd) {
+        printf("zstd support is not enabled\n");
+        return false;
+    }
+#endif
+    fp = fileop::fopen(path, "wb");
+    if (!fp) {
+        printf("Failed to create %s\n", path.c_str());
+        return false;
+    }
+    if (options.deduplicate) {
+        // Deduplication compares segments with the written ones
+        readback.reset(new FilePositionalReader(path.c_str()));
+        if (!readback->is_open()) {
+            printf("Failed to open %s for reading\n", path.c_str());
+            readback.reset();
+            fclose(fp);
+            fp = nullptr;
+            return false;
+        }
+        flushed = 0;
+    }
+    stats = {};
+    written.clear();
+    bool ok = write_header();
+    uint64_t segment_size = options.segment_size ? std::min(options.segment_size, XP3_WRITER_MAX_SEGMENT) : XP3_WRITER_MAX_SEGMENT;
+    std::vector<size_t> order = data_order;
+    if (order.empty()) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            order.push_back(i);
+        }
+    }
+    {
+        // Jobs in data order, committed from the front
+        std::deque<std::unique_ptr<Job>> queue;
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        // Keys of the segments compressed so far, guarded by mutex
+        std::unordered_set<SegmentKey, SegmentKeyHash> claimed;
+        // Declared last so workers stop before the members they use are destroyed
+        ThreadPool pool(options.threads);
+        // Bounds the file data held in memory
+        size_t window = pool.Size() * 4;
+        auto commit_front = [&]() {
+            Job* job = queue.front().get();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done_cv.wait(lock, [job] { return job->done; });
+            }
+            bool committed = ok && job->ok && commit(*job);
+            queue.pop_front();
+            return committed;
+        };
+        for (size_t n = 0; ok && n < order.size(); n++) {
+            Entry& entry = entries[order[n]];
+            auto data = std::make_shared<std::vector<uint8_t>>();
+            if (!entry.source(*data)) {
+                printf("Failed to read %s\n", entry.name.c_str());
+                ok = false;
+                break;
+            }
+            entry.source = nullptr;
+            size_t size = data->size();
+            entry.original_size = size;
+            uLong adler = adler32(0, nullptr, 0);
+            for (size_t pos = 0; pos < size; pos += XP3_WRITER_MAX_SEGMENT) {
+                adler = adler32(adler, data->data() + pos, (uInt)std::min<uint64_t>(size - pos, XP3_WRITER_MAX_SEGMENT));
+            }
+            entry.adler = (uint32_t)adler;
+            stats.files++;
+            stats.original_bytes += size;
+            size_t count = size ? (size_t)((size + segment_size - 1) / segment_size) : 1;
+            entry.segments.assign(count, Segment());
+            for (size_t i = 0; i < count; i++) {
+                std::unique_ptr<Job> job(new Job());
+                job->data = data;
+                job->offset = (size_t)(i * segment_size);
+                job->size = (size_t)std::min<uint64_t>(segment_size, size - job->offset);
+                job->segment = &entry.segments[i];
+                Job* raw = job.get();
+                queue.push_back(std::move(job));
+                pool.Submit([this, raw, &mutex, &done_cv, &claimed] {
+                    if (options.deduplicate) {
+                        raw->key = { raw->size, hash_segment(raw->raw(), raw->size), (uint32_t)crc32(crc32(0, nullptr, 0), raw->raw(), (uInt)raw->size) };
+                        std::lock_guard<std::mutex> guard(mutex);
+                        raw->duplicate = !claimed.insert(raw->key).second;
+                    }
+                    if (!raw->duplicate) {
+                        raw->ok = compress_segment(options, raw->raw(), raw->size, raw->packed);
+                    }
+                    std::lock_guard<std::mutex> guard(mutex);
+                    raw->done = true;
+                    done_cv.notify_all();
+                });
+                while (ok && queue.size() >= window) {
+                    ok = commit_front();
+                }
+            }
+        }
+        // Drain even after a failure, queued tasks point into the jobs
+        while (!queue.empty()) {
+            bool committed = commit_front();
+            ok = ok && committed;
+        }
+    }
+    ok = ok && write_index();
+    readback.reset();
+    if (fclose(fp)) ok = false;
+    fp = nullptr;
+    if (!ok) {
+        printf("Failed to write %s\n", path.c_str());
+    }
+    return ok;
+}
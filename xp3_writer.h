@@ -0,0 +1,120 @@
+#pragma once
+#include "xp3.h"
+#include "xp3vfs_config.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class Xp3Compression {
+    Store,
+    Zlib,
+    Zstd,
+};
+
+struct Xp3WriterOptions {
+    Xp3Compression compression = Xp3Compression::Zlib;
+    /// Compression level, 0 for the default level of the method
+    int level = 0;
+    /// Files larger than this are split into segments of this size. 0 to keep one segment per file.
+    uint64_t segment_size = 1 << 20;
+    /// Number of compression threads. 0 to use the number of hardware threads.
+    size_t threads = 0;
+    /// Store identical segments once and share them between entries
+    bool deduplicate = true;
+};
+
+/**
+ * @brief Loads the content of a file added to Xp3Writer
+ * @return false on failure
+ */
+typedef std::function<bool(std::vector<uint8_t>& data)> Xp3FileSource;
+
+/**
+ * @brief Writes XP3 archives with File/info/segm/adlr chunks and a zlib compressed index
+ *
+ * Files are loaded one at a time in Finish, their segments are compressed on a thread pool
+ * and written in order, so the output does not depend on the number of threads.
+ * Segments which do not shrink are stored. zstd segments use the zlib flag like the reader expects.
+ */
+class Xp3Writer {
+public:
+    struct Stats {
+        uint64_t files;
+        uint64_t segments; // segments referenced by the index
+        uint64_t shared_segments; // segments stored once and referenced again
+        uint64_t original_bytes; // total size of the added files
+        uint64_t written_bytes; // segment data written
+        uint64_t index_bytes; // compressed index size
+    };
+    Xp3Writer(Xp3WriterOptions options = Xp3WriterOptions());
+    Xp3Writer(const Xp3Writer&) = delete;
+    Xp3Writer& operator=(const Xp3Writer&) = delete;
+    ~Xp3Writer();
+    /**
+     * @brief Add a file, loaded when Finish reaches it
+     * @param name Path inside the archive (UTF-8, / as separator)
+     */
+    void AddFile(std::string name, Xp3FileSource source);
+    void AddFile(std::string name, std::vector<uint8_t> data);
+    /**
+     * @brief Add a file from the local file system
+     */
+    void AddLocalFile(std::string name, std::string path);
+    size_t GetFileCount() const {
+        return entries.size();
+    }
+    /**
+     * @brief Set the order in which file data is written, the index keeps the order files were added
+     * @param order Indexes of added files, each exactly once
+     * @return false if order is not a permutation of the added files
+     */
+    bool SetDataOrder(std::vector<size_t> order);
+    /**
+     * @brief Write the archive
+     * @return false on failure, a partial file may be left behind
+     */
+    bool Finish(const std::string& path);
+    Stats GetStats() const {
+        return stats;
+    }
+private:
+    struct Entry {
+        std::string name;
+        Xp3FileSource source;
+        uint64_t original_size = 0;
+        uint32_t adler = 0;
+        std::vector<Segment> segments;
+    };
+    struct Job;
+    bool write_header();
+    bool commit(Job& job);
+    // Read back a written segment and compare it with data, which has seg.original_size bytes
+    bool same_content(const Segment& seg, const uint8_t* data, bool& same);
+    bool write_index();
+    Xp3WriterOptions options;
+    std::vector<Entry> entries;
+    std::vector<size_t> data_order;
+    // Finds segments which may be identical, the bytes are compared before one is shared
+    struct SegmentKey {
+        uint64_t original_size;
+        uint64_t hash;
+        uint32_t crc;
+        bool operator==(const SegmentKey& other) const {
+            return original_size == other.original_size && hash == other.hash && crc == other.crc;
+        }
+    };
+    struct SegmentKeyHash {
+        size_t operator()(const SegmentKey& key) const {
+            return (size_t)(key.hash ^ key.crc);
+        }
+    };
+    FILE* fp = nullptr;
+    uint64_t offset = 0;
+    // Reads back the output for same_content, everything before flushed is visible to it
+    std::unique_ptr<FilePositionalReader> readback;
+    uint64_t flushed = 0;
+    std::unordered_map<SegmentKey, Segment, SegmentKeyHash> written;
+    Stats stats = {};
+};